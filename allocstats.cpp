@@ -0,0 +1,104 @@
+#include "allocstats.hpp"
+
+#ifdef UMUSD_ALLOC_STATS
+#include "config.hpp"
+#include "utils.hpp"
+
+#include <atomic>
+#include <new>
+#include <cstdlib>
+
+namespace
+{
+   std::atomic<unsigned long> total_allocs(0), playback_allocs(0), steady_allocs(0);
+   std::atomic<bool> steady(false);
+   thread_local bool in_playback = false;
+
+   float warmup_left = 0.0f;
+   float steady_seconds = 0.0f;
+
+   // Blocks in steady state that allocated, and when the first one played.
+   unsigned long seen_allocs = 0;
+   std::atomic<unsigned long> violations(0);
+   float first_violation = -1.0f;
+
+   enum { warmup_seconds = 1 };
+
+   void *counted_alloc(std::size_t size)
+   {
+      total_allocs++;
+      if (in_playback)
+      {
+         playback_allocs++;
+         if (steady)
+            steady_allocs++;
+      }
+
+      void *ptr = std::malloc(size ? size : 1);
+      if (!ptr)
+         throw std::bad_alloc();
+      return ptr;
+   }
+}
+
+void *operator new(std::size_t size) { return counted_alloc(size); }
+void *operator new[](std::size_t size) { return counted_alloc(size); }
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete[](void *ptr) noexcept { std::free(ptr); }
+
+AllocStats::Scope::Scope(bool counted) : prev(in_playback)
+{
+   in_playback = counted;
+}
+
+AllocStats::Scope::~Scope()
+{
+   in_playback = prev;
+}
+
+void AllocStats::warmup()
+{
+   steady = false;
+   warmup_left = warmup_seconds;
+}
+
+void AllocStats::played(float seconds)
+{
+   if (!steady)
+   {
+      warmup_left -= seconds;
+      if (warmup_left <= 0.0f)
+         steady = true;
+      return;
+   }
+
+   // Runs on the playback thread, so a violation is only noted for report().
+   unsigned long allocs = steady_allocs;
+   if (allocs != seen_allocs)
+   {
+      seen_allocs = allocs;
+      violations++;
+      if (first_violation < 0.0f)
+         first_violation = steady_seconds;
+   }
+
+   steady_seconds += seconds;
+}
+
+std::string AllocStats::report()
+{
+   std::string res = stringify("total=", total_allocs.load(),
+         " playback=", playback_allocs.load(),
+         " steady=", steady_allocs.load(),
+         " steady_seconds=", static_cast<int>(steady_seconds),
+         " per_second=", steady_seconds > 0.0f ? steady_allocs / steady_seconds : 0.0f);
+
+   // Strict runs turn any steady-state allocation into a failure for the caller to act on.
+   if (config().get_bool("alloc_strict", false) && violations)
+      res = stringify("ERROR ", res, " violations=", violations,
+            " first_violation_at=", first_violation);
+   return res;
+}
+
+#endif
+
@@ -0,0 +1,41 @@
+#ifndef ALLOCSTATS_HPP__
+#define ALLOCSTATS_HPP__
+
+#include <string>
+
+// Heap allocation accounting for the playback path.
+// Only compiled in with ALLOC_STATS=1, otherwise every call is a no-op.
+class AllocStats
+{
+   public:
+#ifdef UMUSD_ALLOC_STATS
+      // Marks the current thread as running playback code for its lifetime.
+      class Scope
+      {
+         public:
+            explicit Scope(bool counted = true);
+            ~Scope();
+            void operator=(const Scope &) = delete;
+
+         private:
+            bool prev;
+      };
+
+      static void warmup();
+      static void played(float seconds);
+      static std::string report();
+#else
+      class Scope
+      {
+         public:
+            explicit Scope(bool = true) {}
+      };
+
+      static void warmup() {}
+      static void played(float) {}
+      static std::string report() { return "DISABLED"; }
+#endif
+};
+
+#endif
+
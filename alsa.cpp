@@ -1,8 +1,37 @@
 #include "alsa.hpp"
-#include <stdexcept>
+#include "config.hpp"
+#include "allocstats.hpp"
+#include "utils.hpp"
+#include "ttfa.hpp"
+#include "trace.hpp"
 
-ALSA::ALSA() : pcm(nullptr)
-{}
+#include <stdexcept>
+#include <algorithm>
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+ALSA::ALSA()
+   : pcm(nullptr), period_size(0), buffer_size(0), frame_bytes(0), rate(0),
+   channels(0), fmt(FF::MediaInfo::Format::None),
+   can_pause(false), held(false), hw_paused(false),
+   space_fd(-1), data_fd(-1),
+   stopping(false), waiting(false), hungry(false), failed(false)
+{
+   stats.xruns = 0;
+   stats.wakeups = 0;
+   stats.jitter_sum = 0;
+   stats.jitter_max = 0;
+   stats.realtime = false;
+   stats.restart_start = 0;
+   stats.restart_us = 0;
+   stats.restart_path = "none";
+}
 
 ALSA::~ALSA()
 {
@@ -11,6 +40,8 @@ ALSA::~ALSA()
 
 void ALSA::stop()
 {
+   stop_thread();
+
    if (pcm)
    {
       snd_pcm_drop(pcm);
@@ -18,12 +49,23 @@ void ALSA::stop()
    }
 
    pcm = nullptr;
+   held = hw_paused = false;
+   open_dev.clear();
+
+   if (space_fd >= 0)
+      close(space_fd);
+   if (data_fd >= 0)
+      close(data_fd);
+   space_fd = data_fd = -1;
+
    fds.clear();
+   ring.clear();
+   clear_queue();
 }
 
 bool ALSA::active() const
 {
-   return pcm;
+   return pcm && !held;
 }
 
 std::string ALSA::default_device() const
@@ -36,15 +78,150 @@ std::string ALSA::default_device() const
       throw std::runtime_error(error); \
 }
 
+static snd_pcm_format_t alsa_format(FF::MediaInfo::Format fmt)
+{
+   switch (fmt)
+   {
+      case FF::MediaInfo::Format::U8:
+         return SND_PCM_FORMAT_U8;
+      case FF::MediaInfo::Format::S16:
+         return SND_PCM_FORMAT_S16;
+      case FF::MediaInfo::Format::S24:
+         return SND_PCM_FORMAT_S24_3LE;
+      case FF::MediaInfo::Format::S32:
+         return SND_PCM_FORMAT_S32;
+      case FF::MediaInfo::Format::Float:
+         return SND_PCM_FORMAT_FLOAT;
+      default:
+         return SND_PCM_FORMAT_UNKNOWN;
+   }
+}
+
+// From least to most precise.
+static const FF::MediaInfo::Format format_ranks[] = {
+   FF::MediaInfo::Format::U8,
+   FF::MediaInfo::Format::S16,
+   FF::MediaInfo::Format::S24,
+   FF::MediaInfo::Format::Float,
+   FF::MediaInfo::Format::S32,
+};
+
+bool ALSA::probe(const std::string &dev, Caps &caps)
+{
+   snd_pcm_t *probe;
+   if (snd_pcm_open(&probe, dev.c_str(), SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK) < 0)
+      return false;
+
+   caps = Caps{0, 0};
+   snd_pcm_hw_params_t *params;
+   snd_pcm_hw_params_alloca(&params);
+
+   if (snd_pcm_hw_params_any(probe, params) >= 0)
+   {
+      for (auto fmt : format_ranks)
+         if (snd_pcm_hw_params_test_format(probe, params, alsa_format(fmt)) == 0)
+            caps.formats |= 1u << static_cast<unsigned>(fmt);
+
+      for (unsigned channels = 1; channels < 32; channels++)
+         if (snd_pcm_hw_params_test_channels(probe, params, channels) == 0)
+            caps.channels |= 1u << channels;
+   }
+
+   snd_pcm_close(probe);
+   return caps.formats && caps.channels;
+}
+
+const ALSA::Caps *ALSA::capabilities(const std::string &dev)
+{
+   auto itr = caps.find(dev);
+   if (itr == std::end(caps))
+   {
+      // A busy device cannot be probed, it gets tried with whatever the track has.
+      Caps probed;
+      if (!probe(dev, probed))
+         return nullptr;
+      itr = caps.insert({dev, probed}).first;
+   }
+
+   return &itr->second;
+}
+
+unsigned ALSA::best_channels(unsigned channels, const std::string &dev)
+{
+   auto dev_caps = capabilities(dev);
+   if (!dev_caps || channels >= 32 || (dev_caps->channels & (1u << channels)))
+      return channels;
+
+   // Downmix to the widest layout the device has, upmix only when it must.
+   for (unsigned i = channels; i > 0; i--)
+      if (dev_caps->channels & (1u << i))
+         return i;
+
+   for (unsigned i = channels + 1; i < 32; i++)
+      if (dev_caps->channels & (1u << i))
+         return i;
+
+   return channels;
+}
+
+FF::MediaInfo::Format ALSA::best_format(FF::MediaInfo::Format fmt,
+      const std::string &dev)
+{
+   auto dev_caps = capabilities(dev);
+   if (!dev_caps)
+      return fmt;
+
+   unsigned mask = dev_caps->formats;
+   if (mask & (1u << static_cast<unsigned>(fmt)))
+      return fmt;
+
+   // Rather gain precision than lose it.
+   unsigned rank = 0;
+   unsigned count = sizeof(format_ranks) / sizeof(format_ranks[0]);
+   while (rank < count && format_ranks[rank] != fmt)
+      rank++;
+
+   for (unsigned i = rank + 1; i < count; i++)
+      if (mask & (1u << static_cast<unsigned>(format_ranks[i])))
+         return format_ranks[i];
+
+   for (unsigned i = std::min(rank, count); i > 0; i--)
+      if (mask & (1u << static_cast<unsigned>(format_ranks[i - 1])))
+         return format_ranks[i - 1];
+
+   return fmt;
+}
+
 void ALSA::init(unsigned channels, unsigned rate,
       FF::MediaInfo::Format fmt,
       const std::string &dev)
 {
+   std::int64_t start = monotonic_ns();
+
+   // Same device and format, restart the PCM that is already set up.
+   if (pcm && dev == open_dev && channels == this->channels &&
+         rate == this->rate && fmt == this->fmt)
+   {
+      stop_thread();
+      snd_pcm_drop(pcm);
+      if (snd_pcm_prepare(pcm) == 0)
+      {
+         held = hw_paused = false;
+         ring.clear();
+         clear_queue();
+
+         stats.restart_path = "reuse";
+         stats.restart_start = start;
+         start_thread();
+         return;
+      }
+   }
+
    stop();
 
    try
    {
-      TRY(snd_pcm_open(&pcm, dev.c_str(), SND_PCM_STREAM_PLAYBACK, 0),
+      TRY(snd_pcm_open(&pcm, dev.c_str(), SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK),
             "Failed to open device.\n");
 
       snd_pcm_hw_params_t *params;
@@ -57,25 +234,8 @@ void ALSA::init(unsigned channels, unsigned rate,
                SND_PCM_ACCESS_RW_INTERLEAVED),
             "Failed to set RW access.\n");
 
-      snd_pcm_format_t format;
-      switch (fmt)
-      {
-         case FF::MediaInfo::Format::S16:
-            format = SND_PCM_FORMAT_S16;
-            break;
-         case FF::MediaInfo::Format::S32:
-            format = SND_PCM_FORMAT_S32;
-            break;
-         case FF::MediaInfo::Format::Float:
-            format = SND_PCM_FORMAT_FLOAT;
-            break;
-         default:
-            format = SND_PCM_FORMAT_UNKNOWN;
-            break;
-      }
-
       TRY(snd_pcm_hw_params_set_format(pcm, params,
-               format),
+               alsa_format(fmt)),
             "Failed to set sample format.\n");
 
       TRY(snd_pcm_hw_params_set_channels(pcm, params,
@@ -85,21 +245,80 @@ void ALSA::init(unsigned channels, unsigned rate,
       TRY(snd_pcm_hw_params_set_rate(pcm, params, rate, 0),
             "Failed to set sampling rate.\n");
 
-      unsigned usec = 500000;
-      unsigned periods = 4;
-      TRY(snd_pcm_hw_params_set_buffer_time_near(pcm, params,
-               &usec, nullptr),
-            "Failed to set buffer time.\n");
+      // Ask for what the device settled on last time, rather than negotiating from scratch.
+      auto key = stringify(dev, " ", channels, " ", rate, " ", static_cast<unsigned>(fmt));
+      auto cached = negotiated.find(key);
+      if (cached != std::end(negotiated))
+      {
+         auto buffer = cached->second.buffer_size;
+         auto period = cached->second.period_size;
+         TRY(snd_pcm_hw_params_set_buffer_size_near(pcm, params, &buffer),
+               "Failed to set buffer size.\n");
 
-      TRY(snd_pcm_hw_params_set_periods_near(pcm, params,
-               &periods, nullptr),
-            "Failed to set periods.\n");
+         TRY(snd_pcm_hw_params_set_period_size_near(pcm, params, &period, nullptr),
+               "Failed to set period size.\n");
+      }
+      else
+      {
+         unsigned usec = config().get_int("alsa_buffer_ms", 500) * 1000;
+         unsigned periods = config().get_int("alsa_periods", 4);
+         TRY(snd_pcm_hw_params_set_buffer_time_near(pcm, params,
+                  &usec, nullptr),
+               "Failed to set buffer time.\n");
+
+         TRY(snd_pcm_hw_params_set_periods_near(pcm, params,
+                  &periods, nullptr),
+               "Failed to set periods.\n");
+      }
 
       TRY(snd_pcm_hw_params(pcm, params),
             "Failed to install params.\n");
 
-      fds.resize(snd_pcm_poll_descriptors_count(pcm));
-      snd_pcm_poll_descriptors(pcm, fds.data(), fds.size());
+      TRY(snd_pcm_hw_params_get_period_size(params, &period_size, nullptr),
+            "Failed to get period size.\n");
+
+      TRY(snd_pcm_hw_params_get_buffer_size(params, &buffer_size),
+            "Failed to get buffer size.\n");
+
+      can_pause = snd_pcm_hw_params_can_pause(params);
+      negotiated[key] = Negotiated{period_size, buffer_size};
+
+      snd_pcm_sw_params_t *sw_params;
+      snd_pcm_sw_params_alloca(&sw_params);
+
+      TRY(snd_pcm_sw_params_current(pcm, sw_params),
+            "Failed to get sw params.\n");
+
+      TRY(snd_pcm_sw_params_set_avail_min(pcm, sw_params, period_size),
+            "Failed to set avail_min.\n");
+
+      TRY(snd_pcm_sw_params_set_start_threshold(pcm, sw_params, period_size),
+            "Failed to set start threshold.\n");
+
+      TRY(snd_pcm_sw_params(pcm, sw_params),
+            "Failed to install sw params.\n");
+
+      this->rate = rate;
+      this->channels = channels;
+      this->fmt = fmt;
+      open_dev = dev;
+      frame_bytes = snd_pcm_frames_to_bytes(pcm, 1);
+      ring.resize(frame_bytes * rate / 4, frame_bytes);
+
+      space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      data_fd = eventfd(0, EFD_CLOEXEC);
+      if (space_fd < 0 || data_fd < 0)
+         throw std::runtime_error("Failed to create eventfd.\n");
+
+      // PCM descriptors, then the eventfd that interrupts the wait.
+      fds.resize(snd_pcm_poll_descriptors_count(pcm) + 1);
+      snd_pcm_poll_descriptors(pcm, fds.data(), fds.size() - 1);
+      fds.back().fd = data_fd;
+      fds.back().events = POLLIN;
+
+      stats.restart_path = "open";
+      stats.restart_start = start;
+      start_thread();
    }
    catch(...)
    {
@@ -108,59 +327,339 @@ void ALSA::init(unsigned channels, unsigned rate,
    }
 }
 
-void ALSA::write(const FF::Buffer &buf)
+bool ALSA::pause(bool enable)
 {
-   auto buffer = buf.data();
-   auto size = snd_pcm_bytes_to_frames(pcm, buf.size());
+   if (!pcm)
+      return false;
+   if (enable == held)
+      return true;
 
-   while (size)
+   if (enable)
    {
-      auto frames = snd_pcm_writei(pcm, buffer, size);
-      if (frames == -EPIPE || frames == -EINTR || frames == -ESTRPIPE)
+      stop_thread();
+
+      // A hardware pause keeps what is buffered, otherwise drop it and hold the set up PCM.
+      hw_paused = can_pause && snd_pcm_state(pcm) == SND_PCM_STATE_RUNNING &&
+         snd_pcm_pause(pcm, 1) == 0;
+      if (!hw_paused)
+         snd_pcm_drop(pcm);
+
+      held = true;
+      return true;
+   }
+
+   std::int64_t start = monotonic_ns();
+   held = false;
+
+   if (hw_paused && snd_pcm_pause(pcm, 0) == 0)
+   {
+      stats.restart_path = "pause";
+      stats.restart_us = (monotonic_ns() - start) / 1000;
+   }
+   else
+   {
+      snd_pcm_drop(pcm);
+      if (snd_pcm_prepare(pcm) < 0)
       {
-         if (snd_pcm_recover(pcm, frames, 1) < 0)
-            throw std::runtime_error("Failed to recover ALSA.\n");
+         stop();
+         return false;
       }
-      else if (frames < 0)
-         throw std::runtime_error("ALSA failed to write.\n");
 
-      buffer += snd_pcm_frames_to_bytes(pcm, frames);
-      size -= frames;
+      stats.restart_path = "hold";
+      stats.restart_start = start;
    }
+
+   hw_paused = false;
+   start_thread();
+   return true;
 }
 
-EventHandled::PollList ALSA::pollfds() const
+void ALSA::discard()
+{
+   Audio::discard();
+   if (!pcm)
+      return;
+
+   // Held, the thread is already stopped. Drop what a hardware pause kept, unpausing then starts afresh.
+   if (held)
+   {
+      ring.clear();
+      if (hw_paused)
+         snd_pcm_drop(pcm);
+      hw_paused = false;
+      return;
+   }
+
+   std::int64_t start = monotonic_ns();
+   stop_thread();
+   ring.clear();
+
+   snd_pcm_drop(pcm);
+   if (snd_pcm_prepare(pcm) < 0)
+   {
+      stop();
+      return;
+   }
+
+   stats.restart_path = "seek";
+   stats.restart_start = start;
+   start_thread();
+}
+
+bool ALSA::paused() const
+{
+   return pcm && held;
+}
+
+void ALSA::start_thread()
+{
+   stopping = false;
+   waiting = false;
+   failed = false;
+
+   // The ring starts out empty, ask the event loop to fill it.
+   hungry = true;
+   eventfd_write(space_fd, 1);
+
+   bool realtime = config().get_bool("rt", false);
+   if (realtime && !ring.lock())
+      std::cerr << "Failed to lock PCM ring in memory." << std::endl;
+
+   thread = std::thread(&ALSA::thread_loop, this);
+   set_scheduling();
+}
+
+void ALSA::stop_thread()
 {
-   EventHandled::PollList list;
-   for (auto fd : fds)
+   if (!thread.joinable())
+      return;
+
+   stopping = true;
+   eventfd_write(data_fd, 1);
+   thread.join();
+}
+
+void ALSA::set_scheduling()
+{
+   stats.realtime = false;
+
+   if (config().get_bool("rt", false))
    {
-      list.push_back({fd.fd,
-            (fd.events & POLLIN ? EPOLLIN : 0) |
-            (fd.events & POLLOUT ? EPOLLOUT : 0)});
+      int policy = config().get("rt_policy", "fifo") == "rr" ? SCHED_RR : SCHED_FIFO;
+
+      struct sched_param param{};
+      param.sched_priority = std::max(sched_get_priority_min(policy),
+            std::min(sched_get_priority_max(policy), config().get_int("rt_priority", 50)));
+
+      int err = pthread_setschedparam(thread.native_handle(), policy, &param);
+      if (err)
+         std::cerr << "Failed to enable real-time scheduling: " << strerror(err) << std::endl;
+      else
+         stats.realtime = true;
    }
 
-   return list;
+   auto cpus = config().get_list("rt_cpus");
+   if (!cpus.empty())
+   {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      for (auto cpu : cpus)
+         CPU_SET(cpu, &set);
+
+      int err = pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+      if (err)
+         std::cerr << "Failed to set output thread affinity: " << strerror(err) << std::endl;
+   }
 }
 
-void ALSA::handle(EventHandler &handler)
+bool ALSA::recover(int err)
+{
+   if (err == -EPIPE)
+      stats.xruns++;
+
+   if (snd_pcm_recover(pcm, err, 1) < 0)
+   {
+      failed = true;
+      eventfd_write(space_fd, 1);
+      return false;
+   }
+
+   return true;
+}
+
+// Runs on the output thread.
+// Everything touched here is preallocated, and nothing is logged or thrown.
+void ALSA::thread_loop()
+{
+   // A ring from an earlier output thread, before anything needs to be real-time.
+   Trace::prepare_thread();
+   AllocStats::Scope scope;
+
+   std::size_t low_water = ring.size() / 2;
+   std::int64_t period_ns = period_size * 1000000000ll / rate;
+   std::int64_t last = 0;
+   bool measure = false;
+
+   while (!stopping.load())
+   {
+      if (ring.read_avail() < frame_bytes)
+      {
+         waiting = true;
+         if (ring.read_avail() < frame_bytes && !stopping.load())
+         {
+            eventfd_t val;
+            eventfd_read(data_fd, &val);
+         }
+         waiting = false;
+
+         measure = false;
+         continue;
+      }
+
+      auto avail = snd_pcm_avail_update(pcm);
+      if (avail < 0)
+      {
+         if (!recover(avail))
+            return;
+
+         measure = false;
+         continue;
+      }
+
+      if (static_cast<snd_pcm_uframes_t>(avail) < period_size)
+      {
+         // avail_min is one period, so the device wakes us once per period.
+         for (auto &fd : fds)
+            fd.revents = 0;
+
+         if (poll(fds.data(), fds.size(), -1) < 0)
+            continue;
+
+         unsigned short revents;
+         snd_pcm_poll_descriptors_revents(pcm, fds.data(), fds.size() - 1, &revents);
+
+         if (fds.back().revents & POLLIN)
+         {
+            eventfd_t val;
+            eventfd_read(data_fd, &val);
+         }
+
+         std::int64_t now = monotonic_ns();
+         if (measure)
+         {
+            std::uint64_t jitter = std::abs(now - last - period_ns) / 1000;
+            stats.jitter_sum += jitter;
+            stats.wakeups++;
+            if (jitter > stats.jitter_max)
+               stats.jitter_max = jitter;
+         }
+
+         last = now;
+         measure = true;
+         continue;
+      }
+
+      // Write everything the device has room for, not just one period.
+      std::size_t frames = std::min<std::size_t>(avail, ring.read_avail() / frame_bytes);
+      while (frames)
+      {
+         const std::uint8_t *data;
+         std::size_t chunk = std::min(ring.peek(data) / frame_bytes, frames);
+         if (!chunk)
+            break;
+
+         snd_pcm_sframes_t written;
+         {
+            Trace::Span span("snd_pcm_writei");
+            written = snd_pcm_writei(pcm, data, chunk);
+         }
+         if (written == -EAGAIN)
+            break;
+         else if (written < 0)
+         {
+            if (!recover(written))
+               return;
+
+            measure = false;
+            break;
+         }
+
+         ring.consume(written * frame_bytes);
+         frames -= written;
+         TTFA::mark(TTFA::FirstWrite);
+
+         if (stats.restart_start.load() && snd_pcm_state(pcm) == SND_PCM_STATE_RUNNING)
+         {
+            std::int64_t start = stats.restart_start.exchange(0);
+            if (start)
+               stats.restart_us = (monotonic_ns() - start) / 1000;
+         }
+      }
+
+      if (ring.read_avail() < low_water && !hungry.exchange(true))
+         eventfd_write(space_fd, 1);
+   }
+}
+
+void ALSA::write(const std::uint8_t *data, std::size_t size)
 {
    if (!pcm)
       return;
 
-   for (auto &fd : fds)
-      fd.revents = 0;
+   ring.write(data, size);
+   if (waiting.exchange(false))
+      eventfd_write(data_fd, 1);
+}
 
-   if (poll(fds.data(), fds.size(), 0) < 0)
-      throw std::runtime_error("ALSA poll failed.");
+std::size_t ALSA::write_avail()
+{
+   if (!pcm)
+      return 0;
+
+   std::size_t avail = ring.write_avail();
+   return avail - avail % frame_bytes;
+}
 
-   unsigned short revents;
-   if (snd_pcm_poll_descriptors_revents(pcm, fds.data(),
-            fds.size(), &revents) < 0)
-      throw std::runtime_error("ALSA revents failed.\n");
+std::size_t ALSA::queued() const
+{
+   return Audio::queued() + ring.read_avail();
+}
 
-   if (!(revents & POLLOUT))
+unsigned long ALSA::xruns() const
+{
+   return stats.xruns;
+}
+
+std::string ALSA::describe() const
+{
+   unsigned long wakeups = stats.wakeups;
+   return stringify("xruns=", stats.xruns.load(),
+         " jitter_avg_us=", wakeups ? stats.jitter_sum / wakeups : 0,
+         " jitter_max_us=", stats.jitter_max.load(),
+         " restart_us=", stats.restart_us.load(), "(", stats.restart_path, ")",
+         stats.realtime ? " rt" : "");
+}
+
+EventHandled::PollList ALSA::pollfds() const
+{
+   if (space_fd < 0)
+      return {};
+   return {{space_fd, EPOLLIN}};
+}
+
+void ALSA::handle(EventHandler &handler)
+{
+   if (!pcm)
       return;
 
+   eventfd_t val;
+   EventHandler::count_syscalls();
+   eventfd_read(space_fd, &val);
+   hungry = false;
+
+   if (failed)
+      throw std::runtime_error("ALSA output thread failed.\n");
+
    Audio::handle(handler);
 }
 
@@ -2,9 +2,18 @@
 #define ALSA_HPP__
 
 #include "audio.hpp"
+#include "ring.hpp"
 #include <asoundlib.h>
 #include <sys/poll.h>
 
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <map>
+#include <cstdint>
+
+// PCM is written from a dedicated output thread.
+// The event loop fills a lock-free ring and is woken through an eventfd when it runs low.
 class ALSA : public Audio
 {
    public:
@@ -15,19 +24,79 @@ class ALSA : public Audio
       void init(unsigned channels, unsigned rate,
             FF::MediaInfo::Format fmt,
             const std::string &dev);
+      FF::MediaInfo::Format best_format(FF::MediaInfo::Format fmt,
+            const std::string &dev);
+      unsigned best_channels(unsigned channels, const std::string &dev);
 
-      void write(const FF::Buffer &buf);
+      void write(const std::uint8_t *data, std::size_t size);
       void stop();
 
       void handle(EventHandler &handler);
 
       bool active() const;
+      bool pause(bool enable);
+      bool paused() const;
+      void discard();
+      std::size_t queued() const;
+      std::string describe() const;
+      unsigned long xruns() const;
 
       EventHandled::PollList pollfds() const;
 
+   protected:
+      std::size_t write_avail();
+
    private:
       snd_pcm_t *pcm;
+      snd_pcm_uframes_t period_size, buffer_size;
+      std::size_t frame_bytes;
+      unsigned rate;
+
+      std::string open_dev;
+      unsigned channels;
+      FF::MediaInfo::Format fmt;
+      bool can_pause, held, hw_paused;
+
+      PCMRing ring;
       std::vector<struct pollfd> fds;
+      std::thread thread;
+      int space_fd, data_fd;
+      std::atomic<bool> stopping, waiting, hungry, failed;
+
+      struct
+      {
+         std::atomic<unsigned long> xruns, wakeups;
+         std::atomic<std::uint64_t> jitter_sum, jitter_max;
+         bool realtime;
+
+         // Time from asking for sound until the PCM runs again, by how it got there.
+         std::atomic<std::int64_t> restart_start;
+         std::atomic<std::uint64_t> restart_us;
+         const char *restart_path;
+      } stats;
+
+      // Bitmasks of supported sample formats and channel counts per device.
+      struct Caps
+      {
+         unsigned formats;
+         std::uint32_t channels;
+      };
+      std::map<std::string, Caps> caps;
+
+      // Buffer and period sizes a device settled on, by device and format.
+      struct Negotiated
+      {
+         snd_pcm_uframes_t period_size, buffer_size;
+      };
+      std::map<std::string, Negotiated> negotiated;
+      static bool probe(const std::string &dev, Caps &caps);
+      const Caps *capabilities(const std::string &dev);
+
+      void start_thread();
+      void stop_thread();
+      void set_scheduling();
+      void thread_loop();
+      bool recover(int err);
 };
 
 #endif
@@ -0,0 +1,390 @@
+#include "analysis.hpp"
+#include "loudness.hpp"
+#include "ffmpeg.hpp"
+#include "dsp.hpp"
+#include "config.hpp"
+#include "utils.hpp"
+
+#include <fstream>
+#include <algorithm>
+#include <iostream>
+#include <cstdlib>
+#include <cmath>
+#include <limits>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static bool stat_file(const std::string &path, std::int64_t &mtime, std::int64_t &size)
+{
+   struct stat st;
+   if (stat(path.c_str(), &st) < 0)
+      return false;
+
+   mtime = st.st_mtime;
+   size = st.st_size;
+   return true;
+}
+
+// Unlike string_split(), keeps empty fields.
+static std::vector<std::string> split_fields(const std::string &line)
+{
+   std::vector<std::string> res;
+   std::size_t start = 0;
+   for (;;)
+   {
+      auto end = line.find('\t', start);
+      res.push_back(line.substr(start, end - start));
+      if (end == std::string::npos)
+         return res;
+      start = end + 1;
+   }
+}
+
+static std::string strip_tabs(std::string str)
+{
+   std::replace(std::begin(str), std::end(str), '\t', ' ');
+   std::replace(std::begin(str), std::end(str), '\n', ' ');
+   return str;
+}
+
+static void write_entry(std::ostream &file, const std::string &path, std::int64_t mtime,
+      std::int64_t size, const Analyzer::Result &result, const std::string &title,
+      const std::string &artist, const std::string &album)
+{
+   file << mtime << '\t' << size << '\t'
+      << result.integrated << '\t' << result.peak << '\t'
+      << result.range << '\t' << strip_tabs(title) << '\t'
+      << strip_tabs(artist) << '\t' << strip_tabs(album) << '\t'
+      << path << '\n';
+}
+
+Analyzer::Analyzer(Library &library)
+   : library(library), shutdown(false), busy(0), done(0), failed(0), active_seconds(0.0), active_since(0)
+{
+   const char *home = getenv("HOME");
+   cache_path = config().get("loudness_cache",
+         home ? stringify(home, "/.umusd-loudness") : "");
+   load_cache();
+
+   int threads = config().get_int("analysis_threads",
+         std::max(1, static_cast<int>(std::thread::hardware_concurrency()) - 1));
+
+   for (int i = 0; i < threads; i++)
+      workers.push_back(std::thread(&Analyzer::worker, this));
+}
+
+Analyzer::~Analyzer()
+{
+   {
+      std::lock_guard<std::mutex> hold(lock);
+      shutdown = true;
+   }
+   cond.notify_all();
+
+   for (auto &thread : workers)
+      thread.join();
+}
+
+void Analyzer::load_cache()
+{
+   if (cache_path.empty())
+      return;
+
+   std::ifstream file(cache_path);
+   std::string line;
+   std::size_t lines = 0;
+
+   // mtime, size, integrated, peak, range, [title, artist, album,] path. Later lines win.
+   while (std::getline(file, line))
+   {
+      lines++;
+      auto list = split_fields(line);
+      if (list.size() != 6 && list.size() != 9)
+         continue;
+
+      Entry entry;
+      entry.mtime = std::strtoll(list[0].c_str(), nullptr, 10);
+      entry.size = std::strtoll(list[1].c_str(), nullptr, 10);
+      entry.result.integrated = std::strtod(list[2].c_str(), nullptr);
+      entry.result.peak = std::strtod(list[3].c_str(), nullptr);
+      entry.result.range = std::strtod(list[4].c_str(), nullptr);
+      entry.tagged = list.size() == 9;
+      entry.checked = false;
+      entry.measured = !std::isnan(entry.result.integrated);
+      if (entry.tagged)
+      {
+         entry.title = list[5];
+         entry.artist = list[6];
+         entry.album = list[7];
+      }
+      cache[list.back()] = entry;
+   }
+   file.close();
+
+   // Every analysis appends, so rewrite once the superseded lines pile up.
+   if (lines > cache.size())
+      compact_cache();
+
+   std::int64_t start = monotonic_ns();
+   for (auto &itr : cache)
+      if (itr.second.tagged)
+         library.update({itr.first, itr.second.title, itr.second.artist, itr.second.album});
+
+   if (!cache.empty())
+      std::cerr << "Indexed " << cache.size() << " cached tracks in "
+         << (monotonic_ns() - start) / 1000000 << " ms." << std::endl;
+}
+
+void Analyzer::compact_cache()
+{
+   // Written aside and renamed, a crash never loses the old cache.
+   auto tmp = cache_path + ".tmp";
+   {
+      std::ofstream out(tmp);
+      for (auto &itr : cache)
+      {
+         auto &entry = itr.second;
+         if (entry.tagged)
+            write_entry(out, itr.first, entry.mtime, entry.size, entry.result,
+                  entry.title, entry.artist, entry.album);
+         else
+            out << entry.mtime << '\t' << entry.size << '\t' << entry.result.integrated << '\t'
+               << entry.result.peak << '\t' << entry.result.range << '\t' << itr.first << '\n';
+      }
+
+      if (!out)
+      {
+         unlink(tmp.c_str());
+         return;
+      }
+   }
+
+   if (rename(tmp.c_str(), cache_path.c_str()) < 0)
+      unlink(tmp.c_str());
+}
+
+void Analyzer::store(const std::string &path, const Entry &entry)
+{
+   library.update({path, entry.title, entry.artist, entry.album});
+
+   if (cache_path.empty())
+      return;
+
+   std::lock_guard<std::mutex> hold(file_lock);
+   std::ofstream file(cache_path, std::ios::app);
+   write_entry(file, path, entry.mtime, entry.size, entry.result,
+         entry.title, entry.artist, entry.album);
+}
+
+void Analyzer::enqueue(const std::string &path, bool urgent)
+{
+   if (workers.empty() || path.empty())
+      return;
+
+   {
+      std::lock_guard<std::mutex> hold(lock);
+
+      auto itr = cache.find(path);
+      if (itr != std::end(cache) && itr->second.tagged && itr->second.checked)
+         return;
+
+      queue_job(path, urgent);
+   }
+
+   cond.notify_one();
+}
+
+void Analyzer::queue_job(const std::string &path, bool urgent)
+{
+   if (!pending.insert(path).second)
+   {
+      if (!urgent)
+         return;
+
+      // Already queued, move it to the front. A worker may have it already.
+      auto job = std::find(std::begin(jobs), std::end(jobs), path);
+      if (job == std::end(jobs))
+         return;
+      jobs.erase(job);
+   }
+
+   if (urgent)
+      jobs.push_front(path);
+   else
+      jobs.push_back(path);
+}
+
+void Analyzer::enqueue(const std::vector<std::string> &paths)
+{
+   if (workers.empty())
+      return;
+
+   {
+      std::lock_guard<std::mutex> hold(lock);
+      for (auto &path : paths)
+         if (pending.insert(path).second)
+            jobs.push_back(path);
+   }
+
+   cond.notify_all();
+}
+
+bool Analyzer::lookup(const std::string &path, Result &result)
+{
+   bool check = false, measured;
+   {
+      std::lock_guard<std::mutex> hold(lock);
+      auto itr = cache.find(path);
+      if (itr == std::end(cache))
+         return false;
+
+      // A changed file is analyzed again, its next lookup gets the new result.
+      if (!itr->second.checked && !workers.empty())
+      {
+         queue_job(path, true);
+         check = true;
+      }
+      measured = itr->second.measured;
+      result = itr->second.result;
+   }
+
+   if (check)
+      cond.notify_one();
+   return measured;
+}
+
+std::string Analyzer::stats()
+{
+   std::lock_guard<std::mutex> hold(lock);
+
+   double seconds = active_seconds;
+   if (busy)
+      seconds += (monotonic_ns() - active_since) / 1e9;
+
+   return stringify("workers=", workers.size(),
+         " pending=", jobs.size() + busy,
+         " done=", done,
+         " failed=", failed,
+         " cached=", cache.size(),
+         " tracks_per_sec=", seconds > 0.0 ? done / seconds : 0.0);
+}
+
+std::size_t Analyzer::backlog()
+{
+   std::lock_guard<std::mutex> hold(lock);
+   return jobs.size() + busy;
+}
+
+bool Analyzer::analyze(const std::string &path, Entry &entry)
+{
+   try
+   {
+      FF ff(path);
+      auto &info = ff.info();
+      entry.title = info.title;
+      entry.artist = info.artist;
+      entry.album = info.album;
+      entry.tagged = true;
+      entry.checked = true;
+
+      // Still worth a place in the library, it just has no loudness. Cached as NaN.
+      entry.measured = info.fmt != FF::MediaInfo::Format::None && info.channels && info.rate;
+      if (!entry.measured)
+      {
+         float none = std::numeric_limits<float>::quiet_NaN();
+         entry.result = {none, none, none};
+         return true;
+      }
+
+      LoudnessMeter meter(info.channels, info.rate);
+
+      FF::Buffer buffer;
+      buffer.reserve(ff.max_frame_size());
+      std::vector<float> samples;
+      std::size_t sample_size = info.frame_size() / info.channels;
+
+      while (ff.decode(buffer))
+      {
+         samples.resize(buffer.size() / sample_size);
+         std::size_t count = to_float(buffer.data(), buffer.size(), info.fmt, samples.data());
+         meter.process(samples.data(), count / info.channels);
+      }
+
+      entry.result.integrated = meter.integrated();
+      entry.result.peak = meter.true_peak();
+      entry.result.range = meter.range();
+      return true;
+   }
+   catch(const std::exception &e)
+   {
+      std::cerr << "Analysis of " << path << " failed: " << e.what() << std::endl;
+      return false;
+   }
+}
+
+void Analyzer::worker()
+{
+   // Analysis only gets CPU time nobody else wants, so playback never starves.
+   struct sched_param param{};
+   pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+   for (;;)
+   {
+      std::string path;
+      {
+         std::unique_lock<std::mutex> hold(lock);
+         cond.wait(hold, [this] { return shutdown || !jobs.empty(); });
+         if (shutdown)
+            return;
+
+         path = std::move(jobs.front());
+         jobs.pop_front();
+
+         if (!busy++)
+            active_since = monotonic_ns();
+      }
+
+      Entry entry;
+      bool ok = stat_file(path, entry.mtime, entry.size);
+
+      bool fresh = false;
+      if (ok)
+      {
+         std::lock_guard<std::mutex> hold(lock);
+         auto itr = cache.find(path);
+         fresh = itr != std::end(cache) && itr->second.tagged &&
+            itr->second.mtime == entry.mtime && itr->second.size == entry.size;
+         if (fresh)
+            itr->second.checked = true;
+      }
+      ok = ok && (fresh || analyze(path, entry));
+
+      {
+         std::lock_guard<std::mutex> hold(lock);
+         if (ok && !fresh)
+            cache[path] = entry;
+         else if (!ok)
+            cache.erase(path);
+      }
+
+      // Lookups on the loop never wait on the disk or the index. The path stays
+      // pending until done, so no other worker appends an older result after it.
+      if (ok && !fresh)
+         store(path, entry);
+      else if (!ok)
+         library.remove(path);
+
+      std::lock_guard<std::mutex> hold(lock);
+      pending.erase(path);
+      if (ok && !fresh)
+         done++;
+      else if (!ok)
+         failed++;
+
+      if (!--busy)
+         active_seconds += (monotonic_ns() - active_since) / 1e9;
+   }
+}
+
@@ -0,0 +1,89 @@
+#ifndef ANALYSIS_HPP__
+#define ANALYSIS_HPP__
+
+#include <string>
+#include <deque>
+#include <set>
+#include <map>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+
+#include "library.hpp"
+
+// Background loudness analysis on a pool of idle-priority workers.
+// Results are cached by path, mtime and size, and persisted between runs.
+// Tags read along the way feed the library search index.
+class Analyzer
+{
+   public:
+      explicit Analyzer(Library &library);
+      ~Analyzer();
+
+      void operator=(const Analyzer &) = delete;
+
+      struct Result
+      {
+         float integrated;
+         float peak;
+         float range;
+      };
+
+      // Neither touches the file on the caller's thread, the workers check it against the cache.
+      void enqueue(const std::string &path, bool urgent = false);
+      void enqueue(const std::vector<std::string> &paths);
+      // Trusts a cached result until a worker has checked it, and has that done.
+      bool lookup(const std::string &path, Result &result);
+
+      std::string stats();
+      // Files waiting for or in analysis.
+      std::size_t backlog();
+
+   private:
+      struct Entry
+      {
+         std::int64_t mtime;
+         std::int64_t size;
+         Result result;
+         // Entries cached before tags were stored get scanned again.
+         bool tagged;
+         // Matched against the file since startup.
+         bool checked;
+         // False for formats the meter cannot take, those are only indexed.
+         bool measured;
+         std::string title, artist, album;
+      };
+
+      Library &library;
+
+      std::mutex lock;
+      std::condition_variable cond;
+      std::deque<std::string> jobs;
+      std::set<std::string> pending;
+      std::map<std::string, Entry> cache;
+      std::vector<std::thread> workers;
+      bool shutdown;
+
+      std::string cache_path;
+      // Keeps appends from two workers from interleaving, never held with lock.
+      std::mutex file_lock;
+
+      unsigned busy;
+      unsigned long done, failed;
+      double active_seconds;
+      std::int64_t active_since;
+
+      void queue_job(const std::string &path, bool urgent);
+      void load_cache();
+      void compact_cache();
+      // Called without lock held, the cache itself is updated by the worker.
+      void store(const std::string &path, const Entry &entry);
+      void worker();
+      bool analyze(const std::string &path, Entry &entry);
+};
+
+#endif
+
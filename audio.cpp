@@ -1,9 +1,20 @@
 #include "audio.hpp"
+#include "fanout.hpp"
 #include "player.hpp"
+#include "allocstats.hpp"
+#include "dsp.hpp"
 
-void Audio::set_media(std::weak_ptr<FF> ff)
+#include <algorithm>
+#include <limits>
+
+Audio::Audio()
+   : fanout(nullptr), remote(nullptr), queue(4), queue_head(0), queue_count(0),
+   queue_offset(0), overruns(0), dropped_blocks(0), block_info{}
+{}
+
+void Audio::set_source(FanOut &fanout)
 {
-   this->ff = ff;
+   this->fanout = &fanout;
 }
 
 void Audio::set_remote(Remote &remote)
@@ -13,20 +24,151 @@ void Audio::set_remote(Remote &remote)
 
 void Audio::handle(EventHandler &handler)
 {
-   if (auto tmp = ff.lock())
+   if (!fanout)
+      return;
+
+   AllocStats::Scope scope;
+   if (remote)
+      remote->publish();
+
+   // Top the sink up as far as it accepts, not just one frame per wakeup.
+   while (write_avail())
    {
-      auto buf = tmp->decode();
-      if (buf.empty())
+      if (!queue_count)
       {
-         try
+         if (!fanout->pull())
          {
-            remote->next();
+            AllocStats::Scope track_change(false);
+            try
+            {
+               remote->track_end();
+            }
+            catch(...)
+            {}
+            return;
          }
-         catch(...)
-         {}
+
+         if (!queue_count)
+            return;
       }
+
+      flush();
+   }
+}
+
+void Audio::set_queue_depth(unsigned depth)
+{
+   clear_queue();
+   queue.resize(std::max(depth, 1u));
+}
+
+unsigned Audio::queue_depth() const
+{
+   return queue.size();
+}
+
+bool Audio::push(Block block)
+{
+   // A sink that keeps overflowing its whole queue has stalled.
+   if (queue_count >= queue.size())
+   {
+      queue[queue_head] = Block();
+      queue_head = (queue_head + 1) % queue.size();
+      queue_count--;
+      queue_offset = 0;
+      dropped_blocks++;
+
+      if (++overruns > queue.size())
+         return false;
+   }
+   else
+      overruns = 0;
+
+   queue[(queue_head + queue_count) % queue.size()] = std::move(block);
+   queue_count++;
+   return true;
+}
+
+void Audio::flush()
+{
+   while (queue_count)
+   {
+      auto &block = *queue[queue_head];
+      std::size_t to_write = std::min(write_avail(), block.size() - queue_offset);
+      if (!to_write)
+         break;
+
+      if (eq.active())
+         write(equalize(block.data() + queue_offset, to_write), to_write);
       else
-         write(buf);
+         write(block.data() + queue_offset, to_write);
+      queue_offset += to_write;
+
+      if (queue_offset >= block.size())
+      {
+         queue[queue_head] = Block();
+         queue_head = (queue_head + 1) % queue.size();
+         queue_count--;
+         queue_offset = 0;
+      }
    }
 }
 
+void Audio::discard()
+{
+   clear_queue();
+}
+
+std::size_t Audio::write_avail()
+{
+   return std::numeric_limits<std::size_t>::max();
+}
+
+void Audio::clear_queue()
+{
+   for (auto &block : queue)
+      block = Block();
+
+   queue_head = queue_count = 0;
+   queue_offset = 0;
+   overruns = 0;
+}
+
+std::size_t Audio::queued() const
+{
+   std::size_t size = 0;
+   for (unsigned i = 0; i < queue_count; i++)
+      size += queue[(queue_head + i) % queue.size()]->size();
+   return size - queue_offset;
+}
+
+unsigned long Audio::dropped() const
+{
+   return dropped_blocks;
+}
+
+void Audio::set_format(const FF::MediaInfo &info)
+{
+   block_info = info;
+   eq.configure(info.channels, info.rate);
+}
+
+void Audio::set_eq(const std::string &spec)
+{
+   eq.set_bands(spec);
+}
+
+const std::uint8_t *Audio::equalize(const std::uint8_t *data, std::size_t size)
+{
+   // Blocks are shared with the other sinks, filter a copy.
+   // Both buffers only grow to the largest block once.
+   std::size_t frame_size = block_info.frame_size();
+   eq_samples.resize(size / frame_size * block_info.channels);
+   to_float(data, size, block_info.fmt, eq_samples.data());
+   eq.process(eq_samples.data(), size / frame_size);
+
+   eq_buffer.resize(size);
+   from_float(eq_samples.data(), eq_samples.size(), block_info.fmt, eq_buffer.data());
+   return eq_buffer.data();
+}
+
@@ -2,19 +2,29 @@
 #define AUDIO_HPP__
 
 #include "ffmpeg.hpp"
+#include "pool.hpp"
 #include "eventhandler.hpp"
+#include "eq.hpp"
 
 #include <string>
 #include <memory>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+class FanOut;
 
 class Audio : public EventHandled
 {
    public:
+      typedef PCMPool::Block Block;
+
+      Audio();
       virtual ~Audio() {}
 
       virtual std::string default_device() const = 0;
 
-      void set_media(std::weak_ptr<FF> ff);
+      void set_source(FanOut &fanout);
 
       void set_remote(Remote &remote);
       virtual void handle(EventHandler &handler);
@@ -22,14 +32,63 @@ class Audio : public EventHandled
       virtual void init(unsigned channels, unsigned rate,
             FF::MediaInfo::Format fmt, const std::string &dev) = 0;
 
-      virtual void write(const FF::Buffer &buf) = 0;
+      // The format closest to fmt that the device takes.
+      virtual FF::MediaInfo::Format best_format(FF::MediaInfo::Format fmt,
+            const std::string &) { return fmt; }
+      // The channel count to open the device with, anything else gets remixed.
+      virtual unsigned best_channels(unsigned channels,
+            const std::string &) { return channels; }
+
+      virtual void write(const std::uint8_t *data, std::size_t size) = 0;
       virtual void stop() = 0;
 
       virtual bool active() const = 0;
 
+      // Holds the device open without playing, false when it cannot.
+      virtual bool pause(bool) { return false; }
+      virtual bool paused() const { return false; }
+      virtual std::string describe() const { return ""; }
+      virtual unsigned long xruns() const { return 0; }
+
+      void set_queue_depth(unsigned depth);
+      unsigned queue_depth() const;
+      bool push(Block block);
+      void flush();
+      // Drops queued audio that has not played yet, after a seek.
+      virtual void discard();
+      // Hands every queued block back to its pool, the device is left alone.
+      void clear_queue();
+
+      virtual std::size_t queued() const;
+      unsigned long dropped() const;
+
+      // The format blocks arrive in, set before the first push.
+      void set_format(const FF::MediaInfo &info);
+      // Per output room correction, see Equalizer::parse.
+      void set_eq(const std::string &spec);
+      const Equalizer &equalizer() const { return eq; }
+
    protected:
-      std::weak_ptr<FF> ff;
+      FanOut *fanout;
       Remote *remote;
+
+      // Bytes the sink can take right now without blocking.
+      virtual std::size_t write_avail();
+
+   private:
+      // Fixed ring of blocks, never reallocated after set_queue_depth().
+      std::vector<Block> queue;
+      unsigned queue_head, queue_count;
+      std::size_t queue_offset;
+      unsigned overruns;
+      unsigned long dropped_blocks;
+
+      FF::MediaInfo block_info;
+      Equalizer eq;
+      std::vector<float> eq_samples;
+      FF::Buffer eq_buffer;
+
+      const std::uint8_t *equalize(const std::uint8_t *data, std::size_t size);
 };
 
 #endif
@@ -1,9 +1,18 @@
 #include "command.hpp"
 #include "utils.hpp"
+#include "config.hpp"
 #include "player.hpp"
+#include "allocstats.hpp"
+#include "remix.hpp"
+#include "ttfa.hpp"
+#include "trace.hpp"
 #include <stdexcept>
 #include <iostream>
+#include <cstdlib>
 #include <signal.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <errno.h>
 
 Command::Command() : remote(nullptr)
 {
@@ -22,11 +31,18 @@ std::string Command::parse_command(EventHandler &event, const std::string &cmd)
    if (last_arg > first_arg)
       arg = cmd.substr(first_arg + 1, last_arg - first_arg - 1);
 
-   auto &cb = command_map[name];
-   if (cb)
-      return cb(event, string_split(arg, "\n"));
-   else
+   if (name == "PLAY" || name == "NEXT" || name == "PREV" ||
+         name == "SEEK" || name == "UNPAUSE")
+      TTFA::begin(name);
+
+   // The map owns the name, so it outlives any trace.
+   auto itr = command_map.find(name);
+   if (itr == std::end(command_map) || !itr->second)
       throw std::runtime_error(stringify("Unrecognized command: \"", name, "\""));
+
+   EventHandler::count_command();
+   Trace::Span span(itr->first.c_str());
+   return itr->second(event, string_split(arg, "\n"));
 }
 
 template <class Delegate>
@@ -71,13 +87,15 @@ void Command::init_command_map()
       return "OK";
    };
 
-   command_map["PLAY"] = [this](EventHandler &, std::vector<std::string> arg) -> std::string {
+   command_map["PLAY"] = [this](EventHandler &event, std::vector<std::string> arg) -> std::string {
       if (arg.empty())
          arg.push_back("");
 
+      // Replies once the file is open, or failed to.
+      auto reply = defer(event);
       try
       {
-         remote->play(arg.front());
+         remote->play(arg.front(), reply);
          arg.erase(arg.begin());
          for (auto &str : arg)
             remote->add(str);
@@ -86,6 +104,8 @@ void Command::init_command_map()
       catch(const std::exception &e)
       {
          std::cerr << e.what() << std::endl;
+         if (reply)
+            reply("ERROR");
          return "ERROR";
       }
    };
@@ -168,17 +188,201 @@ void Command::init_command_map()
    command_map["STATUS"] = [this](EventHandler &, std::vector<std::string>) -> std::string {
       return remote->status();
    };
+
+   command_map["ADDSINK"] = [this](EventHandler &, std::vector<std::string> arg) -> std::string {
+      if (arg.empty())
+         throw std::logic_error("ADDSINK requires argument.");
+
+      std::string dev = arg.size() > 1 ? arg[1] : "";
+      unsigned depth = arg.size() > 2 ? std::strtoul(arg[2].c_str(), nullptr, 0) : 16;
+      return plain_action(std::bind(&Remote::add_sink, remote, arg[0], dev, depth));
+   };
+
+   command_map["DELSINK"] = [this](EventHandler &, std::vector<std::string> arg) -> std::string {
+      if (arg.empty())
+         throw std::logic_error("DELSINK requires argument.");
+
+      return plain_action(std::bind(&Remote::remove_sink, remote, arg[0]));
+   };
+
+   command_map["SINKS"] = [this](EventHandler &, std::vector<std::string>) -> std::string {
+      std::vector<std::string> list;
+      for (auto &sink : remote->sinks())
+      {
+         list.push_back(stringify(sink.dev, " ", sink.queued, " ",
+                  static_cast<int>(sink.lag * 1000), " ", sink.dropped,
+                  sink.info.empty() ? "" : " ", sink.info));
+      }
+      return string_join(list, "\n");
+   };
+
+   command_map["ANALYZE"] = [this](EventHandler &, std::vector<std::string> arg) -> std::string {
+      return plain_action([this, &arg] {
+            for (auto &str : arg)
+               remote->analyze(str);
+         });
+   };
+
+   command_map["LOUDNESS"] = [this](EventHandler &, std::vector<std::string> arg) -> std::string {
+      return remote->loudness(arg.empty() ? "" : arg.front());
+   };
+
+   // Query, then optional offset and count. First line is the total number of matches.
+   command_map["SEARCH"] = [this](EventHandler &, std::vector<std::string> arg) -> std::string {
+      if (arg.empty())
+         return "ERROR";
+
+      std::size_t offset = arg.size() > 1 ? std::strtoul(arg[1].c_str(), nullptr, 10) : 0;
+      std::size_t count = arg.size() > 2 ? std::strtoul(arg[2].c_str(), nullptr, 10) : 50;
+
+      std::size_t total;
+      auto tracks = remote->search(arg[0], offset, count, total);
+
+      std::vector<std::string> list;
+      list.push_back(stringify(total));
+      for (auto &track : tracks)
+         list.push_back(stringify(track.path, "\t", track.artist, "\t", track.album, "\t", track.title));
+      return string_join(list, "\n");
+   };
+
+   command_map["QUEUESEARCH"] = [this](EventHandler &, std::vector<std::string> arg) -> std::string {
+      if (arg.empty())
+         return "ERROR";
+      return stringify(remote->queue_search(arg[0]));
+   };
+
+   command_map["LIBRARY"] = [this](EventHandler &, std::vector<std::string>) -> std::string {
+      return remote->library_stats();
+   };
+
+   // Adds library roots to watch, without arguments reports on the watches.
+   command_map["WATCH"] = [this](EventHandler &, std::vector<std::string> arg) -> std::string {
+      if (arg.empty())
+         return remote->watch_stats();
+
+      return plain_action([this, &arg] {
+            for (auto &str : arg)
+               remote->watch(str);
+         });
+   };
+
+   // "OK <bytes>" and the raw image right after it, PENDING while it is extracted.
+   command_map["COVER"] = [this](EventHandler &, std::vector<std::string> arg) -> std::string {
+      std::string file;
+      std::size_t size;
+
+      switch (remote->cover(arg.empty() ? "" : arg.front(), file))
+      {
+         case CoverArt::State::Found:
+            return attach_file(file, size) ? stringify("OK ", size) : "ERROR";
+         case CoverArt::State::Pending:
+            return "PENDING";
+         default:
+            return "NONE";
+      }
+   };
+
+   command_map["COVERS"] = [this](EventHandler &, std::vector<std::string>) -> std::string {
+      return remote->cover_stats();
+   };
+
+   // START, or STOP with an optional path for the Chrome trace JSON.
+   command_map["TRACE"] = [](EventHandler &, std::vector<std::string> arg) -> std::string {
+      if (arg.empty())
+         return "ERROR";
+
+      try
+      {
+         if (arg[0] == "START")
+         {
+            Trace::start();
+            return "OK";
+         }
+         else if (arg[0] == "STOP")
+         {
+            auto path = arg.size() > 1 ? arg[1] : config().get("trace_path", "/tmp/umusd-trace.json");
+            return stringify(Trace::stop(path));
+         }
+      }
+      catch(const std::exception &e)
+      {
+         std::cerr << e.what() << std::endl;
+      }
+      return "ERROR";
+   };
+
+   command_map["CLIENTS"] = [this](EventHandler &, std::vector<std::string>) -> std::string {
+      return remote->client_stats();
+   };
+
+   // Loop counters, compare syscalls per command between event backends.
+   command_map["EVENTS"] = [](EventHandler &event, std::vector<std::string>) -> std::string {
+      return event.stats();
+   };
+
+   command_map["CROSSFADE"] = [this](EventHandler &, std::vector<std::string> arg) -> std::string {
+      if (arg.empty())
+         return stringify(remote->crossfade());
+
+      float seconds = std::strtof(arg[0].c_str(), nullptr);
+      return plain_action(std::bind(&Remote::set_crossfade, remote, seconds));
+   };
+
+   // Playback speed without a change in pitch, from 0.5 to 2.
+   command_map["SPEED"] = [this](EventHandler &, std::vector<std::string> arg) -> std::string {
+      if (arg.empty())
+         return stringify(remote->speed());
+
+      float speed = std::strtof(arg[0].c_str(), nullptr);
+      if (speed <= 0.0f)
+         return "ERROR";
+      return plain_action(std::bind(&Remote::set_speed, remote, speed));
+   };
+
+   // Lists every output's bands and ns per band and sample, or sets one output's bands.
+   command_map["EQ"] = [this](EventHandler &, std::vector<std::string> arg) -> std::string {
+      if (arg.size() > 1)
+         return plain_action(std::bind(&Remote::set_eq, remote, arg[0], arg[1]));
+
+      std::vector<std::string> list;
+      for (auto &sink : remote->sinks())
+      {
+         if (arg.empty() || arg[0] == sink.dev)
+            list.push_back(stringify(sink.dev, " ", sink.eq.empty() ? "off" : sink.eq, " ", sink.eq_cost));
+      }
+      return string_join(list, "\n");
+   };
+
+   command_map["ALLOCS"] = [](EventHandler &, std::vector<std::string>) -> std::string {
+      return AllocStats::report();
+   };
+
+   command_map["TTFA"] = [](EventHandler &, std::vector<std::string>) -> std::string {
+      return TTFA::report();
+   };
+
+   command_map["REMIX"] = [](EventHandler &, std::vector<std::string>) -> std::string {
+      return Remixer::report();
+   };
 }
 
 SocketReply::SocketReply(int fd,
-      std::string &&data, std::function<void (bool)> end_cb)
-   : fd(fd), data(std::move(data)), ptr(0), end_cb(end_cb)
+      std::string &&data, std::function<void (bool)> end_cb,
+      int file, std::size_t file_size)
+   : fd(fd), data(std::move(data)), ptr(0), end_cb(end_cb),
+   file(file), file_size(file >= 0 ? file_size : 0), file_ptr(0)
 {
    struct sigaction sig{};
    sig.sa_handler = SIG_IGN;
    sigaction(SIGPIPE, &sig, nullptr);
 }
 
+SocketReply::~SocketReply()
+{
+   if (file >= 0)
+      close(file);
+}
+
 EventHandled::PollList SocketReply::pollfds() const
 {
    return {{fd, EPOLLOUT}};
@@ -186,18 +390,30 @@ EventHandled::PollList SocketReply::pollfds() const
 
 void SocketReply::handle(EventHandler &handler)
 {
-   size_t to_write = data.size() - ptr;
+   ssize_t ret;
+   EventHandler::count_syscalls();
+   if (ptr < data.size())
+      ret = write(fd, data.data() + ptr, data.size() - ptr);
+   else
+   {
+      // Straight from the page cache, in slices so one client cannot hog the loop.
+      std::size_t to_send = std::min<std::size_t>(file_size - file_ptr, 256 * 1024);
+      ret = sendfile(fd, file, &file_ptr, to_send);
+   }
 
-   ssize_t ret = write(fd, data.data() + ptr, to_write);
-   if (ret <= 0)
+   // Sockets are nonblocking, a full send buffer just means waiting for the next EPOLLOUT.
+   if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+      return;
+   else if (ret <= 0)
    {
       handler.remove(*this);
       end_cb(false);
+      return;
    }
-   else
+   else if (ptr < data.size())
       ptr += ret;
 
-   if (ptr >= data.size())
+   if (ptr >= data.size() && static_cast<std::size_t>(file_ptr) >= file_size)
    {
       handler.remove(*this);
       end_cb(true);
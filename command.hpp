@@ -7,6 +7,7 @@
 #include <functional>
 #include <vector>
 #include <cstddef>
+#include <sys/types.h>
 
 class EventHandler;
 class Remote;
@@ -21,6 +22,11 @@ class Command : public EventHandled
       std::string parse_command(EventHandler &handler, const std::string &cmd);
       Remote *remote;
 
+      // Lets a command reply once it completes, empty if it has to reply right away.
+      virtual std::function<void (const std::string &)> defer(EventHandler &) { return {}; }
+      // Streams the file after the reply, false if this connection cannot.
+      virtual bool attach_file(const std::string &, std::size_t &) { return false; }
+
    private:
       void init_command_map();
 
@@ -28,11 +34,14 @@ class Command : public EventHandled
          std::function<std::string (EventHandler &, std::vector<std::string>)>> command_map;
 };
 
+// Writes data, then optionally size bytes of file with sendfile(), which it closes.
 class SocketReply : public EventHandled
 {
    public:
       SocketReply(int fd,
-            std::string &&data, std::function<void (bool)> end_cb);
+            std::string &&data, std::function<void (bool)> end_cb,
+            int file = -1, std::size_t file_size = 0);
+      ~SocketReply();
 
       void operator=(const SocketReply &) = delete;
 
@@ -45,6 +54,10 @@ class SocketReply : public EventHandled
       std::string data;
       std::size_t ptr;
       std::function<void (bool)> end_cb;
+
+      int file;
+      std::size_t file_size;
+      off_t file_ptr;
 };
 
 #endif
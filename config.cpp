@@ -0,0 +1,86 @@
+#include "config.hpp"
+#include "utils.hpp"
+
+#include <fstream>
+#include <cstdlib>
+
+Config &config()
+{
+   static Config conf;
+   return conf;
+}
+
+static std::string trim(const std::string &str)
+{
+   auto first = str.find_first_not_of(" \t\r\n");
+   if (first == std::string::npos)
+      return "";
+
+   auto last = str.find_last_not_of(" \t\r\n");
+   return str.substr(first, last - first + 1);
+}
+
+bool Config::load(const std::string &path)
+{
+   std::ifstream file(path);
+   if (!file)
+      return false;
+
+   std::string line;
+   while (std::getline(file, line))
+      parse(line);
+
+   return true;
+}
+
+void Config::parse(const std::string &line)
+{
+   auto str = trim(line.substr(0, line.find('#')));
+   auto split = str.find('=');
+   if (split == std::string::npos)
+      return;
+
+   set(trim(str.substr(0, split)), trim(str.substr(split + 1)));
+}
+
+void Config::set(const std::string &key, const std::string &value)
+{
+   values[key] = value;
+}
+
+std::string Config::get(const std::string &key, const std::string &def) const
+{
+   auto itr = values.find(key);
+   return itr != std::end(values) ? itr->second : def;
+}
+
+int Config::get_int(const std::string &key, int def) const
+{
+   auto itr = values.find(key);
+   return itr != std::end(values) ? std::strtol(itr->second.c_str(), nullptr, 0) : def;
+}
+
+float Config::get_float(const std::string &key, float def) const
+{
+   auto itr = values.find(key);
+   return itr != std::end(values) ? std::strtod(itr->second.c_str(), nullptr) : def;
+}
+
+bool Config::get_bool(const std::string &key, bool def) const
+{
+   auto itr = values.find(key);
+   if (itr == std::end(values))
+      return def;
+
+   auto &val = itr->second;
+   return val == "1" || val == "yes" || val == "true" || val == "on";
+}
+
+std::vector<unsigned> Config::get_list(const std::string &key) const
+{
+   std::vector<unsigned> list;
+   for (auto &str : string_split(get(key), ", "))
+      list.push_back(std::strtoul(str.c_str(), nullptr, 0));
+   return list;
+}
+
@@ -0,0 +1,30 @@
+#ifndef CONFIG_HPP__
+#define CONFIG_HPP__
+
+#include <string>
+#include <map>
+#include <vector>
+
+// Daemon-wide tunables.
+// Read from "key = value" lines in a config file, overridable with key=value arguments.
+class Config
+{
+   public:
+      bool load(const std::string &path);
+      void set(const std::string &key, const std::string &value);
+      void parse(const std::string &line);
+
+      std::string get(const std::string &key, const std::string &def = "") const;
+      int get_int(const std::string &key, int def) const;
+      float get_float(const std::string &key, float def) const;
+      bool get_bool(const std::string &key, bool def) const;
+      std::vector<unsigned> get_list(const std::string &key) const;
+
+   private:
+      std::map<std::string, std::string> values;
+};
+
+Config &config();
+
+#endif
+
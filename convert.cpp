@@ -0,0 +1,69 @@
+#include "convert.hpp"
+#include "dsp.hpp"
+#include <stdexcept>
+
+Converter::Converter(const FF::MediaInfo &in, const FF::MediaInfo &out)
+   : in(in), out(out), swr(nullptr)
+{
+   if (in.channels != out.channels)
+      remixer = std::unique_ptr<Remixer>(new Remixer(in.channel_layout, in.channels, out.channels));
+
+   if (in.rate == out.rate)
+      return;
+
+   // Channels are remixed before resampling, so only the rate differs here.
+   std::int64_t layout = av_get_default_channel_layout(out.channels);
+   swr = swr_alloc_set_opts(nullptr,
+         layout, AV_SAMPLE_FMT_FLT, out.rate,
+         layout, AV_SAMPLE_FMT_FLT, in.rate,
+         0, nullptr);
+
+   if (!swr || swr_init(swr) < 0)
+   {
+      swr_free(&swr);
+      throw std::runtime_error("Failed to initialize resampler.\n");
+   }
+}
+
+Converter::~Converter()
+{
+   if (swr)
+      swr_free(&swr);
+}
+
+void Converter::process(const std::uint8_t *data, std::size_t size, std::vector<float> &out)
+{
+   std::size_t frames = size / in.frame_size();
+   samples.resize(frames * in.channels);
+   to_float(data, frames * in.frame_size(), in.fmt, samples.data());
+
+   if (remixer)
+   {
+      adapted.resize(frames * this->out.channels);
+      remixer->process(samples.data(), adapted.data(), frames);
+   }
+   else
+      adapted.swap(samples);
+
+   if (!swr)
+   {
+      out.insert(std::end(out), std::begin(adapted), std::end(adapted));
+      return;
+   }
+
+   int out_frames = swr_get_out_samples(swr, frames);
+   if (out_frames <= 0)
+      return;
+
+   std::size_t offset = out.size();
+   out.resize(offset + out_frames * this->out.channels);
+
+   auto out_ptr = reinterpret_cast<std::uint8_t*>(out.data() + offset);
+   auto in_ptr = reinterpret_cast<const std::uint8_t*>(adapted.data());
+   int ret = swr_convert(swr, &out_ptr, out_frames, &in_ptr, frames);
+   if (ret < 0)
+      throw std::runtime_error("Failed to resample audio.\n");
+
+   out.resize(offset + ret * this->out.channels);
+}
+
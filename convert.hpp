@@ -0,0 +1,37 @@
+#ifndef CONVERT_HPP__
+#define CONVERT_HPP__
+
+#include "ffmpeg.hpp"
+#include "remix.hpp"
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+extern "C" {
+#include <libswresample/swresample.h>
+}
+
+// Converts decoded PCM of one track to interleaved floats in the
+// channel count and rate of the output.
+class Converter
+{
+   public:
+      Converter(const FF::MediaInfo &in, const FF::MediaInfo &out);
+      ~Converter();
+      void operator=(const Converter&) = delete;
+      Converter(const Converter&) = delete;
+
+      // Appends the converted samples to out.
+      void process(const std::uint8_t *data, std::size_t size, std::vector<float> &out);
+
+   private:
+      FF::MediaInfo in, out;
+      SwrContext *swr;
+      std::unique_ptr<Remixer> remixer;
+
+      std::vector<float> samples, adapted;
+};
+
+#endif
+
@@ -0,0 +1,277 @@
+#include "cover.hpp"
+#include "ffmpeg.hpp"
+#include "config.hpp"
+#include "utils.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <iterator>
+#include <cstdlib>
+#include <cstdio>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static bool stat_file(const std::string &path, std::int64_t &mtime, std::int64_t &size)
+{
+   struct stat st;
+   if (stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode))
+      return false;
+
+   mtime = st.st_mtime;
+   size = st.st_size;
+   return true;
+}
+
+CoverArt::CoverArt()
+   : shutdown(false), extracted(0), shared(0), missing(0)
+{
+   const char *home = getenv("HOME");
+   dir = config().get("cover_cache", home ? stringify(home, "/.umusd-covers") : "");
+   if (dir.empty())
+      return;
+
+   mkdir(dir.c_str(), 0755);
+   load_index();
+
+   worker_thread = std::thread(&CoverArt::worker, this);
+}
+
+CoverArt::~CoverArt()
+{
+   {
+      std::lock_guard<std::mutex> hold(lock);
+      shutdown = true;
+   }
+   cond.notify_all();
+
+   if (worker_thread.joinable())
+      worker_thread.join();
+}
+
+void CoverArt::load_index()
+{
+   std::ifstream file(dir + "/index");
+   std::string line;
+
+   // mtime, size, image name or "-" for none, path. Later lines win.
+   while (std::getline(file, line))
+   {
+      auto list = string_split(line, "\t");
+      if (list.size() != 4)
+         continue;
+
+      Entry entry;
+      entry.mtime = std::strtoll(list[0].c_str(), nullptr, 10);
+      entry.size = std::strtoll(list[1].c_str(), nullptr, 10);
+      entry.name = list[2] == "-" ? "" : list[2];
+      cache[list[3]] = entry;
+   }
+}
+
+void CoverArt::store(const std::string &path, const Entry &entry)
+{
+   cache[path] = entry;
+
+   std::ofstream file(dir + "/index", std::ios::app);
+   file << entry.mtime << '\t' << entry.size << '\t'
+      << (entry.name.empty() ? "-" : entry.name) << '\t' << path << '\n';
+}
+
+CoverArt::State CoverArt::lookup(const std::string &path, std::string &file)
+{
+   if (dir.empty())
+      return State::Missing;
+
+   std::int64_t mtime, size;
+   if (!stat_file(path, mtime, size))
+      return State::Missing;
+
+   {
+      std::lock_guard<std::mutex> hold(lock);
+      auto itr = cache.find(path);
+      if (itr != std::end(cache) && itr->second.mtime == mtime && itr->second.size == size)
+      {
+         if (itr->second.name.empty())
+            return State::Missing;
+
+         // Somebody might have cleaned out the cache directory.
+         file = dir + '/' + itr->second.name;
+         if (access(file.c_str(), R_OK) == 0)
+            return State::Found;
+      }
+   }
+
+   request(path);
+   return State::Pending;
+}
+
+void CoverArt::request(const std::string &path)
+{
+   if (dir.empty() || path.empty())
+      return;
+
+   {
+      std::lock_guard<std::mutex> hold(lock);
+      if (!pending.insert(path).second)
+         return;
+
+      // Asked for by a client, so it goes ahead of any prefetching.
+      jobs.push_front(path);
+   }
+
+   cond.notify_one();
+}
+
+std::string CoverArt::stats()
+{
+   std::lock_guard<std::mutex> hold(lock);
+   return stringify("tracks=", cache.size(),
+         " pending=", jobs.size(),
+         " extracted=", extracted,
+         " shared=", shared,
+         " missing=", missing);
+}
+
+std::string CoverArt::save(const std::vector<std::uint8_t> &data)
+{
+   // FNV-1a, collisions between cover images are not a concern.
+   std::uint64_t hash = 14695981039346656037ull;
+   for (auto c : data)
+      hash = (hash ^ c) * 1099511628211ull;
+
+   const char *ext = ".img";
+   if (data.size() >= 3 && data[0] == 0xff && data[1] == 0xd8 && data[2] == 0xff)
+      ext = ".jpg";
+   else if (data.size() >= 4 && data[0] == 0x89 && data[1] == 'P' && data[2] == 'N' && data[3] == 'G')
+      ext = ".png";
+
+   std::ostringstream stream;
+   stream << std::hex << std::setw(16) << std::setfill('0') << hash << ext;
+   auto name = stream.str();
+   auto file = dir + '/' + name;
+
+   if (access(file.c_str(), R_OK) == 0)
+   {
+      std::lock_guard<std::mutex> hold(lock);
+      shared++;
+      return name;
+   }
+
+   // Written aside and renamed, a reader never sees half an image.
+   auto tmp = file + ".tmp";
+   {
+      std::ofstream out(tmp, std::ios::binary);
+      out.write(reinterpret_cast<const char*>(data.data()), data.size());
+      if (!out)
+         return "";
+   }
+
+   if (rename(tmp.c_str(), file.c_str()) < 0)
+   {
+      unlink(tmp.c_str());
+      return "";
+   }
+
+   std::lock_guard<std::mutex> hold(lock);
+   extracted++;
+   return name;
+}
+
+std::string CoverArt::folder_image(const std::string &path)
+{
+   static const char *names[] = {
+      "cover.jpg", "folder.jpg", "front.jpg", "Cover.jpg", "Folder.jpg", "Front.jpg",
+      "cover.png", "folder.png", "front.png", "Cover.png", "Folder.png", "Front.png",
+   };
+
+   auto slash = path.rfind('/');
+   std::string base = slash == std::string::npos ? "." : path.substr(0, slash);
+
+   for (auto name : names)
+   {
+      auto image = base + '/' + name;
+
+      Entry entry;
+      if (!stat_file(image, entry.mtime, entry.size))
+         continue;
+
+      // The rest of the album reuses the first track's hashing.
+      {
+         std::lock_guard<std::mutex> hold(lock);
+         auto itr = folders.find(image);
+         if (itr != std::end(folders) &&
+               itr->second.mtime == entry.mtime && itr->second.size == entry.size)
+            return itr->second.name;
+      }
+
+      std::ifstream file(image, std::ios::binary);
+      std::vector<std::uint8_t> data((std::istreambuf_iterator<char>(file)),
+            std::istreambuf_iterator<char>());
+      if (data.empty())
+         continue;
+
+      entry.name = save(data);
+      if (entry.name.empty())
+         continue;
+
+      std::lock_guard<std::mutex> hold(lock);
+      folders[image] = entry;
+      return entry.name;
+   }
+
+   return "";
+}
+
+std::string CoverArt::extract(const std::string &path)
+{
+   try
+   {
+      FF ff(path);
+      auto data = ff.cover();
+      if (!data.empty())
+      {
+         auto name = save(data);
+         if (!name.empty())
+            return name;
+      }
+   }
+   catch(const std::exception &e)
+   {
+      std::cerr << "Cover of " << path << ": " << e.what();
+   }
+
+   return folder_image(path);
+}
+
+void CoverArt::worker()
+{
+   for (;;)
+   {
+      std::string path;
+      {
+         std::unique_lock<std::mutex> hold(lock);
+         cond.wait(hold, [this] { return shutdown || !jobs.empty(); });
+         if (shutdown)
+            return;
+
+         path = std::move(jobs.front());
+         jobs.pop_front();
+      }
+
+      Entry entry;
+      bool ok = stat_file(path, entry.mtime, entry.size);
+      if (ok)
+         entry.name = extract(path);
+
+      std::lock_guard<std::mutex> hold(lock);
+      pending.erase(path);
+      if (ok)
+      {
+         if (entry.name.empty())
+            missing++;
+         store(path, entry);
+      }
+   }
+}
+
@@ -0,0 +1,69 @@
+#ifndef COVER_HPP__
+#define COVER_HPP__
+
+#include <string>
+#include <deque>
+#include <set>
+#include <map>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+// Cover art pulled out of embedded pictures or folder images next to the track.
+// Images are stored once per content hash, so a whole album shares one file,
+// and are served straight from the cache directory.
+class CoverArt
+{
+   public:
+      CoverArt();
+      ~CoverArt();
+
+      void operator=(const CoverArt &) = delete;
+
+      enum class State
+      {
+         Found,
+         Missing,
+         Pending
+      };
+
+      // Sets file to the cached image when found, otherwise queues an extraction.
+      State lookup(const std::string &path, std::string &file);
+      void request(const std::string &path);
+
+      std::string stats();
+
+   private:
+      struct Entry
+      {
+         std::int64_t mtime;
+         std::int64_t size;
+         // Cache file name, empty when the track has no art.
+         std::string name;
+      };
+
+      std::mutex lock;
+      std::condition_variable cond;
+      std::deque<std::string> jobs;
+      std::set<std::string> pending;
+      std::map<std::string, Entry> cache;
+      // Folder images already hashed, by image path.
+      std::map<std::string, Entry> folders;
+      std::thread worker_thread;
+      bool shutdown;
+
+      std::string dir;
+      unsigned long extracted, shared, missing;
+
+      void load_index();
+      void store(const std::string &path, const Entry &entry);
+      void worker();
+      std::string extract(const std::string &path);
+      std::string folder_image(const std::string &path);
+      std::string save(const std::vector<std::uint8_t> &data);
+};
+
+#endif
+
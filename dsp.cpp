@@ -0,0 +1,436 @@
+#include "dsp.hpp"
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Readers widen a sample to a full scale int32 or to a float in [-1, 1].
+struct ReadU8
+{
+   typedef std::uint8_t T;
+   static std::int32_t i(T v) { return (v - 128) * 0x1000000; }
+   static float f(T v) { return (v - 128) * (1.0f / 0x80); }
+};
+
+struct ReadS16
+{
+   typedef std::int16_t T;
+   static std::int32_t i(T v) { return v * 0x10000; }
+   static float f(T v) { return v * (1.0f / 0x8000); }
+};
+
+struct ReadS32
+{
+   typedef std::int32_t T;
+   static std::int32_t i(T v) { return v; }
+   static float f(T v) { return v * (1.0f / 0x80000000u); }
+};
+
+struct ReadS64
+{
+   typedef std::int64_t T;
+   static std::int32_t i(T v) { return static_cast<std::int32_t>(v >> 32); }
+   static float f(T v) { return v * (1.0f / 9223372036854775808.0f); }
+};
+
+struct ReadFlt
+{
+   typedef float T;
+   static std::int32_t i(T v)
+   {
+      return static_cast<std::int32_t>(std::min(std::max(v * 2147483648.0, -2147483648.0), 2147483647.0));
+   }
+   static float f(T v) { return v; }
+};
+
+struct ReadDbl
+{
+   typedef double T;
+   static std::int32_t i(T v)
+   {
+      return static_cast<std::int32_t>(std::min(std::max(v * 2147483648.0, -2147483648.0), 2147483647.0));
+   }
+   static float f(T v) { return static_cast<float>(v); }
+};
+
+// Writers store sample i of the output from whichever width loses nothing.
+struct WriteU8
+{
+   typedef std::int32_t Wide;
+   static void put(std::uint8_t *out, std::size_t i, Wide v) { out[i] = (v >> 24) + 128; }
+};
+
+struct WriteS16
+{
+   typedef std::int32_t Wide;
+   static void put(std::uint8_t *out, std::size_t i, Wide v)
+   {
+      reinterpret_cast<std::int16_t*>(out)[i] = v >> 16;
+   }
+};
+
+struct WriteS24
+{
+   typedef std::int32_t Wide;
+   static void put(std::uint8_t *out, std::size_t i, Wide v)
+   {
+      out += 3 * i;
+      out[0] = v >> 8;
+      out[1] = v >> 16;
+      out[2] = v >> 24;
+   }
+};
+
+struct WriteS32
+{
+   typedef std::int32_t Wide;
+   static void put(std::uint8_t *out, std::size_t i, Wide v)
+   {
+      reinterpret_cast<std::int32_t*>(out)[i] = v;
+   }
+};
+
+struct WriteFlt
+{
+   typedef float Wide;
+   static void put(std::uint8_t *out, std::size_t i, Wide v)
+   {
+      reinterpret_cast<float*>(out)[i] = v;
+   }
+};
+
+template <typename R, typename Wide> struct Widen;
+
+template <typename R> struct Widen<R, std::int32_t>
+{
+   static std::int32_t get(typename R::T v) { return R::i(v); }
+};
+
+template <typename R> struct Widen<R, float>
+{
+   static float get(typename R::T v) { return R::f(v); }
+};
+
+template <typename R, typename W>
+static void convert_kernel(const std::uint8_t * const *in, bool planar,
+      std::size_t frames, unsigned channels, std::uint8_t *out)
+{
+   typedef Widen<R, typename W::Wide> Wide;
+
+   if (!planar)
+   {
+      auto src = reinterpret_cast<const typename R::T*>(in[0]);
+      std::size_t samples = frames * channels;
+      for (std::size_t i = 0; i < samples; i++)
+         W::put(out, i, Wide::get(src[i]));
+      return;
+   }
+
+   // Interleave while converting, so every sample is touched once.
+   for (unsigned c = 0; c < channels; c++)
+   {
+      auto src = reinterpret_cast<const typename R::T*>(in[c]);
+      for (std::size_t i = 0; i < frames; i++)
+         W::put(out, i * channels + c, Wide::get(src[i]));
+   }
+}
+
+template <typename R>
+static bool convert_to(FF::MediaInfo::Format fmt, const std::uint8_t * const *in, bool planar,
+      std::size_t frames, unsigned channels, std::uint8_t *out)
+{
+   switch (fmt)
+   {
+      case FF::MediaInfo::Format::U8:
+         convert_kernel<R, WriteU8>(in, planar, frames, channels, out);
+         return true;
+      case FF::MediaInfo::Format::S16:
+         convert_kernel<R, WriteS16>(in, planar, frames, channels, out);
+         return true;
+      case FF::MediaInfo::Format::S24:
+         convert_kernel<R, WriteS24>(in, planar, frames, channels, out);
+         return true;
+      case FF::MediaInfo::Format::S32:
+         convert_kernel<R, WriteS32>(in, planar, frames, channels, out);
+         return true;
+      case FF::MediaInfo::Format::Float:
+         convert_kernel<R, WriteFlt>(in, planar, frames, channels, out);
+         return true;
+      default:
+         return false;
+   }
+}
+
+static inline std::int32_t read_s24(const std::uint8_t *in)
+{
+   return static_cast<std::int32_t>((in[0] << 8) | (in[1] << 16) | (static_cast<std::uint32_t>(in[2]) << 24));
+}
+
+static inline std::int32_t clip_s24(double v)
+{
+   return static_cast<std::int32_t>(std::min(std::max(v, -8388608.0), 8388607.0)) * 0x100;
+}
+
+template <typename T>
+static inline void gain_int(std::uint8_t *data, std::size_t size, float gain, float min, float max)
+{
+   std::size_t samples = size / sizeof(T);
+   T *ptr = reinterpret_cast<T*>(data);
+
+   for (std::size_t i = 0; i < samples; i++)
+   {
+      float val = ptr[i] * gain;
+      ptr[i] = static_cast<T>(std::min(std::max(val, min), max));
+   }
+}
+
+void apply_gain(std::uint8_t *data, std::size_t size,
+      FF::MediaInfo::Format fmt, float gain)
+{
+   switch (fmt)
+   {
+      case FF::MediaInfo::Format::S16:
+         gain_int<std::int16_t>(data, size, gain, -32768.0f, 32767.0f);
+         break;
+
+      case FF::MediaInfo::Format::S32:
+      {
+         // Float has too little mantissa for full S32, use doubles.
+         std::size_t samples = size / sizeof(std::int32_t);
+         std::int32_t *ptr = reinterpret_cast<std::int32_t*>(data);
+         for (std::size_t i = 0; i < samples; i++)
+         {
+            double val = ptr[i] * static_cast<double>(gain);
+            ptr[i] = static_cast<std::int32_t>(std::min(std::max(val, -2147483648.0), 2147483647.0));
+         }
+         break;
+      }
+
+      case FF::MediaInfo::Format::Float:
+      {
+         std::size_t samples = size / sizeof(float);
+         float *ptr = reinterpret_cast<float*>(data);
+         for (std::size_t i = 0; i < samples; i++)
+            ptr[i] *= gain;
+         break;
+      }
+
+      case FF::MediaInfo::Format::U8:
+      {
+         for (std::size_t i = 0; i < size; i++)
+         {
+            float val = (data[i] - 128) * gain;
+            data[i] = static_cast<std::uint8_t>(std::min(std::max(val, -128.0f), 127.0f) + 128);
+         }
+         break;
+      }
+
+      case FF::MediaInfo::Format::S24:
+      {
+         for (std::size_t i = 0; i + 3 <= size; i += 3)
+            WriteS24::put(data + i, 0, clip_s24((read_s24(data + i) >> 8) * static_cast<double>(gain)));
+         break;
+      }
+
+      default:
+         break;
+   }
+}
+
+bool convert_samples(const std::uint8_t * const *in, AVSampleFormat in_fmt,
+      std::size_t frames, unsigned channels,
+      FF::MediaInfo::Format out_fmt, std::uint8_t *out)
+{
+   bool planar = av_sample_fmt_is_planar(in_fmt);
+
+   switch (in_fmt)
+   {
+      case AV_SAMPLE_FMT_U8:
+      case AV_SAMPLE_FMT_U8P:
+         return convert_to<ReadU8>(out_fmt, in, planar, frames, channels, out);
+
+      case AV_SAMPLE_FMT_S16:
+      case AV_SAMPLE_FMT_S16P:
+         return convert_to<ReadS16>(out_fmt, in, planar, frames, channels, out);
+
+      case AV_SAMPLE_FMT_S32:
+      case AV_SAMPLE_FMT_S32P:
+         return convert_to<ReadS32>(out_fmt, in, planar, frames, channels, out);
+
+      case AV_SAMPLE_FMT_S64:
+      case AV_SAMPLE_FMT_S64P:
+         return convert_to<ReadS64>(out_fmt, in, planar, frames, channels, out);
+
+      case AV_SAMPLE_FMT_FLT:
+      case AV_SAMPLE_FMT_FLTP:
+         return convert_to<ReadFlt>(out_fmt, in, planar, frames, channels, out);
+
+      case AV_SAMPLE_FMT_DBL:
+      case AV_SAMPLE_FMT_DBLP:
+         return convert_to<ReadDbl>(out_fmt, in, planar, frames, channels, out);
+
+      default:
+         return false;
+   }
+}
+
+std::size_t to_float(const std::uint8_t *data, std::size_t size,
+      FF::MediaInfo::Format fmt, float *out)
+{
+   switch (fmt)
+   {
+      case FF::MediaInfo::Format::S16:
+      {
+         std::size_t samples = size / sizeof(std::int16_t);
+         const std::int16_t *ptr = reinterpret_cast<const std::int16_t*>(data);
+         for (std::size_t i = 0; i < samples; i++)
+            out[i] = ptr[i] * (1.0f / 0x8000);
+         return samples;
+      }
+
+      case FF::MediaInfo::Format::S32:
+      {
+         std::size_t samples = size / sizeof(std::int32_t);
+         const std::int32_t *ptr = reinterpret_cast<const std::int32_t*>(data);
+         for (std::size_t i = 0; i < samples; i++)
+            out[i] = ptr[i] * (1.0f / 0x80000000u);
+         return samples;
+      }
+
+      case FF::MediaInfo::Format::Float:
+      {
+         std::size_t samples = size / sizeof(float);
+         memcpy(out, data, samples * sizeof(float));
+         return samples;
+      }
+
+      case FF::MediaInfo::Format::U8:
+      {
+         convert_kernel<ReadU8, WriteFlt>(&data, false, size, 1,
+               reinterpret_cast<std::uint8_t*>(out));
+         return size;
+      }
+
+      case FF::MediaInfo::Format::S24:
+      {
+         std::size_t samples = size / 3;
+         for (std::size_t i = 0; i < samples; i++)
+            out[i] = read_s24(data + 3 * i) * (1.0f / 0x80000000u);
+         return samples;
+      }
+
+      default:
+         return 0;
+   }
+}
+
+template <typename T>
+static inline void from_float_int(const float *in, std::size_t samples, std::uint8_t *out, double scale)
+{
+   T *ptr = reinterpret_cast<T*>(out);
+   double max = scale - 1.0;
+   for (std::size_t i = 0; i < samples; i++)
+      ptr[i] = static_cast<T>(std::min(std::max(in[i] * scale, -scale), max));
+}
+
+void from_float(const float *in, std::size_t samples,
+      FF::MediaInfo::Format fmt, std::uint8_t *out)
+{
+   switch (fmt)
+   {
+      case FF::MediaInfo::Format::S16:
+         from_float_int<std::int16_t>(in, samples, out, 0x8000);
+         break;
+
+      case FF::MediaInfo::Format::S32:
+         from_float_int<std::int32_t>(in, samples, out, 2147483648.0);
+         break;
+
+      case FF::MediaInfo::Format::Float:
+         memcpy(out, in, samples * sizeof(float));
+         break;
+
+      case FF::MediaInfo::Format::U8:
+      case FF::MediaInfo::Format::S24:
+      {
+         auto ptr = reinterpret_cast<const std::uint8_t*>(in);
+         convert_to<ReadFlt>(fmt, &ptr, false, samples, 1, out);
+         break;
+      }
+
+      default:
+         break;
+   }
+}
+
+void mix_equal_power(float *a, const float *b, std::size_t frames,
+      unsigned channels, double pos, double step)
+{
+   enum { chunk = 64 };
+   float gain_a[chunk], gain_b[chunk];
+
+   while (frames)
+   {
+      std::size_t count = std::min<std::size_t>(frames, chunk);
+      for (std::size_t i = 0; i < count; i++)
+      {
+         double t = std::min(std::max(pos + i * step, 0.0), 1.0) * M_PI / 2.0;
+         gain_a[i] = std::cos(t);
+         gain_b[i] = std::sin(t);
+      }
+
+      std::size_t i = 0;
+#ifdef __SSE2__
+      if (channels == 2)
+      {
+         // Two stereo frames per vector.
+         for (; i + 2 <= count; i += 2)
+         {
+            __m128 ga = _mm_set_ps(gain_a[i + 1], gain_a[i + 1], gain_a[i], gain_a[i]);
+            __m128 gb = _mm_set_ps(gain_b[i + 1], gain_b[i + 1], gain_b[i], gain_b[i]);
+            __m128 va = _mm_loadu_ps(a + 2 * i);
+            __m128 vb = _mm_loadu_ps(b + 2 * i);
+            _mm_storeu_ps(a + 2 * i, _mm_add_ps(_mm_mul_ps(va, ga), _mm_mul_ps(vb, gb)));
+         }
+      }
+#endif
+
+      for (; i < count; i++)
+         for (unsigned c = 0; c < channels; c++)
+            a[i * channels + c] = a[i * channels + c] * gain_a[i] + b[i * channels + c] * gain_b[i];
+
+      a += count * channels;
+      b += count * channels;
+      pos += count * step;
+      frames -= count;
+   }
+}
+
+float dot_product(const float *a, const float *b, std::size_t count)
+{
+   std::size_t i = 0;
+   float sum = 0.0f;
+
+#ifdef __SSE2__
+   // Two accumulators hide the latency of the adds.
+   __m128 acc0 = _mm_setzero_ps();
+   __m128 acc1 = _mm_setzero_ps();
+   for (; i + 8 <= count; i += 8)
+   {
+      acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+      acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+   }
+
+   float lanes[4];
+   _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+   sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+
+   for (; i < count; i++)
+      sum += a[i] * b[i];
+   return sum;
+}
+
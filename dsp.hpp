@@ -0,0 +1,43 @@
+#ifndef DSP_HPP__
+#define DSP_HPP__
+
+#include "ffmpeg.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+
+// Sample kernels on interleaved PCM in one of the FF::MediaInfo formats.
+// Written as flat loops so the compiler can vectorize them.
+
+void apply_gain(std::uint8_t *data, std::size_t size,
+      FF::MediaInfo::Format fmt, float gain);
+
+// Converts decoded samples in any sample format, planar or packed, to
+// interleaved PCM. Returns false when either format is unsupported.
+bool convert_samples(const std::uint8_t * const *in, AVSampleFormat in_fmt,
+      std::size_t frames, unsigned channels,
+      FF::MediaInfo::Format out_fmt, std::uint8_t *out);
+
+// Converts size bytes of PCM to floats in [-1, 1], returns number of samples written.
+std::size_t to_float(const std::uint8_t *data, std::size_t size,
+      FF::MediaInfo::Format fmt, float *out);
+
+// Converts samples floats in [-1, 1] back to PCM, clipping out of range values.
+void from_float(const float *in, std::size_t samples,
+      FF::MediaInfo::Format fmt, std::uint8_t *out);
+
+// Equal-power crossfade, a = a * cos(x) + b * sin(x) with x = pi / 2 * t.
+// t runs from pos in steps of step per frame and is clamped to [0, 1].
+void mix_equal_power(float *a, const float *b, std::size_t frames,
+      unsigned channels, double pos, double step);
+
+// Sum of a[i] * b[i], the inner loop of correlation searches.
+float dot_product(const float *a, const float *b, std::size_t count);
+
+inline float db_to_gain(float db)
+{
+   return std::pow(10.0f, db / 20.0f);
+}
+
+#endif
+
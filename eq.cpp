@@ -0,0 +1,269 @@
+#include "eq.hpp"
+#include "utils.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+#include <cstdlib>
+#include <cmath>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static float parse_number(const std::string &str, const std::string &band)
+{
+   char *end = nullptr;
+   float value = std::strtof(str.c_str(), &end);
+   if (str.empty() || *end || !std::isfinite(value))
+      throw std::logic_error(stringify("Invalid EQ band ", band, ".\n"));
+   return value;
+}
+
+std::vector<Equalizer::Band> Equalizer::parse(const std::string &spec)
+{
+   std::vector<Band> list;
+   if (spec == "off")
+      return list;
+
+   for (auto &str : string_split(spec, ","))
+   {
+      auto fields = string_split(str, ":");
+      if (fields.size() < 3 || fields.size() > 4)
+         throw std::logic_error(stringify("Invalid EQ band ", str, ".\n"));
+
+      Band band;
+      if (fields[0] == "peak")
+         band.type = Band::Peak;
+      else if (fields[0] == "lowshelf")
+         band.type = Band::LowShelf;
+      else if (fields[0] == "highshelf")
+         band.type = Band::HighShelf;
+      else
+         throw std::logic_error(stringify("Unknown EQ band type ", fields[0], ".\n"));
+
+      band.freq = parse_number(fields[1], str);
+      band.gain_db = parse_number(fields[2], str);
+      band.q = fields.size() > 3 ? parse_number(fields[3], str) : std::sqrt(0.5f);
+
+      if (band.freq <= 0.0f || band.q <= 0.0f || std::fabs(band.gain_db) > 24.0f)
+         throw std::logic_error(stringify("EQ band out of range ", str, ".\n"));
+      list.push_back(band);
+   }
+
+   if (list.size() > MaxBands)
+      throw std::logic_error("Too many EQ bands.\n");
+   return list;
+}
+
+Equalizer::Equalizer()
+   : channels(0), rate(0), fade_left(0), fade_len(0), band_samples(0), ns(0)
+{}
+
+void Equalizer::configure(unsigned channels, unsigned rate)
+{
+   if (channels == this->channels && rate == this->rate)
+      return;
+
+   this->channels = channels;
+   this->rate = rate;
+   fade_left = 0;
+   next.coeffs.clear();
+   design(cascade);
+}
+
+void Equalizer::set_bands(const std::string &spec)
+{
+   bands = parse(spec);
+   current_spec = bands.empty() ? "" : spec;
+   if (!rate)
+      return;
+
+   // Changed again mid fade, carry on from whichever side is louder by now.
+   if (fade_left && fade_left * 2 < fade_len)
+      std::swap(cascade, next);
+
+   // The state of the old bands is close enough to start from, the fade hides the rest.
+   design(next);
+   std::size_t old_bands = cascade.coeffs.size(), new_bands = next.coeffs.size();
+   for (unsigned group = 0; group < (channels + 3) / 4; group++)
+   {
+      for (std::size_t b = 0; b < std::min(old_bands, new_bands); b++)
+      {
+         const float *from = &cascade.state[(group * old_bands + b) * 8];
+         std::copy(from, from + 8, &next.state[(group * new_bands + b) * 8]);
+      }
+   }
+
+   // 20 ms.
+   fade_len = fade_left = std::max(rate / 50, 1u);
+}
+
+void Equalizer::design(Cascade &target) const
+{
+   target.coeffs.clear();
+   for (auto &band : bands)
+   {
+      // Audio EQ cookbook, in double so low bands stay stable.
+      double a = std::pow(10.0, band.gain_db / 40.0);
+      double w0 = 2.0 * M_PI * std::min(band.freq, 0.45f * rate) / rate;
+      double cosw = std::cos(w0);
+      double alpha = std::sin(w0) / (2.0 * band.q);
+      double shelf = 2.0 * std::sqrt(a) * alpha;
+
+      double b0, b1, b2, a0, a1, a2;
+      switch (band.type)
+      {
+         case Band::Peak:
+            b0 = 1.0 + alpha * a;
+            b1 = -2.0 * cosw;
+            b2 = 1.0 - alpha * a;
+            a0 = 1.0 + alpha / a;
+            a1 = -2.0 * cosw;
+            a2 = 1.0 - alpha / a;
+            break;
+
+         case Band::LowShelf:
+            b0 = a * ((a + 1.0) - (a - 1.0) * cosw + shelf);
+            b1 = 2.0 * a * ((a - 1.0) - (a + 1.0) * cosw);
+            b2 = a * ((a + 1.0) - (a - 1.0) * cosw - shelf);
+            a0 = (a + 1.0) + (a - 1.0) * cosw + shelf;
+            a1 = -2.0 * ((a - 1.0) + (a + 1.0) * cosw);
+            a2 = (a + 1.0) + (a - 1.0) * cosw - shelf;
+            break;
+
+         case Band::HighShelf:
+         default:
+            b0 = a * ((a + 1.0) + (a - 1.0) * cosw + shelf);
+            b1 = -2.0 * a * ((a - 1.0) + (a + 1.0) * cosw);
+            b2 = a * ((a + 1.0) + (a - 1.0) * cosw - shelf);
+            a0 = (a + 1.0) - (a - 1.0) * cosw + shelf;
+            a1 = 2.0 * ((a - 1.0) - (a + 1.0) * cosw);
+            a2 = (a + 1.0) - (a - 1.0) * cosw - shelf;
+            break;
+      }
+
+      target.coeffs.push_back({static_cast<float>(b0 / a0), static_cast<float>(b1 / a0),
+            static_cast<float>(b2 / a0), static_cast<float>(a1 / a0), static_cast<float>(a2 / a0)});
+   }
+
+   target.state.assign(((channels + 3) / 4) * target.coeffs.size() * 8, 0.0f);
+}
+
+void Equalizer::run(Cascade &target, unsigned group, float *lanes, std::size_t frames)
+{
+   std::size_t count = target.coeffs.size();
+   for (std::size_t b = 0; b < count; b++)
+   {
+      const Coeffs &c = target.coeffs[b];
+      float *z = &target.state[(group * count + b) * 8];
+
+#ifdef __SSE2__
+      __m128 b0 = _mm_set1_ps(c.b0), b1 = _mm_set1_ps(c.b1), b2 = _mm_set1_ps(c.b2);
+      __m128 a1 = _mm_set1_ps(c.a1), a2 = _mm_set1_ps(c.a2);
+      __m128 z1 = _mm_loadu_ps(z), z2 = _mm_loadu_ps(z + 4);
+
+      for (std::size_t i = 0; i < frames; i++)
+      {
+         __m128 x = _mm_loadu_ps(lanes + 4 * i);
+         __m128 y = _mm_add_ps(_mm_mul_ps(b0, x), z1);
+         z1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1, x), _mm_mul_ps(a1, y)), z2);
+         z2 = _mm_sub_ps(_mm_mul_ps(b2, x), _mm_mul_ps(a2, y));
+         _mm_storeu_ps(lanes + 4 * i, y);
+      }
+
+      _mm_storeu_ps(z, z1);
+      _mm_storeu_ps(z + 4, z2);
+#else
+      for (unsigned l = 0; l < 4; l++)
+      {
+         float z1 = z[l], z2 = z[4 + l];
+         for (std::size_t i = 0; i < frames; i++)
+         {
+            float x = lanes[4 * i + l];
+            float y = c.b0 * x + z1;
+            z1 = c.b1 * x - c.a1 * y + z2;
+            z2 = c.b2 * x - c.a2 * y;
+            lanes[4 * i + l] = y;
+         }
+         z[l] = z1;
+         z[4 + l] = z2;
+      }
+#endif
+   }
+}
+
+void Equalizer::process(float *samples, std::size_t frames)
+{
+   if (!active() || !channels)
+      return;
+
+   std::int64_t start = monotonic_ns();
+   band_samples += frames * channels * (cascade.coeffs.size() + (fade_left ? next.coeffs.size() : 0));
+
+#ifdef __SSE2__
+   // Flush to zero and denormals are zero, decaying filter tails get slow otherwise.
+   unsigned csr = _mm_getcsr();
+   _mm_setcsr(csr | 0x8040);
+#endif
+
+   enum { chunk = 64 };
+   float lanes[4 * chunk], faded[4 * chunk];
+   unsigned groups = (channels + 3) / 4;
+
+   for (std::size_t done = 0; done < frames; )
+   {
+      std::size_t count = std::min<std::size_t>(frames - done, chunk);
+      float *base = samples + done * channels;
+
+      for (unsigned group = 0; group < groups; group++)
+      {
+         unsigned first = group * 4;
+         unsigned width = std::min(channels - first, 4u);
+
+         for (std::size_t i = 0; i < count; i++)
+            for (unsigned l = 0; l < 4; l++)
+               lanes[4 * i + l] = l < width ? base[i * channels + first + l] : 0.0f;
+
+         if (fade_left)
+         {
+            std::copy(lanes, lanes + 4 * count, faded);
+            run(cascade, group, lanes, count);
+            run(next, group, faded, count);
+
+            for (std::size_t i = 0; i < count; i++)
+            {
+               float t = std::min(static_cast<float>(fade_len - fade_left + i + 1) / fade_len, 1.0f);
+               for (unsigned l = 0; l < 4; l++)
+                  lanes[4 * i + l] += (faded[4 * i + l] - lanes[4 * i + l]) * t;
+            }
+         }
+         else
+            run(cascade, group, lanes, count);
+
+         for (std::size_t i = 0; i < count; i++)
+            for (unsigned l = 0; l < width; l++)
+               base[i * channels + first + l] = lanes[4 * i + l];
+      }
+
+      if (fade_left)
+      {
+         fade_left -= std::min(fade_left, count);
+         if (!fade_left)
+            std::swap(cascade, next);
+      }
+
+      done += count;
+   }
+
+#ifdef __SSE2__
+   _mm_setcsr(csr);
+#endif
+
+   ns += monotonic_ns() - start;
+}
+
+double Equalizer::cost() const
+{
+   return band_samples ? static_cast<double>(ns) / band_samples : 0.0;
+}
+
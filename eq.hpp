@@ -0,0 +1,70 @@
+#ifndef EQ_HPP__
+#define EQ_HPP__
+
+#include <vector>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+// Parametric equalizer, a cascade of cookbook biquads in transposed direct
+// form II on interleaved floats. Channels run side by side in the lanes of
+// a vector, four at a time, since every frame depends on the one before.
+class Equalizer
+{
+   public:
+      enum { MaxBands = 10 };
+
+      struct Band
+      {
+         enum Type { Peak, LowShelf, HighShelf } type;
+         float freq, gain_db, q;
+      };
+
+      // Bands as type:freq:gain_db[:q] separated by commas, with types peak,
+      // lowshelf and highshelf, e.g. "lowshelf:80:3,peak:1000:-4.5:1.4".
+      // Empty or "off" is no bands.
+      static std::vector<Band> parse(const std::string &spec);
+
+      Equalizer();
+
+      void configure(unsigned channels, unsigned rate);
+      // Swapped in with a short crossfade from the old bands, no clicks.
+      void set_bands(const std::string &spec);
+      const std::string &spec() const { return current_spec; }
+
+      // False when process() would not change anything.
+      bool active() const { return !cascade.coeffs.empty() || fade_left; }
+      void process(float *samples, std::size_t frames);
+
+      // Measured cost of one band on one sample, in ns.
+      double cost() const;
+
+   private:
+      struct Coeffs
+      {
+         float b0, b1, b2, a1, a2;
+      };
+
+      struct Cascade
+      {
+         std::vector<Coeffs> coeffs;
+         // Per group of four channels and band, z1 and z2 for each lane.
+         std::vector<float> state;
+      };
+
+      unsigned channels, rate;
+      std::vector<Band> bands;
+      std::string current_spec;
+
+      // While fading, both run and the output moves from cascade to next.
+      Cascade cascade, next;
+      std::size_t fade_left, fade_len;
+
+      std::uint64_t band_samples, ns;
+
+      void design(Cascade &target) const;
+      void run(Cascade &target, unsigned group, float *lanes, std::size_t frames);
+};
+
+#endif
+
@@ -1,39 +1,112 @@
 #include "eventhandler.hpp"
+#include "uring.hpp"
+#include "timers.hpp"
+#include "config.hpp"
+#include "utils.hpp"
+#include "trace.hpp"
 #include <sys/epoll.h>
 #include <unistd.h>
 
 #include <stdexcept>
 #include <iostream>
+#include <typeinfo>
+#include <cstdint>
 
-EventHandler::EventHandler() : killed(false)
+namespace
 {
-   epfd = epoll_create(16);
-   if (epfd < 0)
-      throw std::runtime_error("Failed to create epoll.\n");
+   std::uint64_t wakeups, dispatches, syscalls, commands;
+   std::int64_t started = monotonic_ns();
+
+   class Epoll : public Poller
+   {
+      public:
+         Epoll()
+         {
+            epfd = epoll_create(16);
+            if (epfd < 0)
+               throw std::runtime_error("Failed to create epoll.\n");
+         }
+
+         ~Epoll()
+         {
+            close(epfd);
+         }
+
+         void add(int fd, unsigned events)
+         {
+            struct epoll_event event{};
+            event.events = events;
+            event.data.fd = fd;
+
+            EventHandler::count_syscalls();
+            if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) < 0)
+               throw std::runtime_error("Failed to add epoll fd to list.\n");
+         }
+
+         void remove(int fd)
+         {
+            EventHandler::count_syscalls();
+            epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+         }
+
+         void wait(std::vector<int> &ready)
+         {
+            struct epoll_event events[16];
+
+            EventHandler::count_syscalls();
+            int ret = epoll_wait(epfd, events, 16, -1);
+            if (ret < 0)
+               throw std::runtime_error("epoll_wait() failed.\n");
+
+            for (int i = 0; i < ret; i++)
+               ready.push_back(events[i].data.fd);
+         }
+
+         const char *name() const { return "epoll"; }
+
+      private:
+         int epfd;
+   };
 }
 
-EventHandler::~EventHandler()
+EventHandler::EventHandler() : killed(false), completions(nullptr)
 {
-   close(epfd);
+   if (config().get("event_backend", "epoll") == "io_uring")
+   {
+      try
+      {
+         auto uring = new Uring(config().get_int("io_uring_entries", 256));
+         poller.reset(uring);
+         completions = uring;
+      }
+      catch(const std::exception &e)
+      {
+         std::cerr << e.what() << "Falling back to epoll." << std::endl;
+      }
+   }
+
+   if (!poller)
+      poller.reset(new Epoll);
+
+   timers = std::make_shared<Timers>();
+   tasks = std::make_shared<TaskQueue>();
+   add(timers);
+   add(tasks);
 }
 
+EventHandler::~EventHandler()
+{}
+
 void EventHandler::add(std::weak_ptr<EventHandled> handler)
 {
    auto fd_ptr = handler.lock();
+   if (completions && fd_ptr->attach(*this))
+      return;
 
    for (auto fd : fd_ptr->pollfds())
    {
-      struct epoll_event event{};
-      event.events = fd.events;
-      event.data.fd = fd.fd;
-
-      cb_map[event.data.fd] = [this, handler]() {
-         if (auto tmp = handler.lock())
-            tmp->handle(*this);
-      };
-
-      if (epoll_ctl(epfd, EPOLL_CTL_ADD, event.data.fd, &event) < 0)
-         throw std::runtime_error("Failed to add epoll fd to list.\n");
+      cb_map[fd.fd] = handler;
+      poller->add(fd.fd, fd.events);
    }
 }
 
@@ -41,8 +114,8 @@ void EventHandler::remove(const EventHandled &handler)
 {
    for (auto fd : handler.pollfds())
    {
-      cb_map[fd.fd] = {};
-      epoll_ctl(epfd, EPOLL_CTL_DEL, fd.fd, nullptr);
+      if (cb_map.erase(fd.fd))
+         poller->remove(fd.fd);
    }
 }
 
@@ -51,20 +124,81 @@ void EventHandler::kill()
    killed = true;
 }
 
+Uring *EventHandler::uring()
+{
+   return completions;
+}
+
+std::uint64_t EventHandler::add_timer(unsigned delay_ms, Task task, unsigned period_ms)
+{
+   return timers->add(delay_ms * 1000000ll, period_ms * 1000000ll, std::move(task));
+}
+
+void EventHandler::cancel_timer(std::uint64_t id)
+{
+   timers->cancel(id);
+}
+
+void EventHandler::post(Task task)
+{
+   tasks->post(std::move(task));
+}
+
+std::shared_ptr<TaskQueue> EventHandler::task_queue() const
+{
+   return tasks;
+}
+
+void EventHandler::count_syscalls(unsigned count)
+{
+   syscalls += count;
+}
+
+void EventHandler::count_command()
+{
+   commands++;
+}
+
+std::string EventHandler::stats() const
+{
+   double seconds = (monotonic_ns() - started) / 1e9;
+   return stringify("backend=", poller->name(),
+         " wakeups=", wakeups,
+         " dispatches=", dispatches,
+         " syscalls=", syscalls,
+         " commands=", commands,
+         " timers=", timers->size(),
+         " syscalls_per_sec=", seconds > 0.0 ? syscalls / seconds : 0.0);
+}
+
 bool EventHandler::wait()
 {
-   struct epoll_event events[16];
-   int ret = epoll_wait(epfd, events, 16, -1);
-   if (ret < 0)
-      throw std::runtime_error("epoll_wait() failed.\n");
+   Trace::Span span("EventHandler::wait");
+
+   ready.clear();
+   {
+      Trace::Span span(poller->name());
+      poller->wait(ready);
+   }
+   wakeups++;
 
-   for (int i = 0; i < ret; i++)
+   // Holding a strong reference keeps the handler alive even if it removes itself,
+   // without copying a callback on every event.
+   for (auto fd : ready)
    {
-      auto cb = cb_map[events[i].data.fd];
-      if (cb)
-         cb();
+      auto itr = cb_map.find(fd);
+      if (itr == std::end(cb_map))
+         continue;
+
+      if (auto handler = itr->second.lock())
+      {
+         Trace::Span span(Trace::active() ? typeid(*handler).name() : "");
+         dispatches++;
+         handler->handle(*this);
+      }
    }
 
+   poller->complete();
    return !killed;
 }
 
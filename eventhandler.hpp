@@ -5,11 +5,17 @@
 #include <map>
 #include <memory>
 #include <list>
+#include <vector>
+#include <string>
+#include <cstdint>
 #include <sys/epoll.h>
 
 class Remote;
 class EventHandler;
 class EventHandled;
+class Uring;
+class Timers;
+class TaskQueue;
 
 class EventHandled : public std::enable_shared_from_this<EventHandled>
 {
@@ -25,11 +31,32 @@ class EventHandled : public std::enable_shared_from_this<EventHandled>
       virtual PollList pollfds() const = 0;
       virtual void handle(EventHandler &handler) = 0;
       virtual void set_remote(Remote &) {};
+
+      // Called on add() when the loop offers completion based I/O.
+      // Returning true means the handler drives its own I/O and is not polled.
+      virtual bool attach(EventHandler &) { return false; }
+};
+
+// Readiness source behind the loop, epoll or io_uring.
+class Poller
+{
+   public:
+      virtual ~Poller() {}
+
+      virtual void add(int fd, unsigned events) = 0;
+      virtual void remove(int fd) = 0;
+      // Blocks until at least one fd is ready or a completion came in.
+      virtual void wait(std::vector<int> &ready) = 0;
+      // Runs callbacks of finished operations, after ready handlers were served.
+      virtual void complete() {}
+
+      virtual const char *name() const = 0;
 };
 
 class EventHandler
 {
    public:
+      // The backend comes from event_backend in the config, epoll unless io_uring is asked for.
       EventHandler();
       ~EventHandler();
 
@@ -39,10 +66,34 @@ class EventHandler
       void kill();
       bool wait();
 
+      // Completion based socket I/O, null unless the io_uring backend runs.
+      Uring *uring();
+
+      typedef std::function<void ()> Task;
+
+      // Runs task on the loop after delay_ms, then every period_ms unless that is 0.
+      std::uint64_t add_timer(unsigned delay_ms, Task task, unsigned period_ms = 0);
+      void cancel_timer(std::uint64_t id);
+
+      // The only call safe from other threads, task runs on the loop thread.
+      void post(Task task);
+      // For threads that may outlive the loop. Posting to it stays safe, tasks
+      // posted after the loop is gone are dropped.
+      std::shared_ptr<TaskQueue> task_queue() const;
+
+      // Syscalls and commands issued on the loop thread, reported by EVENTS.
+      static void count_syscalls(unsigned count = 1);
+      static void count_command();
+      std::string stats() const;
+
    private:
-      int epfd;
       bool killed;
-      std::map<int, std::function<void ()>> cb_map;
+      std::map<int, std::weak_ptr<EventHandled>> cb_map;
+      std::unique_ptr<Poller> poller;
+      Uring *completions;
+      std::vector<int> ready;
+      std::shared_ptr<Timers> timers;
+      std::shared_ptr<TaskQueue> tasks;
 };
 
 #endif
@@ -0,0 +1,503 @@
+#include "fanout.hpp"
+#include "allocstats.hpp"
+#include "dsp.hpp"
+#include "ttfa.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <algorithm>
+
+FanOut::FanOut()
+   : media_info{}, initialized(false), gain(1.0f), crossfade_len(0.0f),
+   incoming{nullptr, 1.0f, ""}, fading(false), fade_pos(0.0), fade_step(0.0),
+   fade_in_left(0), fade_in_len(0)
+{}
+
+FanOut::~FanOut()
+{
+   if (master)
+      master->clear_queue();
+   for (auto &sink : sinks)
+      sink.audio->clear_queue();
+}
+
+void FanOut::reserve(const FF &ff)
+{
+   // Enough blocks for every queue to be full with one in flight.
+   unsigned count = 2;
+   if (master)
+      count += master->queue_depth();
+   for (auto &sink : sinks)
+      count += sink.audio->queue_depth();
+
+   // Below full speed a block grows, and a grain may spill over into it.
+   std::size_t bytes = ff.max_frame_size();
+   if (stretch.speed() < 1.0f)
+      bytes = bytes * 2 + stretch.headroom() * media_info.frame_size();
+   pool.reserve(bytes, count);
+}
+
+std::unique_ptr<Converter> FanOut::make_converter(FF &ff) const
+{
+   auto &info = ff.info();
+   if (info.fmt == FF::MediaInfo::Format::None)
+      throw std::runtime_error("Unsupported sample format.\n");
+
+   // The decoder converts sample formats by itself.
+   if (info.channels == media_info.channels && info.rate == media_info.rate)
+   {
+      ff.set_format(media_info.fmt);
+      return std::unique_ptr<Converter>();
+   }
+
+   return std::unique_ptr<Converter>(new Converter(info, media_info));
+}
+
+void FanOut::set_media(std::weak_ptr<FF> ff)
+{
+   this->ff = ff;
+   reset_fade();
+   converter.reset();
+
+   if (auto tmp = ff.lock())
+   {
+      reserve(*tmp);
+      if (initialized)
+         converter = make_converter(*tmp);
+   }
+
+   AllocStats::warmup();
+}
+
+void FanOut::set_gain(float gain)
+{
+   this->gain = gain;
+}
+
+void FanOut::set_master(std::shared_ptr<Audio> master)
+{
+   this->master = master;
+}
+
+void FanOut::set_upcoming(std::function<Track ()> upcoming)
+{
+   this->upcoming = upcoming;
+}
+
+void FanOut::set_crossfade(float seconds)
+{
+   crossfade_len = std::min(std::max(seconds, 0.0f), 12.0f);
+   if (crossfade_len <= 0.0f)
+      reset_fade();
+}
+
+float FanOut::crossfade() const
+{
+   return crossfade_len;
+}
+
+void FanOut::set_speed(float speed)
+{
+   stretch.set_speed(speed);
+   if (auto tmp = ff.lock())
+      reserve(*tmp);
+}
+
+float FanOut::speed() const
+{
+   return stretch.speed();
+}
+
+void FanOut::discard()
+{
+   reset_fade();
+   stretch.reset();
+
+   // The resampler holds a few milliseconds of its own.
+   auto tmp = ff.lock();
+   if (converter && tmp)
+      converter = make_converter(*tmp);
+
+   if (master)
+      master->discard();
+   for (auto &sink : sinks)
+      sink.audio->discard();
+
+   // 5 ms, long enough not to click.
+   fade_in_len = fade_in_left = media_info.rate / 200;
+}
+
+void FanOut::reset_fade()
+{
+   incoming = Track{nullptr, 1.0f, ""};
+   incoming_converter.reset();
+   incoming_fifo.clear();
+   fading = false;
+}
+
+std::shared_ptr<FF> FanOut::take_incoming(const std::string &path)
+{
+   if (!incoming.ff || incoming.path != path)
+   {
+      reset_fade();
+      return std::shared_ptr<FF>();
+   }
+
+   // What is left in the FIFO already carries the gain and plays out first.
+   auto next = incoming.ff;
+   ff = next;
+   gain = incoming.gain;
+   converter = std::move(incoming_converter);
+   incoming = Track{nullptr, 1.0f, ""};
+   fading = false;
+
+   reserve(*next);
+   return next;
+}
+
+void FanOut::init_sink(Sink &sink)
+{
+   sink.audio->init(media_info.channels, media_info.rate, media_info.fmt, sink.dev);
+   sink.audio->set_format(media_info);
+}
+
+void FanOut::stop_sink(Sink &sink)
+{
+   try
+   {
+      sink.audio->stop();
+   }
+   catch(const std::exception &e)
+   {
+      std::cerr << e.what() << std::endl;
+   }
+}
+
+void FanOut::attach(std::shared_ptr<Audio> sink, const std::string &dev, unsigned depth)
+{
+   if (std::find_if(std::begin(sinks), std::end(sinks),
+            [&dev](const Sink &s) { return s.dev == dev; }) != std::end(sinks))
+      throw std::logic_error("Sink is already attached.\n");
+
+   sink->set_queue_depth(depth);
+
+   Sink entry{sink, dev};
+   if (initialized)
+      init_sink(entry);
+
+   sinks.push_back(std::move(entry));
+}
+
+std::shared_ptr<Audio> FanOut::detach(const std::string &dev)
+{
+   auto itr = std::find_if(std::begin(sinks), std::end(sinks),
+         [&dev](const Sink &s) { return s.dev == dev; });
+
+   if (itr == std::end(sinks))
+      throw std::logic_error("No such sink.\n");
+
+   auto sink = itr->audio;
+   stop_sink(*itr);
+   sinks.erase(itr);
+   return sink;
+}
+
+void FanOut::set_eq(const std::string &dev, const std::string &spec)
+{
+   if (master && dev == master->default_device())
+   {
+      master->set_eq(spec);
+      return;
+   }
+
+   auto itr = std::find_if(std::begin(sinks), std::end(sinks),
+         [&dev](const Sink &s) { return s.dev == dev; });
+
+   if (itr == std::end(sinks))
+      throw std::logic_error("No such sink.\n");
+   itr->audio->set_eq(spec);
+}
+
+void FanOut::init(const FF::MediaInfo &info)
+{
+   media_info = info;
+   initialized = true;
+
+   stretch.configure(media_info.channels, media_info.rate);
+   if (master)
+      master->set_format(media_info);
+   reset_fade();
+   converter.reset();
+   if (auto tmp = ff.lock())
+      converter = make_converter(*tmp);
+
+   for (auto itr = std::begin(sinks); itr != std::end(sinks); )
+   {
+      try
+      {
+         init_sink(*itr);
+         ++itr;
+      }
+      catch(const std::exception &e)
+      {
+         std::cerr << "Detaching sink " << itr->dev << ": " << e.what() << std::endl;
+         itr = sinks.erase(itr);
+      }
+   }
+}
+
+void FanOut::stop()
+{
+   for (auto &sink : sinks)
+      stop_sink(sink);
+
+   reset_fade();
+   stretch.reset();
+   fade_in_left = 0;
+   initialized = false;
+}
+
+const FF::MediaInfo &FanOut::output() const
+{
+   return media_info;
+}
+
+void FanOut::prepare_crossfade(FF &current)
+{
+   if (crossfade_len <= 0.0f || fading || !upcoming || !initialized)
+      return;
+
+   float duration = current.info().duration;
+   if (duration <= 0.0f)
+      return;
+
+   // In wall time, so the fade keeps its length at any speed.
+   float remaining = (duration - current.pos()) / stretch.speed();
+
+   // Ask for the next track a little early, it may take a while to open.
+   if (!incoming.ff && remaining <= crossfade_len + crossfade_lead)
+   {
+      incoming = upcoming();
+
+      try
+      {
+         if (incoming.ff)
+            incoming_converter = make_converter(*incoming.ff);
+      }
+      catch(const std::exception &e)
+      {
+         std::cerr << e.what() << std::endl;
+         incoming = Track{nullptr, 1.0f, ""};
+      }
+   }
+
+   if (incoming.ff && remaining <= crossfade_len)
+   {
+      fading = true;
+      fade_pos = 0.0;
+      fade_step = 1.0 / std::max(remaining * stretch.speed() * media_info.rate, 1.0f);
+   }
+}
+
+bool FanOut::fill_incoming(std::size_t samples)
+{
+   std::size_t sample_size = media_info.frame_size() / media_info.channels;
+
+   while (incoming_fifo.size() < samples)
+   {
+      if (!incoming.ff->decode(scratch))
+         return false;
+
+      std::size_t offset = incoming_fifo.size();
+      if (incoming_converter)
+         incoming_converter->process(scratch.data(), scratch.size(), incoming_fifo);
+      else
+      {
+         incoming_fifo.resize(offset + scratch.size() / sample_size);
+         to_float(scratch.data(), scratch.size(), media_info.fmt, incoming_fifo.data() + offset);
+      }
+
+      for (std::size_t i = offset; i < incoming_fifo.size(); i++)
+         incoming_fifo[i] *= incoming.gain;
+   }
+
+   return true;
+}
+
+bool FanOut::render(FF &current, FF::Buffer &buffer)
+{
+   std::size_t sample_size = media_info.channels ? media_info.frame_size() / media_info.channels : 1;
+
+   // Leftover of a track adopted in the middle of a crossfade.
+   if (!incoming.ff && !incoming_fifo.empty())
+   {
+      buffer.resize(incoming_fifo.size() * sample_size);
+      from_float(incoming_fifo.data(), incoming_fifo.size(), media_info.fmt, buffer.data());
+      incoming_fifo.clear();
+      return true;
+   }
+
+   // Done fading, the incoming track takes over even if this one has more.
+   if (fading && fade_pos >= 1.0)
+      return false;
+
+   prepare_crossfade(current);
+
+   if (!converter && !fading && !stretch.active() && !fade_in_left)
+   {
+      if (!current.decode(buffer))
+         return false;
+
+      if (gain != 1.0f)
+         apply_gain(buffer.data(), buffer.size(), media_info.fmt, gain);
+      return true;
+   }
+
+   if (stretch.active())
+   {
+      // Runs on source time after the mix, so crossfades and positions stay in track time.
+      stretched.clear();
+      while (stretched.empty())
+      {
+         if (fading && fade_pos >= 1.0)
+            return false;
+
+         if (mix_block(current))
+            stretch.process(mix.data(), mix.size(), stretched);
+         else
+         {
+            stretch.flush(stretched);
+            if (stretched.empty())
+               return false;
+         }
+      }
+      mix.swap(stretched);
+   }
+   else if (!mix_block(current))
+      return false;
+
+   // Ramps up from silence after a seek.
+   std::size_t frames = mix.size() / media_info.channels;
+   for (std::size_t f = 0; f < frames && fade_in_left; f++, fade_in_left--)
+   {
+      float t = 1.0f - static_cast<float>(fade_in_left) / fade_in_len;
+      for (unsigned c = 0; c < media_info.channels; c++)
+         mix[f * media_info.channels + c] *= t;
+   }
+
+   buffer.resize(mix.size() * sample_size);
+   from_float(mix.data(), mix.size(), media_info.fmt, buffer.data());
+   return true;
+}
+
+bool FanOut::mix_block(FF &current)
+{
+   std::size_t sample_size = media_info.frame_size() / media_info.channels;
+
+   // The resampler might hold back a whole packet, never hand out empty blocks.
+   mix.clear();
+   while (mix.empty())
+   {
+      if (!current.decode(scratch))
+         return false;
+
+      if (converter)
+         converter->process(scratch.data(), scratch.size(), mix);
+      else
+      {
+         mix.resize(scratch.size() / sample_size);
+         to_float(scratch.data(), scratch.size(), media_info.fmt, mix.data());
+      }
+   }
+
+   if (gain != 1.0f)
+      for (auto &sample : mix)
+         sample *= gain;
+
+   if (fading)
+   {
+      // An incoming track shorter than the fade is padded with silence.
+      if (!fill_incoming(mix.size()))
+         incoming_fifo.resize(std::max(incoming_fifo.size(), mix.size()), 0.0f);
+
+      std::size_t frames = mix.size() / media_info.channels;
+      mix_equal_power(mix.data(), incoming_fifo.data(), frames,
+            media_info.channels, fade_pos, fade_step);
+      fade_pos += frames * fade_step;
+
+      incoming_fifo.erase(std::begin(incoming_fifo), std::begin(incoming_fifo) + mix.size());
+   }
+
+   return true;
+}
+
+bool FanOut::pull()
+{
+   auto tmp = ff.lock();
+   if (!tmp)
+      return true;
+
+   // Decode once, every sink shares the same block.
+   auto block = pool.acquire();
+   if (!render(*tmp, block.buffer()))
+      return false;
+   TTFA::mark(TTFA::FirstDecode);
+
+   distribute(block);
+
+   float bytes_per_sec = media_info.rate * media_info.frame_size();
+   if (bytes_per_sec)
+      AllocStats::played(block->size() / bytes_per_sec);
+
+   return true;
+}
+
+void FanOut::distribute(const PCMPool::Block &block)
+{
+   if (master)
+      master->push(block);
+
+   for (auto itr = std::begin(sinks); itr != std::end(sinks); )
+   {
+      bool alive = false;
+      try
+      {
+         alive = itr->audio->push(block);
+         if (alive)
+            itr->audio->flush();
+      }
+      catch(const std::exception &e)
+      {
+         std::cerr << e.what() << std::endl;
+      }
+
+      if (alive)
+         ++itr;
+      else
+      {
+         std::cerr << "Detaching stalled sink " << itr->dev << "." << std::endl;
+         stop_sink(*itr);
+         itr = sinks.erase(itr);
+      }
+   }
+}
+
+std::vector<FanOut::Stats> FanOut::stats() const
+{
+   std::vector<Stats> list;
+   float bytes_per_sec = media_info.rate * media_info.frame_size();
+
+   auto add = [&list, bytes_per_sec](const Audio &audio, const std::string &dev) {
+      std::size_t queued = audio.queued();
+      list.push_back({dev, queued,
+            bytes_per_sec ? queued / bytes_per_sec : 0.0f, audio.dropped(),
+            audio.describe(), audio.equalizer().spec(), audio.equalizer().cost()});
+   };
+
+   if (master)
+      add(*master, master->default_device());
+   for (auto &sink : sinks)
+      add(*sink.audio, sink.dev);
+
+   return list;
+}
+
@@ -0,0 +1,121 @@
+#ifndef FANOUT_HPP__
+#define FANOUT_HPP__
+
+#include "audio.hpp"
+#include "ffmpeg.hpp"
+#include "pool.hpp"
+#include "convert.hpp"
+#include "stretch.hpp"
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <functional>
+
+class FanOut
+{
+   public:
+      FanOut();
+      ~FanOut();
+      void operator=(const FanOut &) = delete;
+
+      void set_media(std::weak_ptr<FF> ff);
+      void set_gain(float gain);
+      void set_master(std::shared_ptr<Audio> master);
+
+      // The track queued after the current one, asked for when a crossfade nears.
+      // Returns no ff until it is open.
+      struct Track
+      {
+         std::shared_ptr<FF> ff;
+         float gain;
+         std::string path;
+      };
+      void set_upcoming(std::function<Track ()> upcoming);
+
+      void set_crossfade(float seconds);
+      float crossfade() const;
+      void reset_fade();
+
+      // Playback speed, pitch stays as is. Carries over from track to track.
+      void set_speed(float speed);
+      float speed() const;
+      // Drops everything not heard yet, from a pending crossfade down to the
+      // queues of every output, and fades in what comes next. For seeks.
+      void discard();
+
+      // Hands over the incoming track if it is still the one queued as path.
+      std::shared_ptr<FF> take_incoming(const std::string &path);
+
+      void attach(std::shared_ptr<Audio> sink, const std::string &dev, unsigned depth);
+      std::shared_ptr<Audio> detach(const std::string &dev);
+      void set_eq(const std::string &dev, const std::string &spec);
+
+      void init(const FF::MediaInfo &info);
+      void stop();
+      const FF::MediaInfo &output() const;
+
+      bool pull();
+
+      struct Stats
+      {
+         std::string dev;
+         std::size_t queued;
+         float lag;
+         unsigned long dropped;
+         std::string info;
+         std::string eq;
+         double eq_cost;
+      };
+
+      std::vector<Stats> stats() const;
+
+   private:
+      // Outlives the sinks' queues only because ~FanOut empties them,
+      // the master and sinks themselves may well outlive it.
+      PCMPool pool;
+
+      std::weak_ptr<FF> ff;
+      std::shared_ptr<Audio> master;
+
+      struct Sink
+      {
+         std::shared_ptr<Audio> audio;
+         std::string dev;
+      };
+      std::vector<Sink> sinks;
+
+      FF::MediaInfo media_info;
+      bool initialized;
+      float gain;
+
+      std::function<Track ()> upcoming;
+      float crossfade_len;
+      Track incoming;
+      std::unique_ptr<Converter> converter, incoming_converter;
+      bool fading;
+      double fade_pos, fade_step;
+
+      TimeStretch stretch;
+      std::size_t fade_in_left, fade_in_len;
+
+      // Output format floats of the current block, the incoming track and the stretch.
+      std::vector<float> mix, incoming_fifo, stretched;
+      FF::Buffer scratch;
+
+      void init_sink(Sink &sink);
+      void stop_sink(Sink &sink);
+
+      enum { crossfade_lead = 2 };
+
+      void reserve(const FF &ff);
+      std::unique_ptr<Converter> make_converter(FF &ff) const;
+      void prepare_crossfade(FF &current);
+      bool fill_incoming(std::size_t samples);
+      bool render(FF &current, FF::Buffer &buffer);
+      bool mix_block(FF &current);
+      void distribute(const PCMPool::Block &block);
+};
+
+#endif
+
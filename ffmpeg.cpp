@@ -1,67 +1,207 @@
 #include "ffmpeg.hpp"
+#include "dsp.hpp"
+#include "config.hpp"
+#include "utils.hpp"
+#include "trace.hpp"
 #include <cstring>
 #include <stdexcept>
 #include <algorithm>
 #include <iostream>
+#include <map>
+#include <list>
+#include <mutex>
+#include <sys/stat.h>
+
+// Probe results by path, so reopening a known file skips avformat_find_stream_info().
+// Shared by the player and the analysis workers.
+class ProbeCache
+{
+   public:
+      ~ProbeCache()
+      {
+         for (auto &entry : entries)
+            avcodec_parameters_free(&entry.second.par);
+      }
+
+      int restore(const std::string &path, const struct stat &st, AVFormatContext *fctx)
+      {
+         std::lock_guard<std::mutex> guard(lock);
+         auto itr = entries.find(path);
+         if (itr == std::end(entries))
+            return -1;
+
+         auto &entry = itr->second;
+         if (entry.mtime != st.st_mtime || entry.size != st.st_size ||
+               entry.stream >= static_cast<int>(fctx->nb_streams))
+            return -1;
+
+         auto stream = fctx->streams[entry.stream];
+         if (avcodec_parameters_copy(stream->codecpar, entry.par) < 0)
+            return -1;
+         stream->duration = entry.duration;
+
+         recent.splice(std::begin(recent), recent, entry.use);
+
+         return entry.stream;
+      }
+
+      void store(const std::string &path, const struct stat &st, AVFormatContext *fctx, int stream)
+      {
+         Entry entry{st.st_mtime, st.st_size, stream, avcodec_parameters_alloc(),
+            fctx->streams[stream]->duration, {}};
+
+         if (!entry.par || avcodec_parameters_copy(entry.par, fctx->streams[stream]->codecpar) < 0)
+         {
+            avcodec_parameters_free(&entry.par);
+            return;
+         }
+
+         std::lock_guard<std::mutex> guard(lock);
+         auto itr = entries.find(path);
+         if (itr != std::end(entries))
+            drop(itr);
+         else if (entries.size() >= max_entries)
+            drop(entries.find(recent.back()));
+
+         // A walk through the library in path order must not evict what it just stored.
+         recent.push_front(path);
+         entry.use = std::begin(recent);
+         entries.insert({path, entry});
+      }
+
+   private:
+      struct Entry
+      {
+         time_t mtime;
+         off_t size;
+         int stream;
+         AVCodecParameters *par;
+         std::int64_t duration;
+         // Position in recent.
+         std::list<std::string>::iterator use;
+      };
+
+      std::mutex lock;
+      std::map<std::string, Entry> entries;
+      // Most recently stored or restored first.
+      std::list<std::string> recent;
+
+      void drop(std::map<std::string, Entry>::iterator itr)
+      {
+         avcodec_parameters_free(&itr->second.par);
+         recent.erase(itr->second.use);
+         entries.erase(itr);
+      }
+      enum { max_entries = 4096 };
+};
+
+static ProbeCache probe_cache;
 
-FF::FF(const std::string &path)
-   : fctx(nullptr), actx(nullptr), aud_stream(-1), last_pos(0.0f), planar_audio(false)
+static int open_interrupted(void *opaque)
 {
-   av_register_all();
+   return static_cast<const std::atomic<bool>*>(opaque)->load();
+}
+
+FF::FF(const std::string &path, const std::atomic<bool> *cancel)
+   : fctx(nullptr), actx(nullptr), frame(nullptr), packet(nullptr), packet_pending(false),
+   aud_stream(-1), last_pos(0.0f), open_timing{}
+{
+   static std::once_flag registered;
+   std::call_once(registered, av_register_all);
 
    try
    {
       media_info.title = path;
 
-      if (avformat_open_input(&fctx, path.c_str(), nullptr, nullptr) < 0)
+      frame = av_frame_alloc();
+      packet = av_packet_alloc();
+      if (!frame || !packet)
+         throw std::runtime_error("Failed to allocate frame.\n");
+
+      // Audio needs far less probing than FFmpeg's defaults, which are sized for video.
+      AVDictionary *opts = nullptr;
+      av_dict_set_int(&opts, "probesize", config().get_int("probesize", 256 * 1024), 0);
+      av_dict_set_int(&opts, "analyzeduration",
+            config().get_int("analyzeduration_ms", 1000) * 1000ll, 0);
+
+      if (cancel)
+      {
+         fctx = avformat_alloc_context();
+         if (!fctx)
+            throw std::runtime_error("Failed to allocate format context.\n");
+
+         fctx->interrupt_callback.callback = open_interrupted;
+         fctx->interrupt_callback.opaque = const_cast<std::atomic<bool>*>(cancel);
+      }
+
+      int ret = avformat_open_input(&fctx, path.c_str(), nullptr, &opts);
+      av_dict_free(&opts);
+      if (ret < 0)
          throw std::runtime_error("Failed to open file.\n");
+      open_timing.opened = monotonic_ns();
 
-      if (avformat_find_stream_info(fctx, nullptr) < 0)
+      struct stat st;
+      bool cacheable = stat(path.c_str(), &st) == 0;
+      aud_stream = cacheable ? probe_cache.restore(path, st, fctx) : -1;
+
+      bool probed = aud_stream < 0;
+      if (probed && avformat_find_stream_info(fctx, nullptr) < 0)
          throw std::runtime_error("Failed to get stream info.\n");
+      open_timing.probed = monotonic_ns();
 
       resolve_codecs();
       get_media_info();
+      open_timing.codec_opened = monotonic_ns();
+
+      if (probed && cacheable)
+         probe_cache.store(path, st, fctx, aud_stream);
+
+      // The flag dies with whoever asked for the open.
+      fctx->interrupt_callback.callback = nullptr;
+      fctx->interrupt_callback.opaque = nullptr;
    } 
    catch(...)
    {
-      if (actx)
-         avcodec_close(actx);
+      avcodec_free_context(&actx);
       if (fctx)
          avformat_close_input(&fctx);
+      av_frame_free(&frame);
+      av_packet_free(&packet);
       throw;
    }
 }
 
 FF::~FF()
 {
-   if (actx)
-      avcodec_close(actx);
+   avcodec_free_context(&actx);
    if (fctx)
       avformat_close_input(&fctx);
+   av_frame_free(&frame);
+   av_packet_free(&packet);
 }
 
 FF::FF(FF &&ff)
+   : fctx(nullptr), actx(nullptr), frame(nullptr), packet(nullptr), packet_pending(false)
 {
    *this = std::move(ff);
 }
 
 FF& FF::operator=(FF &&ff)
 {
-   if (actx)
-   {
-      avcodec_close(actx);
-      actx = nullptr;
-   }
+   avcodec_free_context(&actx);
 
    if (fctx)
       avformat_close_input(&fctx);
 
    std::swap(fctx, ff.fctx);
    std::swap(actx, ff.actx);
+   std::swap(frame, ff.frame);
+   std::swap(packet, ff.packet);
+   std::swap(packet_pending, ff.packet_pending);
+   last_pos = ff.last_pos;
    aud_stream = ff.aud_stream;
    media_info = ff.media_info;
-   buffer = std::move(ff.buffer);
-   planar_audio = ff.planar_audio;
+   open_timing = ff.open_timing;
 
    return *this;
 }
@@ -70,19 +210,25 @@ FF::MediaInfo::Format FF::fmt_conv(AVSampleFormat fmt)
 {
    switch (fmt)
    {
+      case AV_SAMPLE_FMT_U8:
+      case AV_SAMPLE_FMT_U8P:
+         return MediaInfo::Format::U8;
+
+      case AV_SAMPLE_FMT_S16:
       case AV_SAMPLE_FMT_S16P:
-         planar_audio = true;
-      case AV_SAMPLE_FMT_S16: // Fallthrough
          return MediaInfo::Format::S16;
 
-      case AV_SAMPLE_FMT_S32P:
-         planar_audio = true; // Fallthrough
+      // S64 has no use for the low bits, devices top out at 32.
       case AV_SAMPLE_FMT_S32:
+      case AV_SAMPLE_FMT_S32P:
+      case AV_SAMPLE_FMT_S64:
+      case AV_SAMPLE_FMT_S64P:
          return MediaInfo::Format::S32;
 
-      case AV_SAMPLE_FMT_FLTP:
-         planar_audio = true; // Fallthrough
       case AV_SAMPLE_FMT_FLT:
+      case AV_SAMPLE_FMT_FLTP:
+      case AV_SAMPLE_FMT_DBL:
+      case AV_SAMPLE_FMT_DBLP:
          return MediaInfo::Format::Float;
 
       default:
@@ -90,6 +236,17 @@ FF::MediaInfo::Format FF::fmt_conv(AVSampleFormat fmt)
    }
 }
 
+FF::MediaInfo::Format FF::native_format() const
+{
+   return fmt_conv(actx->sample_fmt);
+}
+
+void FF::set_format(MediaInfo::Format fmt)
+{
+   if (fmt != MediaInfo::Format::None && native_format() != MediaInfo::Format::None)
+      media_info.fmt = fmt;
+}
+
 void FF::get_metadata(AVDictionary *meta)
 {
    auto entry = av_dict_get(meta, "title", nullptr, 0);
@@ -108,6 +265,7 @@ void FF::get_metadata(AVDictionary *meta)
 void FF::get_media_info()
 {
    media_info.channels = actx->channels;
+   media_info.channel_layout = actx->channel_layout;
    media_info.rate = actx->sample_rate;
    media_info.fmt = fmt_conv(actx->sample_fmt);
 
@@ -119,112 +277,169 @@ void FF::get_media_info()
 
 void FF::resolve_codecs()
 {
-   for (unsigned i = 0; i < fctx->nb_streams; i++)
+   for (unsigned i = 0; i < fctx->nb_streams && aud_stream < 0; i++)
    {
-      if (fctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO)
-      {
+      if (fctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
          aud_stream = i;
-         break;
-      }
    }
 
    if (aud_stream < 0)
       throw std::runtime_error("Failed to locate audio stream.\n");
 
-   AVCodec *codec = avcodec_find_decoder(fctx->streams[aud_stream]->codec->codec_id);
+   // Keep the demuxer from handing us video, cover art and other audio streams.
+   for (unsigned i = 0; i < fctx->nb_streams; i++)
+   {
+      if (static_cast<int>(i) != aud_stream)
+         fctx->streams[i]->discard = AVDISCARD_ALL;
+   }
+
+   auto par = fctx->streams[aud_stream]->codecpar;
+   AVCodec *codec = avcodec_find_decoder(par->codec_id);
    if (!codec)
       throw std::runtime_error("Failed to locate decoder for stream.\n");
 
-   actx = fctx->streams[aud_stream]->codec;
-   if (avcodec_open2(actx, codec, nullptr) < 0)
-   {
-      actx = nullptr;
-      throw std::runtime_error("Failed to open codec.\n");
-   }
-}
+   actx = avcodec_alloc_context3(codec);
+   if (!actx)
+      throw std::runtime_error("Failed to allocate codec.\n");
 
-template <typename T>
-inline void copy_deplanar(std::uint8_t *out, std::uint8_t **in, int frames, int channels)
-{
-   T* out_ptr = reinterpret_cast<T*>(out);
-   for (int c = 0; c < channels; c++, out_ptr++)
-   {
-      const T* in_ptr = reinterpret_cast<T*>(in[c]);
-      for (int i = 0; i < frames; i++)
-         out_ptr[i * channels] = in_ptr[i];
-   }
+   if (avcodec_parameters_to_context(actx, par) < 0 ||
+         avcodec_open2(actx, codec, nullptr) < 0)
+      throw std::runtime_error("Failed to open codec.\n");
 }
 
-const FF::Buffer& FF::decode()
+bool FF::decode(Buffer &buffer)
 {
+   Trace::Span span("decode");
    buffer.clear();
-   AVPacket pkt;
-   AVFrame frame;
-   int got_ptr = 0;
    unsigned retry_cnt = 0;
 
-   while (!got_ptr)
+   // A packet can carry several frames, so drain the decoder before reading more.
+   for (;;)
    {
-      if (av_read_frame(fctx, &pkt) < 0)
+      int ret = avcodec_receive_frame(actx, frame);
+      if (ret == 0)
+         break;
+      else if (ret == AVERROR_EOF)
+         return false;
+      else if (ret != AVERROR(EAGAIN))
+      {
+         std::cerr << "avcodec_receive_frame() failed." << std::endl;
+         return false;
+      }
+
+      if (!packet_pending)
       {
-         std::cerr << "av_read_frame() failed." << std::endl;
-         return buffer;
+         ret = av_read_frame(fctx, packet);
+         if (ret < 0)
+         {
+            if (ret != AVERROR_EOF)
+               std::cerr << "av_read_frame() failed." << std::endl;
+
+            // Flush out whatever the decoder still holds.
+            avcodec_send_packet(actx, nullptr);
+            continue;
+         }
+
+         if (packet->stream_index != aud_stream)
+         {
+            av_packet_unref(packet);
+            continue;
+         }
+         packet_pending = true;
       }
 
-      if (pkt.stream_index != aud_stream)
+      // A decoder that is still full keeps the packet for the next round.
+      ret = avcodec_send_packet(actx, packet);
+      if (ret == AVERROR(EAGAIN))
       {
-         av_free_packet(&pkt);
-         continue;
+         if (retry_cnt++ < 4)
+            continue;
+         return false;
       }
 
-      if (avcodec_decode_audio4(actx, &frame, &got_ptr, &pkt) < 0)
+      av_packet_unref(packet);
+      packet_pending = false;
+
+      if (ret < 0)
       {
-         std::cerr << "avcodec_decode_audio4() failed." << std::endl;
-         av_free_packet(&pkt);
+         std::cerr << "avcodec_send_packet() failed." << std::endl;
 
          if (retry_cnt++ < 4)
             continue;
 
-         return buffer;
+         return false;
       }
-
-      av_free_packet(&pkt);
    }
 
-   int size = av_samples_get_buffer_size(nullptr, actx->channels,
-         frame.nb_samples, actx->sample_fmt, 1);
+   std::size_t size = frame->nb_samples * media_info.frame_size();
 
-   if (pkt.pts != static_cast<std::int64_t>(AV_NOPTS_VALUE))
-      last_pos = pkt.pts * av_q2d(fctx->streams[aud_stream]->time_base);
+   if (frame->pts != static_cast<std::int64_t>(AV_NOPTS_VALUE))
+      last_pos = frame->pts * av_q2d(fctx->streams[aud_stream]->time_base);
+   else if (actx->sample_rate)
+      last_pos += static_cast<float>(frame->nb_samples) / actx->sample_rate;
 
-   if (planar_audio)
-   {
-      std::size_t current_size = buffer.size();
-      buffer.resize(buffer.size() + size);
-      std::uint8_t* out_ptr = buffer.data() + current_size;
+   // The buffer comes from a pool and is reserved for the largest frame, so this does not reallocate.
+   buffer.resize(size);
 
-      switch (actx->sample_fmt)
-      {
-         case AV_SAMPLE_FMT_S16P:
-            copy_deplanar<int16_t>(out_ptr, frame.data, frame.nb_samples, actx->channels);
-            break;
+   // Packed data already in the output format is copied as is.
+   if (!av_sample_fmt_is_planar(actx->sample_fmt) &&
+         av_get_bytes_per_sample(actx->sample_fmt) * media_info.channels == media_info.frame_size() &&
+         native_format() == media_info.fmt)
+      std::copy(frame->data[0], frame->data[0] + size, buffer.data());
+   else if (!convert_samples(frame->extended_data, actx->sample_fmt,
+            frame->nb_samples, media_info.channels, media_info.fmt, buffer.data()))
+      buffer.clear();
 
-         case AV_SAMPLE_FMT_S32P:
-            copy_deplanar<int32_t>(out_ptr, frame.data, frame.nb_samples, actx->channels);
-            break;
+   return !buffer.empty();
+}
 
-         case AV_SAMPLE_FMT_FLTP:
-            copy_deplanar<float>(out_ptr, frame.data, frame.nb_samples, actx->channels);
-            break;
+std::size_t FF::max_frame_size() const
+{
+   // Sized for the widest output format, set_format() might pick another.
+   unsigned samples = actx->frame_size > 0 ? actx->frame_size : 8192;
+   return samples * media_info.channels * sizeof(float);
+}
 
-         default:
-            break;
-      }
+unsigned FF::MediaInfo::frame_size() const
+{
+   switch (fmt)
+   {
+      case Format::U8:
+         return channels;
+      case Format::S16:
+         return channels * 2;
+      case Format::S24:
+         return channels * 3;
+      case Format::S32:
+      case Format::Float:
+         return channels * 4;
+      default:
+         return 0;
    }
-   else
-      buffer.insert(buffer.end(), frame.data[0], frame.data[0] + size);
+}
 
-   return buffer;
+const FF::Timing& FF::timing() const
+{
+   return open_timing;
+}
+
+std::string FF::describe() const
+{
+   return stringify(fctx->iformat ? fctx->iformat->name : "unknown", "/",
+         avcodec_get_name(actx->codec_id));
+}
+
+FF::Buffer FF::cover() const
+{
+   // Attached pictures are read along with the header, discarding the stream does not matter.
+   for (unsigned i = 0; i < fctx->nb_streams; i++)
+   {
+      auto stream = fctx->streams[i];
+      if ((stream->disposition & AV_DISPOSITION_ATTACHED_PIC) && stream->attached_pic.size > 0)
+         return Buffer(stream->attached_pic.data, stream->attached_pic.data + stream->attached_pic.size);
+   }
+
+   return Buffer();
 }
 
 const FF::MediaInfo& FF::info() const
@@ -250,6 +465,11 @@ bool FF::seek(float pos)
 
    last_pos = pos;
    avcodec_flush_buffers(actx);
+   if (packet_pending)
+   {
+      av_packet_unref(packet);
+      packet_pending = false;
+   }
    return true;
 }
 
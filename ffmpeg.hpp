@@ -5,6 +5,7 @@
 #include <cstddef>
 #include <cstdint>
 #include <vector>
+#include <atomic>
 
 extern "C" {
 #include <libavformat/avformat.h>
@@ -14,7 +15,8 @@ extern "C" {
 class FF
 {
    public:
-      FF(const std::string &path);
+      // Opening gives up once cancel turns true.
+      FF(const std::string &path, const std::atomic<bool> *cancel = nullptr);
       ~FF();
       void operator=(const FF&) = delete;
 
@@ -27,16 +29,21 @@ class FF
             None,
             S16,
             S32,
-            Float
+            Float,
+            U8,
+            S24 // Packed into three bytes.
          };
 
          unsigned channels;
          unsigned rate;
          Format fmt;
+         std::uint64_t channel_layout;
 
          float duration;
 
          std::string title, artist, album;
+
+         unsigned frame_size() const;
       };
 
       const MediaInfo &info() const;
@@ -44,26 +51,46 @@ class FF
 
       bool seek(float pos);
 
+      // The format decode() produces, converted from the decoder's own.
+      void set_format(MediaInfo::Format fmt);
+      MediaInfo::Format native_format() const;
+
       typedef std::vector<std::uint8_t> Buffer;
-      const Buffer& decode();
+      bool decode(Buffer &buffer);
+
+      std::size_t max_frame_size() const;
+
+      // When opening got through each step, in monotonic_ns() time.
+      struct Timing
+      {
+         std::int64_t opened, probed, codec_opened;
+      };
+      const Timing &timing() const;
+
+      // Container and codec, e.g. "flac/flac".
+      std::string describe() const;
+
+      // Encoded bytes of the first embedded cover, empty if there is none.
+      Buffer cover() const;
 
    private:
       AVFormatContext *fctx;
       AVCodecContext *actx;
+      AVFrame *frame;
+      // Read but not yet taken by the decoder, sent again once it has drained.
+      AVPacket *packet;
+      bool packet_pending;
 
       int aud_stream;
       float last_pos;
       MediaInfo media_info;
-
-      Buffer buffer;
-
-      bool planar_audio;
+      Timing open_timing;
 
       void resolve_codecs();
       void get_media_info();
       void get_metadata(AVDictionary *meta);
 
-      MediaInfo::Format fmt_conv(AVSampleFormat fmt);
+      static MediaInfo::Format fmt_conv(AVSampleFormat fmt);
 };
 
 #endif
@@ -1,5 +1,7 @@
 #include "mainwindow.hpp"
 #include <iostream>
+#include <algorithm>
+#include <time.h>
 
 template <class T, class... A>
 inline T* managed(A&&... args)
@@ -238,6 +240,9 @@ void MainWindow::add_filter(const std::string &name, const std::list<std::string
 
 bool MainWindow::on_timer_tick()
 {
+   if (update_from_page())
+      return true;
+
    try
    {
       Connection con;
@@ -253,6 +258,65 @@ bool MainWindow::on_timer_tick()
    return true;
 }
 
+// A local daemon publishes its state in shared memory, reading that costs no round trip.
+bool MainWindow::update_from_page()
+{
+   if (!status || !status->valid())
+      status.reset(new StatusReader);
+
+   StatusPage::Snapshot snap;
+   if (!status->read(snap))
+   {
+      status.reset();
+      return false;
+   }
+
+   if (snap.state == StatusPage::Stopped)
+   {
+      reset_meta_pos();
+      set_title("uMusC");
+      return true;
+   }
+
+   double pos = snap.position;
+   if (snap.state == StatusPage::Playing)
+   {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      pos += (ts.tv_sec * 1000000000ll + ts.tv_nsec - snap.updated_ns) / 1e9 * snap.speed;
+   }
+
+   show_meta(StatusReader::field(snap, snap.title),
+         StatusReader::field(snap, snap.artist),
+         StatusReader::field(snap, snap.album));
+   show_pos(std::min(pos, snap.duration), snap.duration);
+   return true;
+}
+
+void MainWindow::show_meta(const std::string &title, const std::string &artist, const std::string &album)
+{
+   if (title.empty())
+      set_title("uMusC");
+   else
+      set_title(stringify("uMusC - ", title));
+   meta.title.set_text(title);
+   meta.artist.set_text(artist);
+   meta.album.set_text(album);
+}
+
+void MainWindow::show_pos(unsigned cur, unsigned len)
+{
+   if (cur > len || !len)
+   {
+      progress.set_text("N/A");
+      progress.set_fraction(0);
+      return;
+   }
+
+   progress.set_text(stringify(sec_to_text(cur), " / ", sec_to_text(len)));
+   progress.set_fraction(static_cast<float>(cur) / len);
+}
+
 void MainWindow::reset_meta_pos()
 {
    progress.set_text("N/A");
@@ -297,11 +361,7 @@ void MainWindow::update_pos(Connection &con)
 
       unsigned cur = std::strtoul(list[0].c_str(), nullptr, 0);
       unsigned len = std::strtoul(list[1].c_str(), nullptr, 0);
-      if (cur > len || !len)
-         throw std::logic_error("Current position is larger than total length.");
-
-      progress.set_text(stringify(sec_to_text(cur), " / ", sec_to_text(len)));
-      progress.set_fraction(static_cast<float>(cur) / len);
+      show_pos(cur, len);
    }
    catch(const std::exception &e)
    {
@@ -315,13 +375,8 @@ void MainWindow::update_meta(Connection &con)
    try
    {
       auto title = con.command("TITLE\r\n");
-      if (title.empty())
-         set_title("uMusC");
-      else
-         set_title(stringify("uMusC - ", title));
-      meta.title.set_text(title);
-      meta.artist.set_text(con.command("ARTIST\r\n"));
-      meta.album.set_text(con.command("ALBUM\r\n"));
+      auto artist = con.command("ARTIST\r\n");
+      show_meta(title, artist, con.command("ALBUM\r\n"));
    }
    catch(const std::exception &e)
    {
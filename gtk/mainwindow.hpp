@@ -1,6 +1,8 @@
 #include <gtkmm.h>
 #include "connection.hpp"
+#include "../statuspage.hpp"
 #include <list>
+#include <memory>
 
 class MainWindow : public Gtk::Window
 {
@@ -45,7 +47,12 @@ class MainWindow : public Gtk::Window
       void queue_file(const std::vector<std::string> &path);
       void update_meta(Connection &con);
       void update_pos(Connection &con);
+      bool update_from_page();
+      void show_meta(const std::string &title, const std::string &artist, const std::string &album);
+      void show_pos(unsigned cur, unsigned len);
       void reset_meta_pos();
+
+      std::unique_ptr<StatusReader> status;
       void seek(float rel);
 
       static std::string sec_to_text(unsigned sec);
@@ -0,0 +1,319 @@
+#include "library.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <set>
+
+// ASCII is folded to lower case and punctuation splits words, anything else is kept as is.
+static std::string fold(const std::string &str)
+{
+   std::string res(str);
+   for (auto &c : res)
+   {
+      unsigned char u = c;
+      if (u >= 0x80 || (u >= '0' && u <= '9') || (u >= 'a' && u <= 'z'))
+         continue;
+      else if (u >= 'A' && u <= 'Z')
+         c = u - 'A' + 'a';
+      else
+         c = ' ';
+   }
+   return res;
+}
+
+static std::vector<std::string> words(const std::string &folded)
+{
+   return string_split(folded, " \n");
+}
+
+// Trigrams live in the low 24 bits, one and two byte word prefixes are tagged above them.
+static inline std::uint32_t trigram(const std::string &word, std::size_t i)
+{
+   return (std::uint32_t(std::uint8_t(word[i])) << 16) |
+      (std::uint32_t(std::uint8_t(word[i + 1])) << 8) |
+      std::uint32_t(std::uint8_t(word[i + 2]));
+}
+
+static inline std::uint32_t prefix(const std::string &word)
+{
+   if (word.size() == 1)
+      return (1u << 24) | std::uint8_t(word[0]);
+   return (2u << 24) | (std::uint32_t(std::uint8_t(word[0])) << 8) | std::uint8_t(word[1]);
+}
+
+static std::set<std::uint32_t> keys(const std::string &folded)
+{
+   std::set<std::uint32_t> res;
+   for (auto &word : words(folded))
+   {
+      res.insert(prefix(word.substr(0, 1)));
+      if (word.size() >= 2)
+         res.insert(prefix(word.substr(0, 2)));
+      for (std::size_t i = 0; i + 3 <= word.size(); i++)
+         res.insert(trigram(word, i));
+   }
+   return res;
+}
+
+Library::Library()
+   : live(0), posting_count(0), build_ns(0), searches(0), search_ns(0), last_search_ns(0)
+{}
+
+void Library::unlink(std::uint32_t id)
+{
+   for (auto key : keys(entries[id].folded))
+   {
+      auto itr = postings.find(key);
+      if (itr == std::end(postings))
+         continue;
+
+      auto &list = itr->second;
+      auto pos = std::lower_bound(std::begin(list), std::end(list), id);
+      if (pos != std::end(list) && *pos == id)
+      {
+         list.erase(pos);
+         posting_count--;
+      }
+
+      if (list.empty())
+         postings.erase(itr);
+   }
+}
+
+void Library::update(const Track &track)
+{
+   std::int64_t start = monotonic_ns();
+   std::string folded = fold(track.title) + '\n' + fold(track.artist) + '\n' + fold(track.album);
+
+   std::lock_guard<std::mutex> hold(lock);
+
+   std::uint32_t id;
+   auto itr = ids.find(track.path);
+   if (itr != std::end(ids))
+   {
+      id = itr->second;
+      if (entries[id].folded == folded)
+      {
+         entries[id].track = track;
+         return;
+      }
+
+      unlink(id);
+      live--;
+   }
+   else
+   {
+      id = entries.size();
+      entries.push_back(Entry());
+      ids[track.path] = id;
+   }
+
+   auto &entry = entries[id];
+   entry.track = track;
+   entry.folded = std::move(folded);
+   entry.alive = true;
+   live++;
+
+   // Ids only grow while building, so this is an append almost always.
+   for (auto key : keys(entry.folded))
+   {
+      auto &list = postings[key];
+      auto pos = std::lower_bound(std::begin(list), std::end(list), id);
+      if (pos == std::end(list) || *pos != id)
+      {
+         list.insert(pos, id);
+         posting_count++;
+      }
+   }
+
+   build_ns += monotonic_ns() - start;
+}
+
+void Library::remove(const std::string &path)
+{
+   std::lock_guard<std::mutex> hold(lock);
+
+   auto itr = ids.find(path);
+   if (itr == std::end(ids))
+      return;
+
+   drop(itr);
+}
+
+Library::IdMap::iterator Library::drop(IdMap::iterator itr)
+{
+   auto id = itr->second;
+   unlink(id);
+   entries[id] = Entry();
+   entries[id].alive = false;
+   live--;
+   return ids.erase(itr);
+}
+
+void Library::retain(const std::string &dir, const std::vector<std::string> &files)
+{
+   std::lock_guard<std::mutex> hold(lock);
+
+   std::string prefix = dir + '/';
+   for (auto itr = ids.lower_bound(prefix);
+         itr != std::end(ids) && !itr->first.compare(0, prefix.size(), prefix); )
+   {
+      if (std::binary_search(std::begin(files), std::end(files), itr->first))
+      {
+         ++itr;
+         continue;
+      }
+
+      itr = drop(itr);
+   }
+}
+
+int Library::score(const Entry &entry, const std::vector<std::string> &words) const
+{
+   // Title matches weigh most, then artist, then album. Starting a word counts double.
+   static const int weights[] = { 3, 2, 1 };
+
+   int total = 0;
+   for (auto &word : words)
+   {
+      std::size_t start = 0;
+      for (unsigned field = 0; field < 3 && start <= entry.folded.size(); field++)
+      {
+         std::size_t end = entry.folded.find('\n', start);
+         if (end == std::string::npos)
+            end = entry.folded.size();
+
+         std::size_t pos = entry.folded.find(word, start);
+         if (pos != std::string::npos && pos + word.size() <= end)
+         {
+            total += weights[field];
+            if (pos == start || entry.folded[pos - 1] == ' ')
+               total += weights[field];
+         }
+
+         start = end + 1;
+      }
+   }
+
+   return total;
+}
+
+std::vector<Library::Track> Library::search(const std::string &query,
+      std::size_t offset, std::size_t count, std::size_t &total)
+{
+   std::int64_t start = monotonic_ns();
+   auto list = words(fold(query));
+   total = 0;
+
+   std::lock_guard<std::mutex> hold(lock);
+
+   // Intersect the shortest posting lists first.
+   std::vector<const std::vector<std::uint32_t>*> lists;
+   bool missing = list.empty();
+   for (auto &word : list)
+   {
+      std::vector<std::uint32_t> word_keys;
+      if (word.size() < 3)
+         word_keys.push_back(prefix(word));
+      else
+         for (std::size_t i = 0; i + 3 <= word.size(); i++)
+            word_keys.push_back(trigram(word, i));
+
+      for (auto key : word_keys)
+      {
+         auto itr = postings.find(key);
+         if (itr == std::end(postings))
+            missing = true;
+         else
+            lists.push_back(&itr->second);
+      }
+   }
+
+   std::vector<std::pair<int, std::uint32_t>> ranked;
+   if (!missing)
+   {
+      std::sort(std::begin(lists), std::end(lists),
+            [](const std::vector<std::uint32_t> *a, const std::vector<std::uint32_t> *b) {
+               return a->size() < b->size();
+            });
+
+      // Walk the shortest list and binary search the rest, common keys
+      // like word prefixes can cover most of the library.
+      std::vector<std::vector<std::uint32_t>::const_iterator> cursors;
+      for (auto l : lists)
+         cursors.push_back(std::begin(*l));
+
+      for (auto id : *lists.front())
+      {
+         bool present = true;
+         for (std::size_t i = 1; i < lists.size() && present; i++)
+         {
+            cursors[i] = std::lower_bound(cursors[i], std::end(*lists[i]), id);
+            present = cursors[i] != std::end(*lists[i]) && *cursors[i] == id;
+         }
+
+         if (!present)
+            continue;
+
+         // Trigrams only say a word might be there, check it really is.
+         auto &entry = entries[id];
+         bool match = std::all_of(std::begin(list), std::end(list), [&entry](const std::string &word) {
+               return word.size() < 3 || entry.folded.find(word) != std::string::npos;
+            });
+
+         if (match)
+            ranked.push_back({score(entry, list), id});
+      }
+   }
+
+   total = ranked.size();
+   std::vector<Track> res;
+   if (offset < total)
+   {
+      std::size_t end = total - offset < count ? total : offset + count;
+      std::partial_sort(std::begin(ranked), std::begin(ranked) + end, std::end(ranked),
+            [this](const std::pair<int, std::uint32_t> &a, const std::pair<int, std::uint32_t> &b) {
+               if (a.first != b.first)
+                  return a.first > b.first;
+               return entries[a.second].track.path < entries[b.second].track.path;
+            });
+
+      for (std::size_t i = offset; i < end; i++)
+         res.push_back(entries[ranked[i].second].track);
+   }
+
+   last_search_ns = monotonic_ns() - start;
+   search_ns += last_search_ns;
+   searches++;
+   return res;
+}
+
+std::string Library::stats()
+{
+   std::lock_guard<std::mutex> hold(lock);
+
+   // Rough heap footprint, containers plus the strings they own.
+   std::size_t bytes = entries.capacity() * sizeof(Entry);
+   for (auto &entry : entries)
+   {
+      bytes += entry.track.path.capacity() + entry.track.title.capacity() +
+         entry.track.artist.capacity() + entry.track.album.capacity() +
+         entry.folded.capacity();
+   }
+   for (auto &id : ids)
+      bytes += 4 * sizeof(void*) + sizeof(id) + id.first.capacity();
+   for (auto &list : postings)
+      bytes += 2 * sizeof(void*) + sizeof(list) + list.second.capacity() * sizeof(std::uint32_t);
+   bytes += postings.bucket_count() * sizeof(void*);
+
+   return stringify("tracks=", live,
+         " keys=", postings.size(),
+         " postings=", posting_count,
+         " bytes=", bytes,
+         " bytes_per_track=", live ? bytes / live : 0,
+         " build_ms=", build_ns / 1000000.0,
+         " searches=", searches,
+         " search_us=", searches ? search_ns / 1000.0 / searches : 0.0,
+         " last_search_us=", last_search_ns / 1000.0);
+}
+
@@ -0,0 +1,64 @@
+#ifndef LIBRARY_HPP__
+#define LIBRARY_HPP__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <cstddef>
+#include <cstdint>
+
+// In-memory search index over title, artist and album of every scanned track.
+// Words of three or more characters match anywhere through a trigram index,
+// shorter ones only match the start of a word. Fed incrementally by the scanner.
+class Library
+{
+   public:
+      Library();
+      void operator=(const Library &) = delete;
+
+      struct Track
+      {
+         std::string path;
+         std::string title, artist, album;
+      };
+
+      void update(const Track &track);
+      void remove(const std::string &path);
+      // Drops every track below dir that is not in the sorted list of files.
+      void retain(const std::string &dir, const std::vector<std::string> &files);
+
+      // Ranked best first, total is the number of matches before paging.
+      std::vector<Track> search(const std::string &query,
+            std::size_t offset, std::size_t count, std::size_t &total);
+
+      std::string stats();
+
+   private:
+      struct Entry
+      {
+         Track track;
+         // Lower case title, artist and album separated by newlines.
+         std::string folded;
+         bool alive;
+      };
+
+      std::mutex lock;
+      std::vector<Entry> entries;
+      typedef std::map<std::string, std::uint32_t> IdMap;
+      IdMap ids;
+      std::unordered_map<std::uint32_t, std::vector<std::uint32_t>> postings;
+      std::size_t live, posting_count;
+
+      std::int64_t build_ns;
+      unsigned long searches;
+      std::int64_t search_ns, last_search_ns;
+
+      void unlink(std::uint32_t id);
+      IdMap::iterator drop(IdMap::iterator itr);
+      int score(const Entry &entry, const std::vector<std::string> &words) const;
+};
+
+#endif
+
@@ -0,0 +1,222 @@
+#include "loudness.hpp"
+
+#include <cmath>
+#include <algorithm>
+
+static inline double energy_to_lufs(double energy)
+{
+   return -0.691 + 10.0 * std::log10(energy);
+}
+
+static inline double lufs_to_energy(double lufs)
+{
+   return std::pow(10.0, (lufs + 0.691) / 10.0);
+}
+
+LoudnessMeter::LoudnessMeter(unsigned channels, unsigned rate)
+   : channels(channels), rate(rate), state(channels),
+   block_frames(rate / 10), block_pos(0), block_energy(0.0), peak(0.0f)
+{
+   // K-weighting, re-derived for the actual sample rate.
+   double f0 = 1681.974450955533;
+   double gain = 3.999843853973347;
+   double q = 0.7071752369554196;
+
+   double k = std::tan(M_PI * f0 / rate);
+   double vh = std::pow(10.0, gain / 20.0);
+   double vb = std::pow(vh, 0.4996667741545416);
+   double a0 = 1.0 + k / q + k * k;
+
+   shelf.b0 = (vh + vb * k / q + k * k) / a0;
+   shelf.b1 = 2.0 * (k * k - vh) / a0;
+   shelf.b2 = (vh - vb * k / q + k * k) / a0;
+   shelf.a1 = 2.0 * (k * k - 1.0) / a0;
+   shelf.a2 = (1.0 - k / q + k * k) / a0;
+
+   f0 = 38.13547087602444;
+   q = 0.5003270373238773;
+   k = std::tan(M_PI * f0 / rate);
+   a0 = 1.0 + k / q + k * k;
+
+   highpass.b0 = 1.0;
+   highpass.b1 = -2.0;
+   highpass.b2 = 1.0;
+   highpass.a1 = 2.0 * (k * k - 1.0) / a0;
+   highpass.a2 = (1.0 - k / q + k * k) / a0;
+
+   // Surrounds of a 5.1 layout count +1.5 dB, LFE is ignored.
+   for (unsigned c = 0; c < channels; c++)
+   {
+      std::fill(std::begin(state[c].z), std::end(state[c].z), 0.0);
+      std::fill(std::begin(state[c].history), std::end(state[c].history), 0.0f);
+      state[c].weight = 1.0;
+   }
+
+   if (channels == 6)
+   {
+      state[3].weight = 0.0;
+      state[4].weight = 1.41;
+      state[5].weight = 1.41;
+   }
+
+   // Windowed sinc interpolator for true peak, 12 taps per phase.
+   oversample = rate < 96000 ? 4 : (rate < 192000 ? 2 : 1);
+   taps.resize(12 * oversample);
+   for (unsigned i = 0; i < taps.size(); i++)
+   {
+      double x = (static_cast<double>(i) - (taps.size() - 1) / 2.0) / oversample;
+      double sinc = x == 0.0 ? 1.0 : std::sin(M_PI * x) / (M_PI * x);
+      double window = 0.5 * (1.0 - std::cos(2.0 * M_PI * (i + 0.5) / taps.size()));
+      taps[i] = sinc * window;
+   }
+}
+
+float LoudnessMeter::measure_peak(ChannelState &ch, float sample)
+{
+   std::copy(ch.history + 1, ch.history + 12, ch.history);
+   ch.history[11] = sample;
+
+   float max = std::fabs(sample);
+   for (unsigned phase = 0; phase < oversample; phase++)
+   {
+      float sum = 0.0f;
+      for (unsigned i = 0; i < 12; i++)
+         sum += ch.history[i] * taps[i * oversample + phase];
+      max = std::max(max, std::fabs(sum));
+   }
+
+   return max;
+}
+
+void LoudnessMeter::process(const float *samples, std::size_t frames)
+{
+   for (std::size_t f = 0; f < frames; f++, samples += channels)
+   {
+      double sum = 0.0;
+      for (unsigned c = 0; c < channels; c++)
+      {
+         auto &ch = state[c];
+         double x = samples[c];
+
+         // Direct form II transposed, shelf then high-pass.
+         double y = shelf.b0 * x + ch.z[0];
+         ch.z[0] = shelf.b1 * x - shelf.a1 * y + ch.z[1];
+         ch.z[1] = shelf.b2 * x - shelf.a2 * y;
+
+         double out = highpass.b0 * y + ch.z[2];
+         ch.z[2] = highpass.b1 * y - highpass.a1 * out + ch.z[3];
+         ch.z[3] = highpass.b2 * y - highpass.a2 * out;
+
+         sum += ch.weight * out * out;
+
+         if (oversample > 1)
+            peak = std::max(peak, measure_peak(ch, samples[c]));
+         else
+            peak = std::max(peak, std::fabs(samples[c]));
+      }
+
+      block_energy += sum;
+      if (++block_pos == block_frames)
+      {
+         blocks.push_back(block_energy / block_frames);
+         block_energy = 0.0;
+         block_pos = 0;
+      }
+   }
+}
+
+double LoudnessMeter::gated_mean(const std::vector<double> &energy, double relative_gate)
+{
+   double abs_gate = lufs_to_energy(-70.0);
+
+   double sum = 0.0;
+   std::size_t count = 0;
+   for (auto e : energy)
+   {
+      if (e > abs_gate)
+      {
+         sum += e;
+         count++;
+      }
+   }
+
+   if (!count)
+      return 0.0;
+
+   double rel_gate = lufs_to_energy(energy_to_lufs(sum / count) + relative_gate);
+
+   sum = 0.0;
+   count = 0;
+   for (auto e : energy)
+   {
+      if (e > abs_gate && e > rel_gate)
+      {
+         sum += e;
+         count++;
+      }
+   }
+
+   return count ? sum / count : 0.0;
+}
+
+float LoudnessMeter::integrated() const
+{
+   // 400 ms momentary blocks with 75 % overlap.
+   std::vector<double> momentary;
+   for (std::size_t i = 3; i < blocks.size(); i++)
+      momentary.push_back((blocks[i - 3] + blocks[i - 2] + blocks[i - 1] + blocks[i]) / 4.0);
+
+   double mean = gated_mean(momentary, -10.0);
+   return mean > 0.0 ? energy_to_lufs(mean) : -70.0;
+}
+
+float LoudnessMeter::range() const
+{
+   // 3 s short-term blocks, every 100 ms.
+   std::vector<double> short_term;
+   double window = 0.0;
+   for (std::size_t i = 0; i < blocks.size(); i++)
+   {
+      window += blocks[i];
+      if (i >= 30)
+         window -= blocks[i - 30];
+      if (i >= 29)
+         short_term.push_back(window / 30.0);
+   }
+
+   double abs_gate = lufs_to_energy(-70.0);
+   double sum = 0.0;
+   std::size_t count = 0;
+   for (auto e : short_term)
+   {
+      if (e > abs_gate)
+      {
+         sum += e;
+         count++;
+      }
+   }
+
+   if (!count)
+      return 0.0f;
+
+   double rel_gate = lufs_to_energy(energy_to_lufs(sum / count) - 20.0);
+
+   std::vector<double> gated;
+   for (auto e : short_term)
+      if (e > abs_gate && e > rel_gate)
+         gated.push_back(energy_to_lufs(e));
+
+   if (gated.empty())
+      return 0.0f;
+
+   std::sort(std::begin(gated), std::end(gated));
+   double low = gated[static_cast<std::size_t>(0.10 * (gated.size() - 1) + 0.5)];
+   double high = gated[static_cast<std::size_t>(0.95 * (gated.size() - 1) + 0.5)];
+   return high - low;
+}
+
+float LoudnessMeter::true_peak() const
+{
+   return peak > 0.0f ? 20.0f * std::log10(peak) : -144.0f;
+}
+
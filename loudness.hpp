@@ -0,0 +1,52 @@
+#ifndef LOUDNESS_HPP__
+#define LOUDNESS_HPP__
+
+#include <vector>
+#include <cstddef>
+
+// EBU R128 / ITU-R BS.1770 meter: integrated loudness, loudness range and true peak.
+class LoudnessMeter
+{
+   public:
+      LoudnessMeter(unsigned channels, unsigned rate);
+
+      // Interleaved float samples.
+      void process(const float *samples, std::size_t frames);
+
+      float integrated() const;
+      float range() const;
+      float true_peak() const;
+
+   private:
+      unsigned channels;
+      unsigned rate;
+
+      struct Biquad
+      {
+         double b0, b1, b2, a1, a2;
+      };
+      Biquad shelf, highpass;
+
+      struct ChannelState
+      {
+         double z[4];
+         double weight;
+         float history[12];
+      };
+      std::vector<ChannelState> state;
+
+      // 100 ms sub-blocks of channel-weighted mean square energy.
+      std::size_t block_frames, block_pos;
+      double block_energy;
+      std::vector<double> blocks;
+
+      unsigned oversample;
+      std::vector<float> taps;
+      float peak;
+
+      float measure_peak(ChannelState &ch, float sample);
+      static double gated_mean(const std::vector<double> &energy, double relative_gate);
+};
+
+#endif
+
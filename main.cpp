@@ -1,11 +1,30 @@
 #include "player.hpp"
+#include "config.hpp"
+#include "utils.hpp"
 #include <iostream>
 #include <stdexcept>
+#include <cstdlib>
+#include <cstring>
 
 int main(int argc, char *argv[])
 {
    try
    {
+      const char *home = getenv("HOME");
+      if (!home || !config().load(stringify(home, "/.umusd.conf")))
+         config().load("/etc/umusd.conf");
+
+      for (int i = 1; i < argc; i++)
+      {
+         if (!strcmp(argv[i], "-c") && i + 1 < argc)
+         {
+            if (!config().load(argv[++i]))
+               throw std::runtime_error(stringify("Failed to load config ", argv[i], ".\n"));
+         }
+         else
+            config().parse(argv[i]);
+      }
+
       Player p;
       p.run();
    }
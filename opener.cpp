@@ -0,0 +1,89 @@
+#include "opener.hpp"
+#include "timers.hpp"
+
+#include <iostream>
+#include <algorithm>
+
+Opener::Opener(EventHandler &handler) : tasks(handler.task_queue())
+{}
+
+Opener::~Opener()
+{
+   // Cancelling interrupts FFmpeg's I/O, so nobody is left inside it once main returns.
+   for (auto &job : running)
+      job->cancelled = true;
+   for (auto &job : running)
+      job->thread.join();
+}
+
+void Opener::open(const std::string &path, Callback callback)
+{
+   cancel();
+
+   current = std::make_shared<Job>();
+   current->path = path;
+   current->cancelled = false;
+   this->callback = callback;
+
+   // Joined once its result is back on the loop, a new open never waits on an old one.
+   auto job = current;
+   auto tasks = this->tasks;
+   std::weak_ptr<Opener> self = shared_from_this();
+   running.push_back(job);
+   job->thread = std::thread([job, tasks, self] {
+      try
+      {
+         job->ff = std::make_shared<FF>(job->path, &job->cancelled);
+      }
+      catch(const std::exception &e)
+      {
+         job->error = e.what();
+      }
+
+      tasks->post([job, self] {
+         if (auto opener = self.lock())
+            opener->finish(job);
+      });
+   });
+}
+
+void Opener::cancel()
+{
+   if (!current)
+      return;
+
+   current->cancelled = true;
+   current.reset();
+
+   auto cb = std::move(callback);
+   callback = Callback();
+   if (cb)
+      cb(Status::Cancelled, std::shared_ptr<FF>());
+}
+
+bool Opener::pending() const
+{
+   return static_cast<bool>(current);
+}
+
+void Opener::finish(const std::shared_ptr<Job> &job)
+{
+   // The worker is done bar returning.
+   job->thread.join();
+   running.erase(std::remove(std::begin(running), std::end(running), job), std::end(running));
+
+   // Superseded jobs are simply dropped here.
+   if (job != current)
+      return;
+
+   current.reset();
+   auto cb = std::move(callback);
+   callback = Callback();
+
+   if (!job->ff)
+      std::cerr << job->path << ": " << job->error;
+
+   if (cb)
+      cb(job->ff ? Status::Opened : Status::Failed, job->ff);
+}
+
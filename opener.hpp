@@ -0,0 +1,57 @@
+#ifndef OPENER_HPP__
+#define OPENER_HPP__
+
+#include "ffmpeg.hpp"
+#include "eventhandler.hpp"
+
+#include <string>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Opens and probes files on a worker thread, so a slow mount never stalls
+// the event loop. Completion is posted back to the loop as a task.
+// Only the latest open counts, starting another one cancels it.
+class Opener : public std::enable_shared_from_this<Opener>
+{
+   public:
+      enum class Status
+      {
+         Opened,
+         Failed,
+         Cancelled
+      };
+      typedef std::function<void (Status, std::shared_ptr<FF>)> Callback;
+
+      explicit Opener(EventHandler &handler);
+      ~Opener();
+      void operator=(const Opener &) = delete;
+
+      void open(const std::string &path, Callback callback);
+      void cancel();
+      bool pending() const;
+
+   private:
+      struct Job
+      {
+         std::string path;
+         std::atomic<bool> cancelled;
+         std::shared_ptr<FF> ff;
+         std::string error;
+         std::thread thread;
+      };
+
+      // Held by the workers, one stuck in a blocking open may outlive the loop.
+      std::shared_ptr<TaskQueue> tasks;
+      std::shared_ptr<Job> current;
+      // Every job whose worker has not been joined, superseded ones included.
+      std::vector<std::shared_ptr<Job>> running;
+      Callback callback;
+
+      void finish(const std::shared_ptr<Job> &job);
+};
+
+#endif
+
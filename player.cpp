@@ -1,8 +1,17 @@
 #include "player.hpp"
+#include "wavfile.hpp"
+#include "stream.hpp"
+#include "config.hpp"
+#include "dsp.hpp"
+#include "utils.hpp"
+#include "ttfa.hpp"
 #include <stdexcept>
 #include <iostream>
+#include <algorithm>
+#include <limits>
+#include <sys/mman.h>
 
-Player::Player()
+Player::Player() : analyzer(library)
 {
    cmd = std::make_shared<TCPCommand>(42878);
    cmd->set_remote(*this);
@@ -10,8 +19,35 @@ Player::Player()
    event = std::unique_ptr<EventHandler>(new EventHandler);
    dev = std::shared_ptr<Audio>(new ALSA);
    dev->set_remote(*this);
+   dev->set_source(fanout);
+   fanout.set_master(dev);
+
+   fanout.set_crossfade(config().get_float("crossfade", 0.0f));
+
+   try
+   {
+      dev->set_eq(config().get("eq", ""));
+   }
+   catch(const std::exception &e)
+   {
+      std::cerr << e.what() << std::endl;
+   }
+   fanout.set_upcoming([this]() { return upcoming(); });
+
+   if (config().get_bool("rt_mlockall", false) && mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+      std::cerr << "Failed to lock daemon memory." << std::endl;
+
+   opener = std::make_shared<Opener>(*event);
+   preopener = std::make_shared<Opener>(*event);
+   preopened = FanOut::Track{nullptr, 1.0f, ""};
+   walker = std::make_shared<Walker>(*event);
+   watcher = std::make_shared<Watcher>(*walker, analyzer, library);
 
    event->add(cmd);
+   event->add(watcher);
+
+   for (auto &root : string_split(config().get("library_roots"), ","))
+      watcher->add_root(root);
 }
 
 void Player::run()
@@ -19,71 +55,232 @@ void Player::run()
    while (event->wait());
 }
 
-void Player::play_media(const std::string &path)
+void Player::play_media(std::function<void ()> start, Reply reply)
 {
-   if (!path.empty())
-      queue.current(path);
+   std::string path = queue.current();
+   TTFA::mark(TTFA::Queued);
+
+   // Whatever plays now keeps playing until the new file is open.
+   opener->open(path, [this, path, start, reply](Opener::Status status, std::shared_ptr<FF> opened) {
+      bool ok = status == Opener::Status::Opened;
+      if (ok)
+      {
+         try
+         {
+            ff = opened;
+            auto &timing = ff->timing();
+            TTFA::mark(TTFA::Opened, timing.opened);
+            TTFA::mark(TTFA::Probed, timing.probed);
+            TTFA::mark(TTFA::CodecOpened, timing.codec_opened);
+            TTFA::media(ff->describe());
+
+            fanout.set_media(ff);
+            fanout.set_gain(track_gain(path));
+            start();
+            publish();
+
+            // Have the art ready by the time a client asks for it.
+            std::string file;
+            covers.lookup(path, file);
+         }
+         catch(const std::exception &e)
+         {
+            std::cerr << e.what() << std::endl;
+            ok = false;
+         }
+      }
 
-   ff = std::make_shared<FF>(queue.current());
-   dev->set_media(ff);
+      if (reply)
+         reply(ok ? "OK" : (status == Opener::Status::Cancelled ? "CANCELLED" : "ERROR"));
+   });
+}
+
+FanOut::Track Player::upcoming()
+{
+   auto &path = queue.peek();
+   if (path.empty())
+      return FanOut::Track{nullptr, 1.0f, ""};
+
+   // Opened in the background, the crossfade asks again until it is ready.
+   if (preopened.path != path)
+   {
+      preopened = FanOut::Track{nullptr, 1.0f, path};
+      preopener->open(path, [this, path](Opener::Status status, std::shared_ptr<FF> opened) {
+         if (status == Opener::Status::Opened && preopened.path == path)
+         {
+            preopened.ff = opened;
+            preopened.gain = track_gain(path);
+         }
+      });
+   }
+
+   // Handed out once, a failed open is not retried either.
+   auto track = preopened;
+   preopened.ff.reset();
+   return track;
+}
+
+float Player::track_gain(const std::string &path)
+{
+   if (!config().get_bool("loudness_normalize", true))
+      return 1.0f;
+
+   // Unanalyzed tracks play at unity gain, but jump the analysis queue.
+   Analyzer::Result result;
+   if (!analyzer.lookup(path, result))
+   {
+      analyzer.enqueue(path, true);
+      return 1.0f;
+   }
+
+   // Never push the true peak above full scale.
+   float db = config().get_float("loudness_target", -18.0f) - result.integrated;
+   db = std::min(db, -result.peak);
+   return db_to_gain(db);
 }
 
 void Player::play_audio()
 {
+   event->remove(*dev);
+
+   ff->set_format(dev->best_format(ff->native_format(), dev->default_device()));
    auto info = ff->info();
+   info.channels = dev->best_channels(info.channels, dev->default_device());
    dev->init(info.channels, info.rate, info.fmt, dev->default_device());
+   TTFA::mark(TTFA::DeviceInit);
+   fanout.init(info);
    event->add(dev);
 }
 
-void Player::play(const std::string& path)
+void Player::play(const std::string& path, Reply reply)
 {
-   play_media(path);
-   play_audio();
+   if (path.empty())
+   {
+      play_media([this] { play_audio(); }, reply);
+      return;
+   }
+
+   // Even a stat can stall on a slow share, so the walker tells files and directories apart.
+   walker->check(path, [this, path, reply](bool directory) {
+      // A directory plays its first file and queues the rest once scanned.
+      if (directory)
+      {
+         walker->scan(path, [this, reply](std::vector<std::string> files) {
+            if (files.empty())
+            {
+               if (reply)
+                  reply("ERROR");
+               return;
+            }
+
+            queue.current(files.front());
+            files.erase(files.begin());
+            queue.add(files);
+            analyzer.enqueue(files);
+            play_media([this] { play_audio(); }, reply);
+         });
+         return;
+      }
+
+      queue.current(path);
+      play_media([this] { play_audio(); }, reply);
+   });
 }
 
 void Player::add(const std::string& path)
 {
    if (path.empty())
+   {
       queue.clear();
-   else
-      queue.add(path);
+      return;
+   }
+
+   walker->check(path, [this, path](bool directory) {
+      if (directory)
+      {
+         walker->scan(path, [this](std::vector<std::string> files) {
+            queue.add(files);
+            analyzer.enqueue(files);
+         });
+      }
+      else
+      {
+         queue.add(path);
+         analyzer.enqueue(path);
+      }
+   });
 }
 
 void Player::stop()
 {
+   opener->cancel();
    dev->stop();
    event->remove(*dev);
+   fanout.stop();
    ff.reset();
+   publish();
 }
 
 void Player::prev()
 {
    queue.prev();
-
-   stop();
-   play();
+   play_media([this] { play_audio(); });
 }
 
 void Player::next()
 {
-   FF::MediaInfo old_info{};
-   if (ff)
-      old_info = ff->info();
-
    queue.next();
-   play_media();
 
+   // A crossfade already has the track open and playing.
+   if (auto incoming = fanout.take_incoming(queue.current()))
+   {
+      opener->cancel();
+      ff = incoming;
+      publish();
+      return;
+   }
+
+   play_media([this] { start_next(); });
+}
+
+void Player::track_end()
+{
+   // A file being opened takes over when ready, the finished one must not ask again.
+   if (opener->pending())
+      fanout.set_media(std::weak_ptr<FF>());
+   else
+      next();
+}
+
+void Player::publish()
+{
+   if (!status_page.enabled())
+      return;
+
+   StatusPage::State state = StatusPage::Stopped;
+   if (ff)
+      state = dev->active() ? StatusPage::Playing : StatusPage::Paused;
+   status_page.update(state, ff, queue.current(), dev->xruns(), fanout.speed());
+}
+
+void Player::start_next()
+{
+   auto &old_info = fanout.output();
    auto &new_info = ff->info();
+   auto fmt = dev->best_format(ff->native_format(), dev->default_device());
+   auto channels = dev->best_channels(new_info.channels, dev->default_device());
 
-   // Attempt gapless
-   if (old_info.channels != new_info.channels ||
+   // Attempt gapless, crossfading converts rather than reopening the device.
+   bool convert = fanout.crossfade() > 0.0f && old_info.channels;
+   if ((!convert && (old_info.channels != channels ||
          old_info.rate != new_info.rate ||
-         old_info.fmt != new_info.fmt ||
-         !ff ||
+         old_info.fmt != fmt)) ||
          !dev->active())
-   {
-      event->remove(*dev);
       play_audio();
+   else
+   {
+      // The device might have drained while the file opened, and waits for data.
+      dev->handle(*event);
    }
 }
 
@@ -103,18 +300,33 @@ void Player::pause()
    if (dev->active())
    {
       event->remove(*dev);
-      dev->stop();
+      if (!dev->pause(true))
+         dev->stop();
    }
+   publish();
 }
 
 void Player::unpause()
 {
-   auto info = media_info();
+   if (!ff)
+      throw std::logic_error("FFmpeg file not loaded.\n");
+
+   if (dev->paused() && dev->pause(false))
+   {
+      TTFA::mark(TTFA::DeviceInit);
+      event->add(dev);
+      publish();
+      return;
+   }
+
+   auto &info = fanout.output();
    if (!dev->active())
    {
       dev->init(info.channels, info.rate, info.fmt, dev->default_device());
+      TTFA::mark(TTFA::DeviceInit);
       event->add(dev);
    }
+   publish();
 }
 
 std::pair<float, float> Player::pos() const
@@ -131,6 +343,8 @@ void Player::seek(float pos)
       throw std::logic_error("FFmpeg file not loaded.\n");
 
    ff->seek(pos);
+   fanout.discard();
+   publish();
 }
 
 std::string Player::status() const
@@ -143,3 +357,133 @@ std::string Player::status() const
       return "STOPPED";
 }
 
+void Player::add_sink(const std::string &type,
+      const std::string &dev, unsigned depth)
+{
+   std::shared_ptr<Audio> sink;
+   if (type == "alsa")
+      sink = std::make_shared<ALSA>();
+   else if (type == "wav")
+      sink = std::make_shared<WAVFile>();
+   else if (type == "stream")
+      sink = std::make_shared<StreamServer>(dev.empty() ? "wav:42879" : dev);
+   else
+      throw std::logic_error("Unknown sink type.\n");
+
+   // Only sinks with their own sockets join the event loop, never a secondary device.
+   bool evented = !sink->pollfds().empty();
+
+   sink->set_remote(*this);
+   fanout.attach(sink, dev.empty() ? sink->default_device() : dev, depth);
+
+   if (evented)
+      event->add(sink);
+}
+
+void Player::remove_sink(const std::string &dev)
+{
+   auto sink = fanout.detach(dev);
+   if (!sink->pollfds().empty())
+      event->remove(*sink);
+}
+
+std::vector<FanOut::Stats> Player::sinks() const
+{
+   return fanout.stats();
+}
+
+void Player::analyze(const std::string &path)
+{
+   analyzer.enqueue(path);
+}
+
+std::string Player::loudness(const std::string &path)
+{
+   if (path.empty())
+      return analyzer.stats();
+
+   Analyzer::Result result;
+   if (!analyzer.lookup(path, result))
+      return "PENDING";
+
+   return stringify(result.integrated, " ", result.peak, " ", result.range);
+}
+
+std::vector<Library::Track> Player::search(const std::string &query,
+      std::size_t offset, std::size_t count, std::size_t &total)
+{
+   return library.search(query, offset, count, total);
+}
+
+std::size_t Player::queue_search(const std::string &query)
+{
+   std::size_t total;
+   auto tracks = library.search(query, 0, std::numeric_limits<std::size_t>::max(), total);
+   for (auto &track : tracks)
+      queue.add(track.path);
+   return tracks.size();
+}
+
+std::string Player::library_stats()
+{
+   return library.stats();
+}
+
+void Player::watch(const std::string &dir)
+{
+   walker->check(dir, [this, dir](bool directory) {
+      if (directory)
+         watcher->add_root(dir);
+      else
+         std::cerr << dir << " is not a directory." << std::endl;
+   });
+}
+
+std::string Player::watch_stats() const
+{
+   return watcher->stats();
+}
+
+CoverArt::State Player::cover(const std::string &path, std::string &file)
+{
+   if (path.empty())
+      return ff ? covers.lookup(queue.current(), file) : CoverArt::State::Missing;
+   return covers.lookup(path, file);
+}
+
+std::string Player::cover_stats()
+{
+   return covers.stats();
+}
+
+std::string Player::client_stats() const
+{
+   return cmd->stats();
+}
+
+void Player::set_crossfade(float seconds)
+{
+   fanout.set_crossfade(seconds);
+}
+
+float Player::crossfade() const
+{
+   return fanout.crossfade();
+}
+
+void Player::set_speed(float speed)
+{
+   fanout.set_speed(speed);
+   publish();
+}
+
+float Player::speed() const
+{
+   return fanout.speed();
+}
+
+void Player::set_eq(const std::string &dev, const std::string &spec)
+{
+   fanout.set_eq(dev, spec);
+}
+
@@ -3,21 +3,36 @@
 
 #include <memory>
 #include <utility>
+#include <functional>
 
 #include "alsa.hpp"
 #include "ffmpeg.hpp"
+#include "fanout.hpp"
 #include "tcpcommand.hpp"
 #include "eventhandler.hpp"
 #include "queue.hpp"
+#include "analysis.hpp"
+#include "library.hpp"
+#include "cover.hpp"
+#include "opener.hpp"
+#include "walker.hpp"
+#include "watcher.hpp"
+#include "statuswriter.hpp"
 
 class Remote
 {
    public:
-      virtual void play(const std::string &path = "") = 0;
+      // Answers a command that completes later.
+      typedef std::function<void (const std::string &)> Reply;
+
+      virtual void play(const std::string &path = "", Reply reply = Reply()) = 0;
       virtual void add(const std::string &path) = 0;
       virtual void stop() = 0;
       virtual void prev() = 0;
       virtual void next() = 0;
+      virtual void track_end() = 0;
+      // Refreshes the shared memory status page, called from the playback path.
+      virtual void publish() = 0;
 
       virtual void pause() = 0;
       virtual void unpause() = 0;
@@ -28,6 +43,37 @@ class Remote
       virtual const FF::MediaInfo media_info() const = 0;
 
       virtual std::string status() const = 0;
+
+      virtual void add_sink(const std::string &type,
+            const std::string &dev, unsigned depth) = 0;
+      virtual void remove_sink(const std::string &dev) = 0;
+      virtual std::vector<FanOut::Stats> sinks() const = 0;
+
+      virtual void analyze(const std::string &path) = 0;
+      virtual std::string loudness(const std::string &path) = 0;
+
+      virtual std::vector<Library::Track> search(const std::string &query,
+            std::size_t offset, std::size_t count, std::size_t &total) = 0;
+      // Queues every match in ranked order, returns how many.
+      virtual std::size_t queue_search(const std::string &query) = 0;
+      virtual std::string library_stats() = 0;
+      virtual void watch(const std::string &dir) = 0;
+      virtual std::string watch_stats() const = 0;
+
+      // An empty path asks for the current track.
+      virtual CoverArt::State cover(const std::string &path, std::string &file) = 0;
+      virtual std::string cover_stats() = 0;
+
+      virtual std::string client_stats() const = 0;
+
+      virtual void set_crossfade(float seconds) = 0;
+      virtual float crossfade() const = 0;
+
+      virtual void set_speed(float speed) = 0;
+      virtual float speed() const = 0;
+
+      // An output by device name, as listed by SINKS.
+      virtual void set_eq(const std::string &dev, const std::string &spec) = 0;
 };
 
 class Player : public Remote
@@ -36,10 +82,12 @@ class Player : public Remote
       Player();
       void run();
 
-      void play(const std::string &path = "");
+      void play(const std::string &path = "", Reply reply = Reply());
       void add(const std::string &path);
       void stop();
       void next();
+      void track_end();
+      void publish();
       void prev();
       void pause();
       void unpause();
@@ -49,15 +97,57 @@ class Player : public Remote
       virtual const FF::MediaInfo media_info() const;
       std::string status() const;
 
+      void add_sink(const std::string &type,
+            const std::string &dev, unsigned depth);
+      void remove_sink(const std::string &dev);
+      std::vector<FanOut::Stats> sinks() const;
+
+      void analyze(const std::string &path);
+      std::string loudness(const std::string &path);
+
+      std::vector<Library::Track> search(const std::string &query,
+            std::size_t offset, std::size_t count, std::size_t &total);
+      std::size_t queue_search(const std::string &query);
+      std::string library_stats();
+      void watch(const std::string &dir);
+      std::string watch_stats() const;
+
+      CoverArt::State cover(const std::string &path, std::string &file);
+      std::string cover_stats();
+
+      std::string client_stats() const;
+
+      void set_crossfade(float seconds);
+      float crossfade() const;
+
+      void set_speed(float speed);
+      float speed() const;
+
+      void set_eq(const std::string &dev, const std::string &spec);
+
    private:
-      std::shared_ptr<TCPCommand> cmd;
+      // Outlives the sockets, which hand their pending I/O back to it.
       std::unique_ptr<EventHandler> event;
+      std::shared_ptr<TCPCommand> cmd;
       std::shared_ptr<Audio> dev;
       std::shared_ptr<FF> ff;
+      FanOut fanout;
       PlayQueue queue;
+      Library library;
+      Analyzer analyzer;
+      CoverArt covers;
+      StatusWriter status_page;
+
+      std::shared_ptr<Opener> opener, preopener;
+      std::shared_ptr<Walker> walker;
+      std::shared_ptr<Watcher> watcher;
+      FanOut::Track preopened;
 
-      void play_media(const std::string &path = "");
+      void play_media(std::function<void ()> start, Reply reply = Reply());
+      void start_next();
+      FanOut::Track upcoming();
       void play_audio();
+      float track_gain(const std::string &path);
 };
 
 #endif
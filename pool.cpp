@@ -0,0 +1,48 @@
+#include "pool.hpp"
+
+PCMPool::Node *PCMPool::grow()
+{
+   std::unique_ptr<Node> node(new Node);
+   node->data.reserve(block_size);
+   node->refs = 0;
+   node->pool = this;
+   node->next = nullptr;
+
+   nodes.push_back(std::move(node));
+   return nodes.back().get();
+}
+
+void PCMPool::reserve(std::size_t bytes, unsigned count)
+{
+   if (bytes > block_size)
+   {
+      block_size = bytes;
+      for (auto &node : nodes)
+         node->data.reserve(block_size);
+   }
+
+   while (nodes.size() < count)
+      recycle(grow());
+}
+
+PCMPool::Block PCMPool::acquire()
+{
+   // Running dry only happens while sinks are still warming up.
+   Node *node = free_list;
+   if (node)
+      free_list = node->next;
+   else
+      node = grow();
+
+   node->refs = 1;
+   node->next = nullptr;
+   node->data.clear();
+   return Block(node);
+}
+
+void PCMPool::recycle(Node *node)
+{
+   node->next = free_list;
+   free_list = node;
+}
+
@@ -0,0 +1,80 @@
+#ifndef POOL_HPP__
+#define POOL_HPP__
+
+#include "ffmpeg.hpp"
+
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include <utility>
+
+// Recycled, refcounted PCM blocks shared between the sinks of a FanOut.
+// Blocks are only acquired and released on the event loop thread.
+class PCMPool
+{
+   private:
+      struct Node;
+
+   public:
+      class Block
+      {
+         public:
+            Block() : node(nullptr) {}
+            Block(const Block &block) : node(block.node) { if (node) node->refs++; }
+            Block(Block &&block) : node(block.node) { block.node = nullptr; }
+            ~Block() { release(); }
+
+            Block &operator=(Block block)
+            {
+               std::swap(node, block.node);
+               return *this;
+            }
+
+            explicit operator bool() const { return node; }
+            const FF::Buffer &operator*() const { return node->data; }
+            const FF::Buffer *operator->() const { return &node->data; }
+
+            // Only valid for the producer, before the block is shared.
+            FF::Buffer &buffer() { return node->data; }
+
+         private:
+            friend class PCMPool;
+            explicit Block(Node *node) : node(node) {}
+
+            Node *node;
+
+            void release()
+            {
+               if (node && --node->refs == 0)
+                  node->pool->recycle(node);
+               node = nullptr;
+            }
+      };
+
+      PCMPool() : free_list(nullptr), block_size(0) {}
+      void operator=(const PCMPool &) = delete;
+
+      void reserve(std::size_t bytes, unsigned count);
+      Block acquire();
+
+      std::size_t size() const { return nodes.size(); }
+
+   private:
+      struct Node
+      {
+         FF::Buffer data;
+         unsigned refs;
+         PCMPool *pool;
+         Node *next;
+      };
+
+      std::vector<std::unique_ptr<Node>> nodes;
+      Node *free_list;
+      std::size_t block_size;
+
+      Node *grow();
+      void recycle(Node *node);
+};
+
+#endif
+
@@ -28,6 +28,12 @@ const std::string& PlayQueue::current()
    return queue.current;
 }
 
+const std::string& PlayQueue::peek() const
+{
+   static const std::string none;
+   return queue.next.empty() ? none : queue.next.front();
+}
+
 void PlayQueue::prev()
 {
    if (queue.prev.empty())
@@ -60,3 +66,8 @@ void PlayQueue::add(const std::string &path)
    queue.next.push_back(path);
 }
 
+void PlayQueue::add(const std::vector<std::string> &paths)
+{
+   queue.next.insert(queue.next.end(), paths.begin(), paths.end());
+}
+
@@ -3,15 +3,19 @@
 
 #include <deque>
 #include <string>
+#include <vector>
 
 class PlayQueue
 {
    public:
       void current(const std::string &current);
       void add(const std::string &path);
+      void add(const std::vector<std::string> &paths);
       void clear();
 
       const std::string &current();
+      // The path next() would move to, or an empty string.
+      const std::string &peek() const;
 
       void prev();
       void next();
@@ -0,0 +1,222 @@
+#include "remix.hpp"
+#include "utils.hpp"
+
+extern "C" {
+#include <libavutil/avutil.h>
+}
+
+#include <cmath>
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+std::map<std::string, Remixer::Cost> Remixer::costs;
+
+static std::uint64_t checked_layout(std::uint64_t layout, unsigned channels)
+{
+   if (!layout || static_cast<unsigned>(__builtin_popcountll(layout)) != channels)
+      return av_get_default_channel_layout(channels);
+   return layout;
+}
+
+static int channel_index(std::uint64_t layout, std::uint64_t channel)
+{
+   if (!(layout & channel))
+      return -1;
+   return __builtin_popcountll(layout & (channel - 1));
+}
+
+static std::string layout_name(std::uint64_t layout, unsigned channels)
+{
+   char buf[64];
+   av_get_channel_layout_string(buf, sizeof(buf), channels, layout);
+   return buf;
+}
+
+Remixer::Remixer(std::uint64_t in_layout, unsigned in_channels, unsigned out_channels)
+   : in_channels(in_channels), out_channels(out_channels),
+   matrix(in_channels * out_channels), columns(4 * in_channels)
+{
+   in_layout = checked_layout(in_layout, in_channels);
+   std::uint64_t out_layout = checked_layout(0, out_channels);
+   build(in_layout, out_layout);
+
+   for (unsigned i = 0; i < in_channels && out_channels == 2; i++)
+   {
+      columns[4 * i + 0] = columns[4 * i + 2] = matrix[i];
+      columns[4 * i + 1] = columns[4 * i + 3] = matrix[in_channels + i];
+   }
+
+   cost = &costs[layout_name(in_layout, in_channels) + "->" +
+      layout_name(out_layout, out_channels)];
+}
+
+void Remixer::build(std::uint64_t in_layout, std::uint64_t out_layout)
+{
+   const float minus_3db = std::sqrt(0.5f);
+   unsigned in = 0;
+
+   auto add = [&](std::uint64_t channel, float gain) -> bool {
+      int out = channel_index(out_layout, channel);
+      if (out < 0)
+         return false;
+      matrix[out * in_channels + in] += gain;
+      return true;
+   };
+
+   auto add_pair = [&](std::uint64_t left, std::uint64_t right, float gain) -> bool {
+      if (channel_index(out_layout, left) < 0 || channel_index(out_layout, right) < 0)
+         return false;
+      return add(left, gain) && add(right, gain);
+   };
+
+   for (unsigned bit = 0; bit < 64 && in < in_channels; bit++)
+   {
+      std::uint64_t channel = 1ull << bit;
+      if (!(in_layout & channel))
+         continue;
+
+      bool mapped = add(channel, 1.0f);
+
+      if (!mapped)
+      {
+         switch (channel)
+         {
+            case AV_CH_LOW_FREQUENCY:
+               mapped = true;
+               break;
+
+            case AV_CH_FRONT_CENTER:
+               // Mono spreads at full level, a centre speaker at -3 dB.
+               mapped = add_pair(AV_CH_FRONT_LEFT, AV_CH_FRONT_RIGHT,
+                     in_channels == 1 ? 1.0f : minus_3db);
+               break;
+
+            case AV_CH_FRONT_LEFT_OF_CENTER:
+               mapped = add(AV_CH_FRONT_LEFT, 1.0f) || add(AV_CH_FRONT_CENTER, minus_3db);
+               break;
+
+            case AV_CH_FRONT_RIGHT_OF_CENTER:
+               mapped = add(AV_CH_FRONT_RIGHT, 1.0f) || add(AV_CH_FRONT_CENTER, minus_3db);
+               break;
+
+            case AV_CH_SIDE_LEFT:
+               mapped = add(AV_CH_BACK_LEFT, 1.0f) || add(AV_CH_FRONT_LEFT, minus_3db);
+               break;
+
+            case AV_CH_SIDE_RIGHT:
+               mapped = add(AV_CH_BACK_RIGHT, 1.0f) || add(AV_CH_FRONT_RIGHT, minus_3db);
+               break;
+
+            case AV_CH_BACK_LEFT:
+               mapped = add(AV_CH_SIDE_LEFT, 1.0f) || add(AV_CH_FRONT_LEFT, minus_3db);
+               break;
+
+            case AV_CH_BACK_RIGHT:
+               mapped = add(AV_CH_SIDE_RIGHT, 1.0f) || add(AV_CH_FRONT_RIGHT, minus_3db);
+               break;
+
+            case AV_CH_BACK_CENTER:
+               mapped = add_pair(AV_CH_BACK_LEFT, AV_CH_BACK_RIGHT, minus_3db) ||
+                  add_pair(AV_CH_SIDE_LEFT, AV_CH_SIDE_RIGHT, minus_3db) ||
+                  add_pair(AV_CH_FRONT_LEFT, AV_CH_FRONT_RIGHT, 0.5f);
+               break;
+
+            default:
+               break;
+         }
+      }
+
+      // Left and right into mono, and whatever is left over into the front.
+      if (!mapped)
+      {
+         mapped = add(AV_CH_FRONT_CENTER, minus_3db) ||
+            add_pair(AV_CH_FRONT_LEFT, AV_CH_FRONT_RIGHT, 0.5f);
+      }
+
+      if (!mapped)
+         matrix[(in % out_channels) * in_channels + in] += 1.0f;
+
+      in++;
+   }
+
+   float max_sum = 0.0f;
+   for (unsigned o = 0; o < out_channels; o++)
+   {
+      float sum = 0.0f;
+      for (unsigned i = 0; i < in_channels; i++)
+         sum += std::fabs(matrix[o * in_channels + i]);
+      max_sum = std::max(max_sum, sum);
+   }
+
+   if (max_sum > 1.0f)
+      for (auto &gain : matrix)
+         gain /= max_sum;
+}
+
+void Remixer::mix_generic(const float *in, float *out, std::size_t frames)
+{
+   for (std::size_t f = 0; f < frames; f++, in += in_channels, out += out_channels)
+   {
+      for (unsigned o = 0; o < out_channels; o++)
+      {
+         const float *row = &matrix[o * in_channels];
+         float sum = 0.0f;
+         for (unsigned i = 0; i < in_channels; i++)
+            sum += row[i] * in[i];
+         out[o] = sum;
+      }
+   }
+}
+
+void Remixer::mix_stereo(const float *in, float *out, std::size_t frames)
+{
+   std::size_t f = 0;
+
+#ifdef __SSE2__
+   // Two frames per vector, lanes are L0 R0 L1 R1.
+   for (; f + 2 <= frames; f += 2)
+   {
+      const float *a = in + f * in_channels;
+      const float *b = a + in_channels;
+
+      __m128 acc = _mm_setzero_ps();
+      for (unsigned i = 0; i < in_channels; i++)
+      {
+         __m128 samples = _mm_set_ps(b[i], b[i], a[i], a[i]);
+         acc = _mm_add_ps(acc, _mm_mul_ps(samples, _mm_loadu_ps(&columns[4 * i])));
+      }
+      _mm_storeu_ps(out + 2 * f, acc);
+   }
+#endif
+
+   mix_generic(in + f * in_channels, out + 2 * f, frames - f);
+}
+
+void Remixer::process(const float *in, float *out, std::size_t frames)
+{
+   std::int64_t start = monotonic_ns();
+
+   if (out_channels == 2)
+      mix_stereo(in, out, frames);
+   else
+      mix_generic(in, out, frames);
+
+   cost->frames += frames;
+   cost->ns += monotonic_ns() - start;
+}
+
+std::string Remixer::report()
+{
+   std::vector<std::string> lines;
+   for (auto &entry : costs)
+   {
+      double per_frame = entry.second.frames ?
+         static_cast<double>(entry.second.ns) / entry.second.frames : 0.0;
+      lines.push_back(stringify(entry.first, " ", entry.second.frames, " ", per_frame));
+   }
+   return string_join(lines, "\n");
+}
+
@@ -0,0 +1,46 @@
+#ifndef REMIX_HPP__
+#define REMIX_HPP__
+
+#include <vector>
+#include <string>
+#include <map>
+#include <cstddef>
+#include <cstdint>
+
+// Mixes interleaved float frames from one channel layout into another with
+// a downmix matrix in the usual ITU style. LFE is dropped, centre and
+// surrounds fold in at -3 dB, and rows are normalized so nothing clips.
+class Remixer
+{
+   public:
+      Remixer(std::uint64_t in_layout, unsigned in_channels, unsigned out_channels);
+
+      void process(const float *in, float *out, std::size_t frames);
+
+      // Measured cost per layout pair, one line each.
+      static std::string report();
+
+   private:
+      unsigned in_channels, out_channels;
+
+      // out_channels rows of in_channels gains.
+      std::vector<float> matrix;
+      // Stereo output, per input channel the gains as L R L R.
+      std::vector<float> columns;
+
+      struct Cost
+      {
+         unsigned long long frames;
+         unsigned long long ns;
+      };
+      Cost *cost;
+      // Only touched from the event loop.
+      static std::map<std::string, Cost> costs;
+
+      void build(std::uint64_t in_layout, std::uint64_t out_layout);
+      void mix_generic(const float *in, float *out, std::size_t frames);
+      void mix_stereo(const float *in, float *out, std::size_t frames);
+};
+
+#endif
+
@@ -0,0 +1,107 @@
+#ifndef RING_HPP__
+#define RING_HPP__
+
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <sys/mman.h>
+
+// Lock-free single producer, single consumer byte ring.
+// All memory is allocated up front in resize(), never by write() or consume().
+class PCMRing
+{
+   public:
+      PCMRing() : read_ptr(0), write_ptr(0), locked(false) {}
+      ~PCMRing() { unlock(); }
+
+      void operator=(const PCMRing &) = delete;
+
+      // Not thread-safe, only call while the consumer is stopped.
+      // Capacity is a whole number of granules, so with writes in whole
+      // granules peek() never splits one across the wrap.
+      void resize(std::size_t size, std::size_t granule = 1)
+      {
+         unlock();
+
+         granule = std::max<std::size_t>(granule, 1);
+         std::size_t capacity = std::max<std::size_t>((size + granule - 1) / granule, 1) * granule;
+
+         buffer.assign(capacity, 0);
+         clear();
+      }
+
+      bool lock()
+      {
+         if (!locked && !buffer.empty())
+            locked = mlock(buffer.data(), buffer.size()) == 0;
+         return locked;
+      }
+
+      void clear()
+      {
+         read_ptr.store(0);
+         write_ptr.store(0);
+      }
+
+      std::size_t size() const { return buffer.size(); }
+
+      std::size_t read_avail() const
+      {
+         return write_ptr.load(std::memory_order_acquire) -
+            read_ptr.load(std::memory_order_relaxed);
+      }
+
+      std::size_t write_avail() const
+      {
+         return buffer.size() - (write_ptr.load(std::memory_order_relaxed) -
+               read_ptr.load(std::memory_order_acquire));
+      }
+
+      std::size_t write(const std::uint8_t *data, std::size_t size)
+      {
+         size = std::min(size, write_avail());
+
+         std::size_t ptr = write_ptr.load(std::memory_order_relaxed);
+         std::size_t offset = ptr % buffer.size();
+         std::size_t first = std::min(size, buffer.size() - offset);
+
+         std::copy(data, data + first, buffer.data() + offset);
+         std::copy(data + first, data + size, buffer.data());
+
+         write_ptr.store(ptr + size, std::memory_order_release);
+         return size;
+      }
+
+      // Largest contiguous readable region.
+      std::size_t peek(const std::uint8_t *&data) const
+      {
+         std::size_t ptr = read_ptr.load(std::memory_order_relaxed);
+         std::size_t offset = ptr % buffer.size();
+
+         data = buffer.data() + offset;
+         return std::min(read_avail(), buffer.size() - offset);
+      }
+
+      void consume(std::size_t size)
+      {
+         read_ptr.store(read_ptr.load(std::memory_order_relaxed) + size,
+               std::memory_order_release);
+      }
+
+   private:
+      std::vector<std::uint8_t> buffer;
+      std::atomic<std::size_t> read_ptr, write_ptr;
+      bool locked;
+
+      void unlock()
+      {
+         if (locked)
+            munlock(buffer.data(), buffer.size());
+         locked = false;
+      }
+};
+
+#endif
+
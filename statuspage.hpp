@@ -0,0 +1,132 @@
+#ifndef STATUSPAGE_HPP__
+#define STATUSPAGE_HPP__
+
+// Playback state the daemon publishes in POSIX shared memory, so local clients
+// can poll it without a round trip through the command socket.
+// Header only and without daemon dependencies, clients include it as is.
+// Link with -lrt on glibc older than 2.34.
+
+#include <atomic>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+struct StatusPage
+{
+   enum : std::uint32_t
+   {
+      Magic = 0x736d7575, // "uums"
+      Version = 2,
+      StringSpace = 4096
+   };
+
+   enum State : std::uint32_t
+   {
+      Stopped,
+      Playing,
+      Paused
+   };
+
+   // Byte range in Snapshot::strings, also NUL terminated there.
+   struct Field
+   {
+      std::uint32_t offset, size;
+   };
+
+   struct Snapshot
+   {
+      std::uint32_t state;
+      std::uint32_t xruns;
+      // Bumped whenever a different track starts, strings are only rewritten then.
+      std::uint64_t track;
+      // CLOCK_MONOTONIC time of the position, for extrapolating while playing.
+      std::int64_t updated_ns;
+      double position, duration;
+      // Media seconds per second, position moves this fast while playing.
+      double speed;
+      Field path, title, artist, album;
+      char strings[StringSpace];
+   };
+
+   std::uint32_t magic, version, size;
+   // Seqlock, odd while the daemon is writing.
+   std::atomic<std::uint32_t> sequence;
+   Snapshot data;
+};
+
+class StatusReader
+{
+   public:
+      explicit StatusReader(const char *name = "/umusd-status") : page(nullptr)
+      {
+         int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+         if (fd < 0)
+            return;
+
+         struct stat st;
+         if (fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(StatusPage)))
+         {
+            void *ptr = mmap(nullptr, sizeof(StatusPage), PROT_READ, MAP_SHARED, fd, 0);
+            if (ptr != MAP_FAILED)
+               page = static_cast<const StatusPage*>(ptr);
+         }
+         close(fd);
+
+         if (page && (page->magic != StatusPage::Magic ||
+                  page->version != StatusPage::Version || page->size != sizeof(StatusPage)))
+         {
+            munmap(const_cast<StatusPage*>(page), sizeof(StatusPage));
+            page = nullptr;
+         }
+      }
+
+      ~StatusReader()
+      {
+         if (page)
+            munmap(const_cast<StatusPage*>(page), sizeof(StatusPage));
+      }
+
+      void operator=(const StatusReader &) = delete;
+
+      bool valid() const { return page; }
+
+      // Copies out a consistent snapshot without any syscall.
+      // False if there is no page or the daemon kept writing through every try.
+      bool read(StatusPage::Snapshot &snapshot) const
+      {
+         // The daemon clears the magic on exit, a restarted one makes a new page.
+         if (!page || page->magic != StatusPage::Magic)
+            return false;
+
+         for (unsigned tries = 0; tries < 1000; tries++)
+         {
+            std::uint32_t before = page->sequence.load(std::memory_order_acquire);
+            if (before & 1)
+               continue;
+
+            std::memcpy(&snapshot, &page->data, sizeof(snapshot));
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            if (page->sequence.load(std::memory_order_relaxed) == before)
+               return true;
+         }
+         return false;
+      }
+
+      static std::string field(const StatusPage::Snapshot &snapshot, const StatusPage::Field &field)
+      {
+         if (field.offset + field.size > sizeof(snapshot.strings))
+            return "";
+         return std::string(snapshot.strings + field.offset, field.size);
+      }
+
+   private:
+      const StatusPage *page;
+};
+
+#endif
+
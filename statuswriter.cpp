@@ -0,0 +1,110 @@
+#include "statuswriter.hpp"
+#include "ffmpeg.hpp"
+#include "config.hpp"
+#include "utils.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <new>
+
+StatusWriter::StatusWriter() : page(nullptr)
+{
+   name = config().get("status_page", "/umusd-status");
+   if (name.empty())
+      return;
+
+   // Readable by everyone, written only by us.
+   int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+   if (fd < 0)
+   {
+      std::cerr << "Failed to create status page " << name << "." << std::endl;
+      return;
+   }
+
+   void *ptr = MAP_FAILED;
+   if (ftruncate(fd, sizeof(StatusPage)) == 0)
+      ptr = mmap(nullptr, sizeof(StatusPage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+
+   if (ptr == MAP_FAILED)
+   {
+      std::cerr << "Failed to map status page " << name << "." << std::endl;
+      shm_unlink(name.c_str());
+      return;
+   }
+
+   page = new (ptr) StatusPage;
+   page->sequence.store(0, std::memory_order_relaxed);
+   std::memset(&page->data, 0, sizeof(page->data));
+   page->size = sizeof(StatusPage);
+   page->version = StatusPage::Version;
+   // Last, a reader seeing the magic sees a complete header.
+   std::atomic_thread_fence(std::memory_order_release);
+   page->magic = StatusPage::Magic;
+}
+
+StatusWriter::~StatusWriter()
+{
+   if (!page)
+      return;
+
+   page->magic = 0;
+   munmap(page, sizeof(StatusPage));
+   shm_unlink(name.c_str());
+}
+
+StatusPage::Field StatusWriter::put(const std::string &str, std::uint32_t &offset)
+{
+   // Long strings are cut, there is always room for the terminator.
+   std::uint32_t room = sizeof(page->data.strings) - offset - 1;
+   std::uint32_t size = std::min<std::size_t>(str.size(), room);
+
+   StatusPage::Field field{offset, size};
+   std::memcpy(page->data.strings + offset, str.data(), size);
+   page->data.strings[offset + size] = '\0';
+   offset += size + 1;
+   return field;
+}
+
+void StatusWriter::update(StatusPage::State state, const std::shared_ptr<FF> &track,
+      const std::string &path, unsigned long xruns, float speed)
+{
+   if (!page)
+      return;
+
+   auto &data = page->data;
+   std::uint32_t sequence = page->sequence.load(std::memory_order_relaxed);
+   page->sequence.store(sequence + 1, std::memory_order_relaxed);
+   std::atomic_thread_fence(std::memory_order_release);
+
+   data.state = track ? state : StatusPage::Stopped;
+   data.xruns = xruns;
+   data.speed = speed;
+   data.updated_ns = monotonic_ns();
+
+   if (track != current.lock())
+   {
+      current = track;
+      data.track++;
+
+      std::uint32_t offset = 0;
+      if (track)
+      {
+         auto &info = track->info();
+         data.duration = info.duration;
+         data.path = put(path, offset);
+         data.title = put(info.title, offset);
+         data.artist = put(info.artist, offset);
+         data.album = put(info.album, offset);
+      }
+      else
+      {
+         data.duration = 0.0;
+         data.path = data.title = data.artist = data.album = put("", offset);
+      }
+   }
+   data.position = track ? track->pos() : 0.0;
+
+   page->sequence.store(sequence + 2, std::memory_order_release);
+}
+
@@ -0,0 +1,37 @@
+#ifndef STATUSWRITER_HPP__
+#define STATUSWRITER_HPP__
+
+#include "statuspage.hpp"
+
+#include <string>
+#include <memory>
+#include <cstdint>
+
+class FF;
+
+// Daemon side of the shared memory status page, written from the loop thread only.
+class StatusWriter
+{
+   public:
+      // Named by status_page in the config, empty turns it off.
+      StatusWriter();
+      ~StatusWriter();
+
+      void operator=(const StatusWriter &) = delete;
+
+      bool enabled() const { return page; }
+
+      void update(StatusPage::State state, const std::shared_ptr<FF> &track,
+            const std::string &path, unsigned long xruns, float speed);
+
+   private:
+      StatusPage *page;
+      std::string name;
+      // Expires with the track, so a new one at the same address still counts as new.
+      std::weak_ptr<FF> current;
+
+      StatusPage::Field put(const std::string &str, std::uint32_t &offset);
+};
+
+#endif
+
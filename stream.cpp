@@ -0,0 +1,216 @@
+#include "stream.hpp"
+#include "tcpcommand.hpp"
+#include "utils.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+#include <cstdlib>
+#include <cerrno>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+StreamServer::StreamServer(const std::string &dev)
+   : fd(-1), wav(true), channels(0), rate(0),
+   fmt(FF::MediaInfo::Format::None), frame_size(0),
+   ring(ring_size), head(0), skipped(0)
+{
+   auto port = dev;
+   auto split = dev.find(':');
+   if (split != std::string::npos)
+   {
+      auto kind = dev.substr(0, split);
+      if (kind == "pcm")
+         wav = false;
+      else if (kind != "wav")
+         throw std::logic_error("Stream must be wav:port or pcm:port.\n");
+
+      port = dev.substr(split + 1);
+   }
+
+   unsigned long num = std::strtoul(port.c_str(), nullptr, 0);
+   if (!num || num > 0xffff)
+      throw std::logic_error("Invalid stream port.\n");
+
+   fd = tcp_listen(num, 64);
+}
+
+StreamServer::~StreamServer()
+{
+   drop_listeners();
+   if (fd >= 0)
+      close(fd);
+}
+
+std::string StreamServer::default_device() const
+{
+   return "wav:42879";
+}
+
+bool StreamServer::active() const
+{
+   return fd >= 0;
+}
+
+std::string StreamServer::describe() const
+{
+   return stringify("listeners=", listeners.size(), " skipped=", skipped);
+}
+
+EventHandled::PollList StreamServer::pollfds() const
+{
+   return {{fd, EPOLLIN}};
+}
+
+void StreamServer::init(unsigned channels, unsigned rate,
+      FF::MediaInfo::Format fmt,
+      const std::string &)
+{
+   if (fmt == FF::MediaInfo::Format::None)
+      throw std::runtime_error("Unsupported sample format for stream.\n");
+
+   if (channels == this->channels && rate == this->rate && fmt == this->fmt)
+      return;
+
+   this->channels = channels;
+   this->rate = rate;
+   this->fmt = fmt;
+
+   FF::MediaInfo info{};
+   info.channels = channels;
+   info.fmt = fmt;
+   frame_size = info.frame_size();
+
+   // A WAV listener that already got the old header cannot follow a format change.
+   for (auto itr = std::begin(listeners); itr != std::end(listeners); )
+   {
+      if (wav && itr->header_ptr > 0)
+      {
+         close(itr->fd);
+         itr = listeners.erase(itr);
+      }
+      else
+      {
+         start_listener(*itr);
+         ++itr;
+      }
+   }
+}
+
+void StreamServer::stop()
+{
+   clear_queue();
+}
+
+void StreamServer::drop_listeners()
+{
+   for (auto &listener : listeners)
+      close(listener.fd);
+   listeners.clear();
+}
+
+void StreamServer::start_listener(Listener &listener)
+{
+   listener.cursor = head;
+   if (wav)
+   {
+      wav_header(listener.header, channels, rate, fmt, 0xffffffffu);
+      listener.header_ptr = 0;
+   }
+   else
+      listener.header_ptr = wav_header_size;
+}
+
+void StreamServer::handle(EventHandler &)
+{
+   for (;;)
+   {
+      int newfd = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (newfd < 0)
+         return;
+
+      Listener listener{};
+      listener.fd = newfd;
+      start_listener(listener);
+      listeners.push_back(listener);
+   }
+}
+
+bool StreamServer::send_listener(Listener &listener)
+{
+   if (!frame_size)
+      return true;
+
+   while (listener.header_ptr < wav_header_size)
+   {
+      ssize_t ret = send(listener.fd, listener.header + listener.header_ptr,
+            wav_header_size - listener.header_ptr, MSG_NOSIGNAL);
+      if (ret < 0)
+         return errno == EAGAIN || errno == EWOULDBLOCK;
+
+      listener.header_ptr += ret;
+   }
+
+   // Skip a slow reader forward instead of buffering for it.
+   std::uint64_t lag = head - listener.cursor;
+   if (lag > ring_size)
+   {
+      std::uint64_t excess = lag - ring_size / 2;
+      excess = (excess + frame_size - 1) / frame_size * frame_size;
+      listener.cursor += excess;
+      skipped++;
+   }
+
+   while (listener.cursor < head)
+   {
+      std::size_t offset = listener.cursor % ring_size;
+      std::size_t chunk = std::min<std::uint64_t>(head - listener.cursor, ring_size - offset);
+
+      ssize_t ret = send(listener.fd, ring.data() + offset, chunk, MSG_NOSIGNAL);
+      if (ret < 0)
+         return errno == EAGAIN || errno == EWOULDBLOCK;
+
+      listener.cursor += ret;
+      if (static_cast<std::size_t>(ret) < chunk)
+         break;
+   }
+
+   return true;
+}
+
+void StreamServer::send_all()
+{
+   for (auto itr = std::begin(listeners); itr != std::end(listeners); )
+   {
+      if (send_listener(*itr))
+         ++itr;
+      else
+      {
+         close(itr->fd);
+         itr = listeners.erase(itr);
+      }
+   }
+}
+
+void StreamServer::write(const std::uint8_t *data, std::size_t size)
+{
+   if (size > ring_size)
+   {
+      std::size_t excess = size - ring_size / 2;
+      excess -= excess % std::max(frame_size, 1u);
+      data += excess;
+      head += excess;
+      size -= excess;
+   }
+
+   // One copy into the ring, regardless of the number of listeners.
+   std::size_t offset = head % ring_size;
+   std::size_t first = std::min<std::size_t>(size, ring_size - offset);
+   std::copy(data, data + first, ring.data() + offset);
+   std::copy(data + first, data + size, ring.data());
+   head += size;
+
+   send_all();
+}
+
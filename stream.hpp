@@ -0,0 +1,65 @@
+#ifndef STREAM_HPP__
+#define STREAM_HPP__
+
+#include "audio.hpp"
+#include "wavfile.hpp"
+
+#include <cstdint>
+#include <vector>
+#include <string>
+
+// Serves the decoded program to any number of TCP listeners.
+// Every listener reads from one shared ring buffer through its own cursor.
+class StreamServer : public Audio
+{
+   public:
+      explicit StreamServer(const std::string &dev);
+      ~StreamServer();
+
+      void operator=(const StreamServer &) = delete;
+
+      std::string default_device() const;
+      void init(unsigned channels, unsigned rate,
+            FF::MediaInfo::Format fmt,
+            const std::string &dev);
+
+      void write(const std::uint8_t *data, std::size_t size);
+      void stop();
+
+      void handle(EventHandler &handler);
+
+      bool active() const;
+      std::string describe() const;
+
+      EventHandled::PollList pollfds() const;
+
+   private:
+      int fd;
+      bool wav;
+
+      unsigned channels, rate;
+      FF::MediaInfo::Format fmt;
+      unsigned frame_size;
+
+      enum { ring_size = 1 << 20 };
+      std::vector<std::uint8_t> ring;
+      std::uint64_t head;
+
+      struct Listener
+      {
+         int fd;
+         std::uint64_t cursor;
+         std::uint8_t header[wav_header_size];
+         unsigned header_ptr;
+      };
+      std::vector<Listener> listeners;
+      unsigned long skipped;
+
+      void start_listener(Listener &listener);
+      bool send_listener(Listener &listener);
+      void send_all();
+      void drop_listeners();
+};
+
+#endif
+
@@ -0,0 +1,147 @@
+#include "stretch.hpp"
+#include "dsp.hpp"
+#include <algorithm>
+#include <cmath>
+
+TimeStretch::TimeStretch()
+   : channels(0), sequence(0), overlap(0), window(0), ratio(1.0f),
+   resume(0.0), position(0.0), primed(false)
+{}
+
+void TimeStretch::configure(unsigned channels, unsigned rate)
+{
+   // 40 ms grains, 8 ms overlaps and a 15 ms search suit speech and music alike.
+   this->channels = channels;
+   sequence = rate * 40 / 1000;
+   overlap = rate * 8 / 1000;
+   window = rate * 15 / 1000;
+
+   // Sized up front, the playback path must not allocate.
+   fifo.reserve((sequence + window) * channels * 8);
+   tail.resize(overlap * channels);
+   reset();
+}
+
+void TimeStretch::set_speed(float speed)
+{
+   ratio = std::min(std::max(speed, 0.5f), 2.0f);
+   if (std::fabs(ratio - 1.0f) < 0.005f)
+      ratio = 1.0f;
+}
+
+void TimeStretch::reset()
+{
+   fifo.clear();
+   std::fill(std::begin(tail), std::end(tail), 0.0f);
+   resume = 0.0;
+   position = 0.0;
+   primed = false;
+}
+
+std::size_t TimeStretch::best_offset(const float *in) const
+{
+   std::size_t samples = overlap * channels;
+   const float *ref = tail.data();
+
+   // Normalized cross-correlation, the candidate's energy slides along with it.
+   float energy = dot_product(in, in, samples);
+   float best = -1e30f;
+   std::size_t best_pos = 0;
+
+   for (std::size_t pos = 0; pos < window; pos++)
+   {
+      const float *cand = in + pos * channels;
+      float corr = dot_product(ref, cand, samples);
+      float score = corr / std::sqrt(energy + 1e-9f);
+      if (score > best)
+      {
+         best = score;
+         best_pos = pos;
+      }
+
+      for (unsigned c = 0; c < channels; c++)
+      {
+         energy -= cand[c] * cand[c];
+         energy += cand[samples + c] * cand[samples + c];
+      }
+      energy = std::max(energy, 0.0f);
+   }
+
+   return best_pos;
+}
+
+void TimeStretch::process(const float *in, std::size_t samples, std::vector<float> &out)
+{
+   fifo.insert(std::end(fifo), in, in + samples);
+
+   if (ratio == 1.0f)
+   {
+      flush(out);
+      return;
+   }
+
+   // Above 1.5 times the input skips past the searched span, it has to be there to skip.
+   std::size_t advance = static_cast<std::size_t>((sequence - overlap) * ratio) + 1;
+   std::size_t needed = std::max(window + sequence, advance) * channels;
+   std::size_t consumed = 0;
+
+   while (consumed + needed <= fifo.size())
+   {
+      const float *base = fifo.data() + consumed;
+
+      std::size_t offset = 0;
+      std::size_t start = out.size();
+      if (primed)
+      {
+         offset = best_offset(base);
+         const float *grain = base + offset * channels;
+
+         // Linear crossfade from the previous grain's tail.
+         out.resize(start + overlap * channels);
+         float *dst = out.data() + start;
+         for (std::size_t i = 0; i < overlap; i++)
+         {
+            float t = static_cast<float>(i) / overlap;
+            for (unsigned c = 0; c < channels; c++)
+               dst[i * channels + c] = tail[i * channels + c] * (1.0f - t) + grain[i * channels + c] * t;
+         }
+      }
+      else
+      {
+         // Nothing to blend with yet, the first grain starts as is.
+         out.insert(std::end(out), base, base + overlap * channels);
+      }
+
+      const float *grain = base + offset * channels;
+      out.insert(std::end(out), grain + overlap * channels, grain + (sequence - overlap) * channels);
+      std::copy(grain + (sequence - overlap) * channels, grain + sequence * channels, std::begin(tail));
+      primed = true;
+
+      // Each grain puts out sequence - overlap frames and moves the input on by ratio times that.
+      position += (sequence - overlap) * ratio;
+      std::size_t whole = static_cast<std::size_t>(position);
+      position -= whole;
+      consumed += whole * channels;
+      resume = static_cast<double>(offset + sequence) - whole;
+   }
+
+   fifo.erase(std::begin(fifo), std::begin(fifo) + consumed);
+}
+
+void TimeStretch::flush(std::vector<float> &out)
+{
+   if (primed)
+   {
+      out.insert(std::end(out), std::begin(tail), std::end(tail));
+
+      // At high speed the input after the tail may already be gone, it plays on from here.
+      std::size_t from = resume > 0.0 ? static_cast<std::size_t>(resume) * channels : 0;
+      if (from < fifo.size())
+         out.insert(std::end(out), std::begin(fifo) + from, std::end(fifo));
+   }
+   else
+      out.insert(std::end(out), std::begin(fifo), std::end(fifo));
+
+   reset();
+}
+
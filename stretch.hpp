@@ -0,0 +1,51 @@
+#ifndef STRETCH_HPP__
+#define STRETCH_HPP__
+
+#include <vector>
+#include <cstddef>
+
+// Changes tempo without changing pitch, by WSOLA on interleaved floats.
+// Output is cut into grains, each one taken from wherever around its nominal
+// input position it lines up best with the tail of the previous grain, then
+// crossfaded over that tail. Speed 1 passes audio through untouched.
+class TimeStretch
+{
+   public:
+      TimeStretch();
+
+      void configure(unsigned channels, unsigned rate);
+      // Clamped to [0.5, 2], takes effect on the next grain.
+      void set_speed(float speed);
+      float speed() const { return ratio; }
+      // Most samples one call can hand out beyond twice its input.
+      std::size_t headroom() const { return 2 * (sequence + window) * channels; }
+
+      // True while the stage changes the audio or still holds some of it.
+      bool active() const { return ratio != 1.0f || primed || !fifo.empty(); }
+
+      // Appends output for samples of input. Back at speed 1 it hands out
+      // everything it holds and goes idle.
+      void process(const float *in, std::size_t samples, std::vector<float> &out);
+      // Hands out what it holds at the end of the stream.
+      void flush(std::vector<float> &out);
+      // Forgets held audio, after a seek.
+      void reset();
+
+   private:
+      unsigned channels;
+      // In frames: grain, overlap with the previous grain, and the search window.
+      std::size_t sequence, overlap, window;
+      float ratio;
+
+      std::vector<float> fifo, tail;
+      // Where the source continues after tail, in fifo frames. Negative once skipped.
+      double resume;
+      // Fraction of a frame the input is ahead of the next grain's nominal start.
+      double position;
+      bool primed;
+
+      std::size_t best_offset(const float *in) const;
+};
+
+#endif
+
@@ -1,6 +1,9 @@
 #include "tcpcommand.hpp"
 #include "utils.hpp"
 #include "player.hpp"
+#include "ttfa.hpp"
+#include "uring.hpp"
+#include "config.hpp"
 
 #include <memory>
 #include <stdexcept>
@@ -16,8 +19,11 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
 
-TCPCommand::TCPCommand(std::uint16_t port) : remote(nullptr)
+int tcp_listen(std::uint16_t port, int backlog)
 {
    struct addrinfo hints{}, *servinfo{nullptr};
 
@@ -33,7 +39,8 @@ TCPCommand::TCPCommand(std::uint16_t port) : remote(nullptr)
             freeaddrinfo(info);
          });
 
-   fd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
+   int fd = socket(servinfo->ai_family, servinfo->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+         servinfo->ai_protocol);
    if (fd < 0)
       throw std::runtime_error("Failed to create socket.\n");
 
@@ -42,30 +49,138 @@ TCPCommand::TCPCommand(std::uint16_t port) : remote(nullptr)
    if (bind(fd, servinfo->ai_addr, servinfo->ai_addrlen) < 0)
    {
       close(fd);
-      throw std::runtime_error("Failed to bind socket. umusd is probably already running.\n");
+      throw std::runtime_error(stringify("Failed to bind socket to port ", port, ".\n"));
    }
 
-   if (listen(fd, 10) < 0)
+   if (listen(fd, backlog) < 0)
    {
       close(fd);
       throw std::runtime_error("Failed to listen to socket.\n");
    }
+
+   return fd;
+}
+
+TCPCommand::TCPCommand(std::uint16_t port)
+   : remote(nullptr), sweep_timer(0), accepted(0), expired(0), back_offs(0), peak(0)
+{
+   // Clients reconnect all at once after a restart, the backlog has to hold them.
+   idle_timeout = config().get_int("client_idle_timeout", 300) * 1000000000ll;
+   // A command whose reply never comes, say an open hung on a dead mount, must not pin its client.
+   busy_timeout = config().get_int("client_busy_timeout", 900) * 1000000000ll;
+
+   try
+   {
+      fd = tcp_listen(port, config().get_int("listen_backlog", 1024));
+   }
+   catch(const std::exception &e)
+   {
+      throw std::runtime_error(stringify(e.what(), "umusd is probably already running.\n"));
+   }
 }
 
 void TCPCommand::handle(EventHandler &handler)
 {
-   int newfd = accept(fd, nullptr, nullptr);
-   if (newfd < 0)
-      return;
-   
-   connections.erase(std::remove_if(std::begin(connections), std::end(connections),
-         [](std::shared_ptr<TCPSocket> sock) { return sock->dead(); }),
-         connections.end());
+   // Drains the whole backlog, a connect storm costs one wakeup, not one per client.
+   for (;;)
+   {
+      EventHandler::count_syscalls();
+      int newfd = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (newfd >= 0)
+         add_connection(handler, newfd);
+      else if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+      {
+         back_off(handler);
+         return;
+      }
+      else if (errno != EINTR && errno != ECONNABORTED)
+         return;
+   }
+}
+
+void TCPCommand::back_off(EventHandler &handler)
+{
+   // The pending connection stays ready, so polling on would just spin.
+   std::cerr << "Out of file descriptors, not accepting for a moment." << std::endl;
+   back_offs++;
+   handler.remove(*this);
+
+   std::weak_ptr<EventHandled> weak = shared_from_this();
+   handler.add_timer(100, [weak, &handler] {
+         if (auto self = weak.lock())
+            handler.add(self);
+      });
+}
+
+bool TCPCommand::attach(EventHandler &handler)
+{
+   std::weak_ptr<EventHandled> weak = shared_from_this();
+   return handler.uring()->accept(fd, [this, weak, &handler](int newfd) {
+         if (!weak.lock())
+            return;
+
+         if (newfd >= 0)
+            add_connection(handler, newfd);
+         else if (newfd == -EMFILE || newfd == -ENFILE || newfd == -ENOBUFS || newfd == -ENOMEM)
+            back_off(handler);
+         else
+            std::cerr << "accept() failed, no more connections." << std::endl;
+      });
+}
+
+void TCPCommand::add_connection(EventHandler &handler, int newfd)
+{
+   // Replies are small and a client waits on each one.
+   int yes = 1;
+   EventHandler::count_syscalls();
+   setsockopt(newfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
 
    auto conn = std::make_shared<TCPSocket>(newfd);
-   handler.add(conn);
    conn->set_remote(*remote);
+   handler.add(conn);
    connections.push_back(conn);
+   accepted++;
+   peak = std::max(peak, connections.size());
+
+   if (!sweep_timer)
+   {
+      std::weak_ptr<EventHandled> weak = shared_from_this();
+      sweep_timer = handler.add_timer(1000, [this, weak, &handler] {
+            if (weak.lock())
+               sweep(handler);
+         }, 1000);
+   }
+}
+
+void TCPCommand::sweep(EventHandler &handler)
+{
+   // Once a second, cheaper than a timer per client and a scan on every accept.
+   std::int64_t now = monotonic_ns();
+   std::int64_t cutoff = idle_timeout > 0 ? now - idle_timeout : 0;
+   std::int64_t busy_cutoff = busy_timeout > 0 ? now - busy_timeout : 0;
+   connections.erase(std::remove_if(std::begin(connections), std::end(connections),
+         [this, &handler, cutoff, busy_cutoff](const std::shared_ptr<TCPSocket> &sock) {
+            bool alive = !sock->dead();
+            bool dead = sock->expire(handler, cutoff, busy_cutoff);
+            if (alive && dead)
+               expired++;
+            return dead;
+         }), std::end(connections));
+}
+
+std::string TCPCommand::stats() const
+{
+   // Dead connections linger until the next sweep, a second at most.
+   std::size_t open = std::count_if(std::begin(connections), std::end(connections),
+         [](const std::shared_ptr<TCPSocket> &sock) { return !sock->dead(); });
+
+   return stringify("open=", open,
+         " peak=", peak,
+         " accepted=", accepted,
+         " expired=", expired,
+         " back_offs=", back_offs,
+         " idle_timeout_s=", idle_timeout / 1000000000,
+         " busy_timeout_s=", busy_timeout / 1000000000);
 }
 
 EventHandled::PollList TCPCommand::pollfds() const
@@ -98,8 +213,14 @@ TCPCommand::TCPCommand(TCPCommand &&tcp)
    *this = std::move(tcp);
 }
 
-TCPSocket::TCPSocket(int fd) : fd(fd), is_dead(false)
-{}
+TCPSocket::TCPSocket(int fd)
+   : fd(fd), is_dead(false), uring(nullptr), last_active(monotonic_ns()),
+   writing(false), pending_bytes(0), attached(-1), attached_size(0),
+   awaiting(false), deferring(false)
+{
+   input_limit = std::max(config().get_int("client_input_limit", 64 * 1024), 1024);
+   output_limit = std::max(config().get_int("client_output_limit", 1024 * 1024), 1);
+}
 
 TCPSocket::~TCPSocket() { kill_sock(); }
 
@@ -108,56 +229,223 @@ EventHandled::PollList TCPSocket::pollfds() const
    return {{fd, EPOLLIN}};
 }
 
+bool TCPSocket::attach(EventHandler &handler)
+{
+   std::weak_ptr<EventHandled> weak = shared_from_this();
+   bool ok = handler.uring()->recv(fd, [this, weak, &handler](int ret, const char *data) {
+         auto self = weak.lock();
+         if (!self || is_dead)
+            return;
+
+         if (ret <= 0)
+         {
+            kill_sock();
+            return;
+         }
+
+         if (received(data, ret))
+            run_commands(handler);
+      });
+
+   if (ok)
+      uring = handler.uring();
+   return ok;
+}
+
+bool TCPSocket::expire(EventHandler &handler, std::int64_t cutoff, std::int64_t busy_cutoff)
+{
+   // A reply still going out or a command still running gets longer.
+   // A reply arriving after the close is dropped, the callback checks is_dead.
+   bool busy = writing || awaiting;
+   if (!is_dead && last_active < (busy ? busy_cutoff : cutoff))
+   {
+      handler.remove(*this);
+      kill_sock();
+   }
+   return is_dead;
+}
+
 void TCPSocket::kill_sock()
 {
+   if (uring && fd >= 0)
+      uring->cancel(fd);
    if (fd >= 0)
       close(fd);
    fd = -1;
    is_dead = true;
+
+   for (auto &output : pending)
+      if (output.file >= 0)
+         close(output.file);
+   pending.clear();
+   pending_bytes = 0;
+
+   if (attached >= 0)
+      close(attached);
+   attached = -1;
 }
 
-void TCPSocket::write_all(EventHandler &handler, std::string &&str)
+void TCPSocket::write_all(EventHandler &handler, std::string &&str,
+      int file, std::size_t file_size)
 {
-   handler.remove(*this);
+   // Replies finishing while another one is written go out right after it.
+   if (writing)
+   {
+      pending_bytes += str.size();
+      if (!pending.empty() && pending.back().file < 0)
+      {
+         pending.back().data += str;
+         pending.back().file = file;
+         pending.back().file_size = file_size;
+      }
+      else
+         pending.push_back({std::move(str), file, file_size});
+      return;
+   }
 
-   reply = std::make_shared<SocketReply>(fd, std::move(str),
-         [this, &handler](bool success)
-         {
-            if (success)
-               handler.add(shared_from_this());
-            else
-               kill_sock();
+   writing = true;
+   if (uring && file < 0)
+   {
+      std::weak_ptr<EventHandled> weak = shared_from_this();
+      uring->send(fd, std::move(str), [this, weak, &handler](bool success) {
+            if (!weak.lock())
+               return;
+            write_done(handler, success);
          });
+      return;
+   }
+
+   if (!uring)
+      handler.remove(*this);
+
+   reply = std::make_shared<SocketReply>(fd, std::move(str),
+         [this, &handler](bool success) {
+            write_done(handler, success);
+         }, file, file_size);
 
    handler.add(reply);
 }
 
-void TCPSocket::parse_commands(EventHandler &event)
+void TCPSocket::write_done(EventHandler &handler, bool success)
 {
-   for (;;)
+   writing = false;
+   last_active = monotonic_ns();
+
+   if (!success)
+      kill_sock();
+   else if (!pending.empty())
+   {
+      auto output = std::move(pending.front());
+      pending.pop_front();
+      pending_bytes -= output.data.size();
+      write_all(handler, std::move(output.data), output.file, output.file_size);
+   }
+   else
+   {
+      if (!uring)
+         handler.add(shared_from_this());
+
+      // Commands held back by the output limit.
+      if (command_buf.find("\r\n") != std::string::npos)
+         run_commands(handler);
+   }
+}
+
+bool TCPSocket::attach_file(const std::string &path, std::size_t &size)
+{
+   int file = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+   if (file < 0)
+      return false;
+
+   struct stat st;
+   if (fstat(file, &st) < 0)
+   {
+      close(file);
+      return false;
+   }
+
+   if (attached >= 0)
+      close(attached);
+   attached = file;
+   attached_size = size = st.st_size;
+   return true;
+}
+
+std::function<void (const std::string &)> TCPSocket::defer(EventHandler &event)
+{
+   deferring = true;
+   awaiting = true;
+
+   std::weak_ptr<EventHandled> weak = shared_from_this();
+   return [this, weak, &event](const std::string &str) {
+      auto self = weak.lock();
+      if (!self || !awaiting || is_dead)
+         return;
+
+      awaiting = false;
+      deferred = str;
+
+      // Answered before the command even returned.
+      if (deferring)
+         return;
+
+      try
+      {
+         parse_commands(event, deferred + "\r\n");
+      }
+      catch (const std::exception &e)
+      {
+         std::cerr << e.what() << std::endl;
+         kill_sock();
+      }
+   };
+}
+
+void TCPSocket::parse_commands(EventHandler &event, std::string &&out)
+{
+   // Commands after one still in progress wait, replies keep their order.
+   // A client not reading its replies stops being served until it catches up.
+   while (!awaiting && pending_bytes < output_limit)
    {
       auto first = command_buf.find("\r\n");
       if (first == std::string::npos)
-         return;
+         break;
 
       auto cmd = command_buf.substr(0, first);
+      command_buf.erase(0, first + 2);
 
+      deferring = false;
       auto reply = parse_command(event, cmd);
-      reply += "\r\n";
-
-      write_all(event, std::move(reply));
 
-      command_buf.erase(0, first + 2);
+      if (!deferring)
+         out += reply + "\r\n";
+      else if (!awaiting)
+         out += deferred + "\r\n";
+      deferring = false;
+
+      if (attached >= 0)
+      {
+         write_all(event, std::move(out), attached, attached_size);
+         out.clear();
+         attached = -1;
+      }
    }
+
+   if (!out.empty())
+      write_all(event, std::move(out));
 }
 
 void TCPSocket::handle(EventHandler &event)
 {
-   flush_buffer();
+   if (flush_buffer())
+      run_commands(event);
+}
 
+void TCPSocket::run_commands(EventHandler &event)
+{
    try
    {
-      parse_commands(event);
+      parse_commands(event, std::string());
    }
    catch (const std::exception &e)
    {
@@ -166,17 +454,36 @@ void TCPSocket::handle(EventHandler &event)
    }
 }
 
-void TCPSocket::flush_buffer()
+bool TCPSocket::flush_buffer()
 {
-   char buf[1024];
+   char buf[4096];
+   EventHandler::count_syscalls();
    ssize_t ret = ::read(fd, buf, sizeof(buf));
-   if (ret <= 0)
+   if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+      return false;
+   else if (ret <= 0)
    {
       kill_sock();
-      return;
+      return false;
    }
 
-   command_buf.insert(command_buf.end(), buf, buf + ret);
+   return received(buf, ret);
+}
+
+bool TCPSocket::received(const char *data, std::size_t size)
+{
+   TTFA::received();
+   last_active = monotonic_ns();
+   command_buf.insert(command_buf.end(), data, data + size);
+
+   // Either one absurd line or a flood of commands without reading the replies.
+   if (command_buf.size() > input_limit)
+   {
+      std::cerr << "Client sent more than " << input_limit << " bytes ahead, dropping it." << std::endl;
+      kill_sock();
+      return false;
+   }
+   return true;
 }
 
 bool TCPSocket::dead() const
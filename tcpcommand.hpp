@@ -6,9 +6,14 @@
 #include <map>
 #include <string>
 #include <memory>
+#include <deque>
 #include "command.hpp"
 
 class EventHandler;
+class Uring;
+
+// Nonblocking and close-on-exec, like every socket accepted from it.
+int tcp_listen(std::uint16_t port, int backlog);
 
 class TCPSocket : public Command
 {
@@ -22,22 +27,53 @@ class TCPSocket : public Command
       TCPSocket(TCPSocket &&tcp);
 
       bool dead() const;
+      // Closes the connection if it was last active before cutoff, or before
+      // busy_cutoff while a reply is still pending. True once dead.
+      bool expire(EventHandler &handler, std::int64_t cutoff, std::int64_t busy_cutoff);
       EventHandled::PollList pollfds() const;
       void handle(EventHandler &handler);
+      bool attach(EventHandler &handler);
 
    private:
       int fd;
       bool is_dead;
+      // Set when reads and writes go through io_uring instead of polling.
+      Uring *uring;
+      std::int64_t last_active;
+      std::size_t input_limit, output_limit;
 
       void kill_sock();
       std::string command_buf;
 
-      void flush_buffer();
-      void parse_commands(EventHandler &handler);
+      bool flush_buffer();
+      bool received(const char *data, std::size_t size);
+      void run_commands(EventHandler &handler);
+      void parse_commands(EventHandler &handler, std::string &&out);
 
-      void write_all(EventHandler &handler, std::string &&str);
+      void write_all(EventHandler &handler, std::string &&str,
+            int file = -1, std::size_t file_size = 0);
+      void write_done(EventHandler &handler, bool success);
 
       std::shared_ptr<SocketReply> reply;
+      bool writing;
+
+      // Output queued behind the reply being written, text and the file following it.
+      struct Output
+      {
+         std::string data;
+         int file;
+         std::size_t file_size;
+      };
+      std::deque<Output> pending;
+      std::size_t pending_bytes;
+
+      bool attach_file(const std::string &path, std::size_t &size);
+      int attached;
+      std::size_t attached_size;
+
+      std::function<void (const std::string &)> defer(EventHandler &handler);
+      bool awaiting, deferring;
+      std::string deferred;
 };
 
 class TCPCommand : public EventHandled
@@ -53,11 +89,22 @@ class TCPCommand : public EventHandled
       void handle(EventHandler &handler);
 
       void set_remote(Remote &remote);
+      bool attach(EventHandler &handler);
+
+      std::string stats() const;
 
    private:
       int fd;
       Remote *remote;
       std::vector<std::shared_ptr<TCPSocket>> connections;
+      std::uint64_t sweep_timer;
+      std::int64_t idle_timeout, busy_timeout;
+      unsigned long accepted, expired, back_offs;
+      std::size_t peak;
+
+      void add_connection(EventHandler &handler, int newfd);
+      void back_off(EventHandler &handler);
+      void sweep(EventHandler &handler);
 };
 
 #endif
@@ -0,0 +1,205 @@
+#include "timers.hpp"
+#include "utils.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+#include <functional>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+Timers::Timers() : next_id(1), armed(0)
+{
+   fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+   if (fd < 0)
+      throw std::runtime_error("Failed to create timerfd.\n");
+}
+
+Timers::~Timers()
+{
+   close(fd);
+}
+
+std::uint64_t Timers::add(std::int64_t delay_ns, std::int64_t period_ns, Task task)
+{
+   std::uint64_t id = next_id++;
+   timers[id] = Timer{period_ns, std::move(task)};
+   push(monotonic_ns() + std::max<std::int64_t>(delay_ns, 0), id);
+   arm();
+   return id;
+}
+
+void Timers::cancel(std::uint64_t id)
+{
+   if (!timers.erase(id))
+      return;
+
+   // Dead entries would otherwise pile up behind long timeouts.
+   if (heap.size() > 2 * timers.size() + 64)
+   {
+      heap.erase(std::remove_if(std::begin(heap), std::end(heap),
+               [this](const Entry &entry) { return !timers.count(entry.id); }),
+            std::end(heap));
+      std::make_heap(std::begin(heap), std::end(heap), std::greater<Entry>());
+   }
+   arm();
+}
+
+void Timers::push(std::int64_t deadline, std::uint64_t id)
+{
+   heap.push_back({deadline, id});
+   std::push_heap(std::begin(heap), std::end(heap), std::greater<Entry>());
+}
+
+void Timers::arm()
+{
+   while (!heap.empty() && !timers.count(heap.front().id))
+   {
+      std::pop_heap(std::begin(heap), std::end(heap), std::greater<Entry>());
+      heap.pop_back();
+   }
+
+   // An absolute deadline of zero would disarm the timer.
+   std::int64_t deadline = heap.empty() ? 0 : std::max<std::int64_t>(heap.front().deadline, 1);
+   if (deadline == armed)
+      return;
+   armed = deadline;
+
+   struct itimerspec spec{};
+   spec.it_value.tv_sec = deadline / 1000000000;
+   spec.it_value.tv_nsec = deadline % 1000000000;
+   EventHandler::count_syscalls();
+   timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, nullptr);
+}
+
+EventHandled::PollList Timers::pollfds() const
+{
+   return {{fd, EPOLLIN}};
+}
+
+void Timers::handle(EventHandler &)
+{
+   std::uint64_t expirations;
+   EventHandler::count_syscalls();
+   if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+      return;
+   armed = 0;
+
+   std::int64_t now = monotonic_ns();
+   while (!heap.empty() && heap.front().deadline <= now)
+   {
+      auto entry = heap.front();
+      std::pop_heap(std::begin(heap), std::end(heap), std::greater<Entry>());
+      heap.pop_back();
+
+      auto itr = timers.find(entry.id);
+      if (itr == std::end(timers))
+         continue;
+
+      // The task may add or cancel timers, itself included.
+      Task task = itr->second.task;
+      if (itr->second.period > 0)
+      {
+         // Ticks missed while the loop was busy are skipped, not replayed.
+         std::int64_t next = entry.deadline + itr->second.period;
+         push(next > now ? next : now + itr->second.period, entry.id);
+      }
+      else
+         timers.erase(itr);
+
+      task();
+   }
+
+   arm();
+}
+
+TaskQueue::TaskQueue() : tail(&stub), signalled(false)
+{
+   fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (fd < 0)
+      throw std::runtime_error("Failed to create eventfd.\n");
+
+   stub.next = nullptr;
+   head = &stub;
+}
+
+TaskQueue::~TaskQueue()
+{
+   while (Node *node = pop())
+      delete node;
+   close(fd);
+}
+
+void TaskQueue::post(Task task)
+{
+   Node *node = new Node;
+   node->task = std::move(task);
+   push(node);
+
+   if (!signalled.exchange(true))
+      eventfd_write(fd, 1);
+}
+
+void TaskQueue::push(Node *node)
+{
+   node->next.store(nullptr, std::memory_order_relaxed);
+   Node *prev = head.exchange(node, std::memory_order_acq_rel);
+   prev->next.store(node, std::memory_order_release);
+}
+
+TaskQueue::Node *TaskQueue::pop()
+{
+   Node *first = tail;
+   Node *next = first->next.load(std::memory_order_acquire);
+
+   if (first == &stub)
+   {
+      if (!next)
+         return nullptr;
+      tail = next;
+      first = next;
+      next = next->next.load(std::memory_order_acquire);
+   }
+
+   if (next)
+   {
+      tail = next;
+      return first;
+   }
+
+   // A producer is between swapping head and linking its node, it signals after.
+   if (first != head.load(std::memory_order_acquire))
+      return nullptr;
+
+   push(&stub);
+   next = first->next.load(std::memory_order_acquire);
+   if (next)
+   {
+      tail = next;
+      return first;
+   }
+   return nullptr;
+}
+
+EventHandled::PollList TaskQueue::pollfds() const
+{
+   return {{fd, EPOLLIN}};
+}
+
+void TaskQueue::handle(EventHandler &)
+{
+   eventfd_t val;
+   EventHandler::count_syscalls();
+   eventfd_read(fd, &val);
+
+   // Posts from here on write the eventfd again.
+   signalled.store(false);
+
+   while (Node *node = pop())
+   {
+      Task task = std::move(node->task);
+      delete node;
+      task();
+   }
+}
+
@@ -0,0 +1,95 @@
+#ifndef TIMERS_HPP__
+#define TIMERS_HPP__
+
+#include "eventhandler.hpp"
+
+#include <functional>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <cstdint>
+
+// Every timer on the loop shares one timerfd, armed for the earliest deadline
+// in a heap. Cancelled timers stay in the heap until they come up or the heap
+// is compacted, so rearming a timeout on every request stays cheap.
+class Timers : public EventHandled
+{
+   public:
+      typedef std::function<void ()> Task;
+
+      Timers();
+      ~Timers();
+      void operator=(const Timers &) = delete;
+
+      std::uint64_t add(std::int64_t delay_ns, std::int64_t period_ns, Task task);
+      void cancel(std::uint64_t id);
+      std::size_t size() const { return timers.size(); }
+
+      EventHandled::PollList pollfds() const;
+      void handle(EventHandler &handler);
+
+   private:
+      struct Entry
+      {
+         std::int64_t deadline;
+         std::uint64_t id;
+
+         bool operator>(const Entry &other) const
+         {
+            return deadline > other.deadline;
+         }
+      };
+
+      struct Timer
+      {
+         std::int64_t period;
+         Task task;
+      };
+
+      int fd;
+      std::uint64_t next_id;
+      std::int64_t armed;
+      std::vector<Entry> heap;
+      std::map<std::uint64_t, Timer> timers;
+
+      void push(std::int64_t deadline, std::uint64_t id);
+      void arm();
+};
+
+// Closures handed to the loop from any thread, run on the loop thread.
+// Producers push onto an intrusive lock-free list (Vyukov's MPSC queue) and
+// only the first post after the loop drained it writes the eventfd.
+// The loop side takes no lock at all.
+class TaskQueue : public EventHandled
+{
+   public:
+      typedef std::function<void ()> Task;
+
+      TaskQueue();
+      ~TaskQueue();
+      void operator=(const TaskQueue &) = delete;
+
+      void post(Task task);
+
+      EventHandled::PollList pollfds() const;
+      void handle(EventHandler &handler);
+
+   private:
+      struct Node
+      {
+         std::atomic<Node*> next;
+         Task task;
+      };
+
+      int fd;
+      std::atomic<Node*> head;
+      Node *tail;
+      Node stub;
+      std::atomic<bool> signalled;
+
+      void push(Node *node);
+      Node *pop();
+};
+
+#endif
+
@@ -0,0 +1,193 @@
+#include "trace.hpp"
+#include "allocstats.hpp"
+#include "config.hpp"
+
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <map>
+#include <iomanip>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+std::atomic<bool> Trace::on(false);
+
+namespace
+{
+   struct Event
+   {
+      const char *name;
+      std::int64_t start, end;
+      // A ring outlives its threads, spans keep who recorded them.
+      long tid;
+   };
+
+   // Only the thread holding a ring writes it, stop() reads it once recording is off.
+   struct Ring
+   {
+      Ring(std::size_t size) : events(size), head(0), in_use(false), owner(0) {}
+
+      std::vector<Event> events;
+      std::atomic<std::size_t> head;
+      bool in_use;
+      long owner;
+   };
+
+   std::mutex lock;
+   // Rings of exited threads are reused, so there are only ever as many as threads at once.
+   std::vector<std::unique_ptr<Ring>> rings;
+   std::map<long, std::string> thread_names;
+   std::int64_t origin;
+
+   struct Local
+   {
+      Ring *ring = nullptr;
+      long tid = 0;
+      bool prepared = false;
+
+      ~Local()
+      {
+         if (!ring)
+            return;
+
+         std::lock_guard<std::mutex> hold(lock);
+         ring->in_use = false;
+      }
+   };
+   thread_local Local local;
+
+   void claim()
+   {
+      std::lock_guard<std::mutex> hold(lock);
+      for (auto &ring : rings)
+      {
+         if (!ring->in_use)
+         {
+            local.ring = ring.get();
+            break;
+         }
+      }
+
+      if (!local.ring)
+      {
+         AllocStats::Scope uncounted(false);
+         rings.emplace_back(new Ring(std::max(config().get_int("trace_events", 65536), 1)));
+         local.ring = rings.back().get();
+      }
+
+      local.tid = syscall(SYS_gettid);
+      local.ring->in_use = true;
+      local.ring->owner = local.tid;
+
+      char thread_name[16] = {};
+      pthread_getname_np(pthread_self(), thread_name, sizeof(thread_name));
+      thread_names[local.tid] = thread_name;
+   }
+
+   void write_string(std::ostream &out, const char *str)
+   {
+      out << '"';
+      for (; *str; str++)
+      {
+         if (*str == '"' || *str == '\\')
+            out << '\\';
+         out << *str;
+      }
+      out << '"';
+   }
+}
+
+void Trace::start()
+{
+   std::lock_guard<std::mutex> hold(lock);
+   on = false;
+
+   // Only threads still holding a ring can show up in the new trace.
+   std::map<long, std::string> live;
+   for (auto &ring : rings)
+   {
+      ring->head = 0;
+      if (ring->in_use)
+         live[ring->owner] = thread_names[ring->owner];
+   }
+   thread_names.swap(live);
+
+   origin = monotonic_ns();
+   on = true;
+}
+
+void Trace::prepare_thread()
+{
+   local.prepared = true;
+   if (active() && !local.ring)
+      claim();
+}
+
+void Trace::record(const char *name, std::int64_t start, std::int64_t end)
+{
+   if (!local.ring)
+   {
+      if (local.prepared)
+         return;
+      claim();
+   }
+
+   auto ring = local.ring;
+   auto head = ring->head.load(std::memory_order_relaxed);
+   ring->events[head % ring->events.size()] = {name, start, end, local.tid};
+   ring->head.store(head + 1, std::memory_order_release);
+}
+
+std::size_t Trace::stop(const std::string &path)
+{
+   std::lock_guard<std::mutex> hold(lock);
+   on = false;
+
+   std::ofstream out(path);
+   if (!out)
+      throw std::runtime_error(stringify("Failed to open ", path, ".\n"));
+
+   out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[\n";
+
+   // Complete events in microseconds since start(), a wrapped ring keeps the newest.
+   int pid = getpid();
+   out << "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":" << pid
+      << ",\"args\":{\"name\":\"umusd\"}}";
+
+   for (auto &entry : thread_names)
+   {
+      out << ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" << pid
+         << ",\"tid\":" << entry.first << ",\"args\":{\"name\":";
+      write_string(out, entry.second.empty() ? "thread" : entry.second.c_str());
+      out << "}}";
+   }
+
+   std::size_t count = 0;
+   for (auto &ring : rings)
+   {
+      std::size_t head = ring->head.load(std::memory_order_acquire);
+      std::size_t size = std::min(head, ring->events.size());
+
+      for (std::size_t i = head - size; i < head; i++)
+      {
+         auto &event = ring->events[i % ring->events.size()];
+         if (event.start < origin)
+            continue;
+
+         out << ",\n{\"ph\":\"X\",\"name\":";
+         write_string(out, event.name);
+         out << ",\"pid\":" << pid << ",\"tid\":" << event.tid
+            << ",\"ts\":" << (event.start - origin) / 1000.0
+            << ",\"dur\":" << (event.end - event.start) / 1000.0 << "}";
+         count++;
+      }
+   }
+
+   out << "\n]}\n";
+   return count;
+}
+
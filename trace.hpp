@@ -0,0 +1,56 @@
+#ifndef TRACE_HPP__
+#define TRACE_HPP__
+
+#include "utils.hpp"
+
+#include <string>
+#include <atomic>
+#include <cstdint>
+
+// Timeline of spans for chasing glitches, written out as Chrome trace-event JSON.
+// Each thread records into a ring of its own, claimed with its first span and
+// handed on to a later thread once it exits. After that recording takes no lock
+// and no allocation. Disabled, a span costs a single relaxed load.
+class Trace
+{
+   public:
+      static void start();
+      // Writes everything recorded to path, returns the number of spans.
+      static std::size_t stop(const std::string &path);
+
+      static bool active() { return on.load(std::memory_order_relaxed); }
+
+      // First thing on threads which must not allocate or lock later on. Claims a
+      // ring now if tracing is on, otherwise the thread records nothing until it
+      // is started again.
+      static void prepare_thread();
+
+      // Name must outlive the trace, string literals or other static storage.
+      static void record(const char *name, std::int64_t start, std::int64_t end);
+
+      class Span
+      {
+         public:
+            explicit Span(const char *name)
+               : name(name), begin(active() ? monotonic_ns() : 0)
+            {}
+
+            ~Span()
+            {
+               if (begin && active())
+                  record(name, begin, monotonic_ns());
+            }
+
+            void operator=(const Span &) = delete;
+
+         private:
+            const char *name;
+            std::int64_t begin;
+      };
+
+   private:
+      static std::atomic<bool> on;
+};
+
+#endif
+
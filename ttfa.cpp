@@ -0,0 +1,120 @@
+#include "ttfa.hpp"
+#include "utils.hpp"
+
+#include <atomic>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+namespace
+{
+   std::atomic<std::int64_t> stages[TTFA::StageCount];
+   std::atomic<bool> armed(false);
+
+   std::int64_t pending_received = 0;
+   std::string key;
+
+   std::int64_t last[TTFA::StageCount];
+   std::string last_key;
+   std::map<std::string, std::vector<float>> history;
+
+   enum { max_history = 1000 };
+
+   const char *names[TTFA::StageCount] = {
+      "received", "parsed", "queued", "opened", "probed",
+      "codec", "device", "decode", "write",
+   };
+
+   // Files a completed timeline, the output thread only ever sets stages.
+   void fold()
+   {
+      if (!armed || !stages[TTFA::FirstWrite].load())
+         return;
+
+      armed = false;
+      for (unsigned i = 0; i < TTFA::StageCount; i++)
+         last[i] = stages[i].load();
+      last_key = key;
+
+      auto &list = history[key];
+      if (list.size() >= max_history)
+         list.erase(list.begin());
+      list.push_back((last[TTFA::FirstWrite] - last[TTFA::Received]) / 1000000.0f);
+   }
+
+   float percentile(std::vector<float> sorted, float p)
+   {
+      std::sort(std::begin(sorted), std::end(sorted));
+      return sorted[std::min<std::size_t>(sorted.size() * p, sorted.size() - 1)];
+   }
+}
+
+void TTFA::received()
+{
+   pending_received = monotonic_ns();
+}
+
+void TTFA::begin(const std::string &command)
+{
+   fold();
+
+   armed = false;
+   for (auto &stage : stages)
+      stage = 0;
+
+   std::int64_t now = monotonic_ns();
+   stages[Received] = pending_received ? pending_received : now;
+   stages[Parsed] = now;
+   pending_received = 0;
+
+   key = command;
+   armed = true;
+}
+
+void TTFA::media(const std::string &name)
+{
+   if (armed)
+      key = stringify(key.substr(0, key.find(' ')), " ", name);
+}
+
+void TTFA::mark(Stage stage)
+{
+   if (armed.load(std::memory_order_relaxed) && !stages[stage].load(std::memory_order_relaxed))
+      mark(stage, monotonic_ns());
+}
+
+void TTFA::mark(Stage stage, std::int64_t ns)
+{
+   std::int64_t unset = 0;
+   if (armed)
+      stages[stage].compare_exchange_strong(unset, ns);
+}
+
+std::string TTFA::report()
+{
+   fold();
+
+   std::vector<std::string> lines;
+   if (!last_key.empty())
+   {
+      std::string line = stringify("last ", last_key);
+      for (unsigned i = 1; i < StageCount; i++)
+      {
+         if (last[i])
+            line += stringify(" ", names[i], "=", (last[i] - last[Received]) / 1000000.0f);
+      }
+      lines.push_back(line);
+   }
+
+   for (auto &entry : history)
+   {
+      auto &list = entry.second;
+      lines.push_back(stringify(entry.first, " n=", list.size(),
+               " p50=", percentile(list, 0.5f),
+               " p90=", percentile(list, 0.9f),
+               " max=", *std::max_element(std::begin(list), std::end(list))));
+   }
+
+   return string_join(lines, "\n");
+}
+
@@ -0,0 +1,43 @@
+#ifndef TTFA_HPP__
+#define TTFA_HPP__
+
+#include <string>
+#include <cstdint>
+
+// Time to first audio: stage timestamps of each playback start, from a
+// command arriving on a socket to the first frames handed to snd_pcm_writei().
+// Everything but mark() is called from the event loop only.
+class TTFA
+{
+   public:
+      enum Stage
+      {
+         Received,
+         Parsed,
+         Queued,
+         Opened,
+         Probed,
+         CodecOpened,
+         DeviceInit,
+         FirstDecode,
+         FirstWrite,
+         StageCount
+      };
+
+      // A command came in, it might start playback.
+      static void received();
+      // The command starts playback, begin a new timeline.
+      static void begin(const std::string &command);
+      // Container and codec the timeline is filed under.
+      static void media(const std::string &name);
+
+      // First time a stage is reached, safe from any thread.
+      static void mark(Stage stage);
+      static void mark(Stage stage, std::int64_t ns);
+
+      // The latest timeline, then the distribution per command and media.
+      static std::string report();
+};
+
+#endif
+
@@ -0,0 +1,466 @@
+#include "uring.hpp"
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <stdexcept>
+#include <algorithm>
+
+namespace
+{
+   int setup(unsigned entries, io_uring_params &params)
+   {
+      // Only the loop thread submits, which lets the kernel skip some locking.
+      params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+      int fd = syscall(__NR_io_uring_setup, entries, &params);
+      if (fd < 0 && errno == EINVAL)
+      {
+         memset(&params, 0, sizeof(params));
+         fd = syscall(__NR_io_uring_setup, entries, &params);
+      }
+      return fd;
+   }
+
+   template<typename T>
+   T *offset(void *base, unsigned off)
+   {
+      return reinterpret_cast<T*>(static_cast<char*>(base) + off);
+   }
+}
+
+Uring::Uring(unsigned entries)
+   : sq_ptr(MAP_FAILED), cq_ptr(MAP_FAILED), sqes(nullptr),
+   local_tail(0), queued(0), buf_ring(nullptr), buf_ring_size(0), buf_tail(0),
+   multishot(true), next_id(1)
+{
+   io_uring_params params{};
+   ring_fd = setup(entries, params);
+   if (ring_fd < 0)
+      throw std::runtime_error("Failed to set up io_uring.\n");
+
+   if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+   {
+      close(ring_fd);
+      throw std::runtime_error("io_uring is too old.\n");
+   }
+
+   sq_entries = params.sq_entries;
+   cq_entries = params.cq_entries;
+   sq_size = params.sq_off.array + sq_entries * sizeof(unsigned);
+   cq_size = params.cq_off.cqes + cq_entries * sizeof(io_uring_cqe);
+   sq_size = cq_size = std::max(sq_size, cq_size);
+   sqes_size = sq_entries * sizeof(io_uring_sqe);
+
+   sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE,
+         MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+   void *sqes_ptr = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+         MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+   if (sq_ptr == MAP_FAILED || sqes_ptr == MAP_FAILED)
+   {
+      if (sq_ptr != MAP_FAILED)
+         munmap(sq_ptr, sq_size);
+      close(ring_fd);
+      throw std::runtime_error("Failed to map io_uring.\n");
+   }
+   cq_ptr = sq_ptr;
+   sqes = static_cast<io_uring_sqe*>(sqes_ptr);
+
+   sq_head = offset<unsigned>(sq_ptr, params.sq_off.head);
+   sq_tail = offset<unsigned>(sq_ptr, params.sq_off.tail);
+   sq_mask = offset<unsigned>(sq_ptr, params.sq_off.ring_mask);
+   sq_array = offset<unsigned>(sq_ptr, params.sq_off.array);
+   cq_head = offset<unsigned>(cq_ptr, params.cq_off.head);
+   cq_tail = offset<unsigned>(cq_ptr, params.cq_off.tail);
+   cq_mask = offset<unsigned>(cq_ptr, params.cq_off.ring_mask);
+   cqes = offset<io_uring_cqe>(cq_ptr, params.cq_off.cqes);
+   local_tail = *sq_tail;
+
+   // Received data lands in a shared pool of buffers the kernel picks from,
+   // so idle connections don't each pin a buffer.
+   buf_ring_size = buffer_count * sizeof(io_uring_buf);
+   void *ring = mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE,
+         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (ring == MAP_FAILED)
+      return;
+
+   io_uring_buf_reg reg{};
+   reg.ring_addr = reinterpret_cast<std::uintptr_t>(ring);
+   reg.ring_entries = buffer_count;
+   reg.bgid = buffer_group;
+   if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+   {
+      munmap(ring, buf_ring_size);
+      return;
+   }
+
+   // Indexed by hand, the header's flexible array is off by one byte in C++.
+   buf_ring = static_cast<io_uring_buf*>(ring);
+   buffers.resize(buffer_count * buffer_size);
+   for (unsigned i = 0; i < buffer_count; i++)
+      recycle(i);
+}
+
+Uring::~Uring()
+{
+   close(ring_fd);
+   munmap(sqes, sqes_size);
+   munmap(sq_ptr, sq_size);
+   if (buf_ring)
+      munmap(buf_ring, buf_ring_size);
+}
+
+io_uring_sqe *Uring::get_sqe()
+{
+   if (local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+      submit(0);
+
+   unsigned index = local_tail & *sq_mask;
+   io_uring_sqe *sqe = &sqes[index];
+   memset(sqe, 0, sizeof(*sqe));
+   sq_array[index] = index;
+   local_tail++;
+   queued++;
+   return sqe;
+}
+
+void Uring::submit(unsigned wait_nr)
+{
+   __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+
+   EventHandler::count_syscalls();
+   int ret = syscall(__NR_io_uring_enter, ring_fd, queued, wait_nr,
+         wait_nr ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+   if (ret < 0)
+   {
+      // Interrupted or the completion queue is full, reaping sorts both out.
+      if (errno == EINTR || errno == EBUSY || errno == EAGAIN)
+         return;
+      throw std::runtime_error("io_uring_enter() failed.\n");
+   }
+
+   queued -= std::min(queued, static_cast<unsigned>(ret));
+}
+
+void Uring::recycle(unsigned short bid)
+{
+   io_uring_buf &buf = buf_ring[buf_tail & (buffer_count - 1)];
+   buf.addr = reinterpret_cast<std::uintptr_t>(&buffers[bid * buffer_size]);
+   buf.len = buffer_size;
+   buf.bid = bid;
+   buf_tail++;
+   // The ring tail overlays the reserved field of the first entry.
+   __atomic_store_n(&buf_ring[0].resv, buf_tail, __ATOMIC_RELEASE);
+}
+
+void Uring::add(int fd, unsigned events)
+{
+   Poll &poll = polls[fd];
+   poll.events = events;
+   poll.armed = 0;
+   arm_poll(fd, poll);
+}
+
+void Uring::remove(int fd)
+{
+   auto itr = polls.find(fd);
+   if (itr == std::end(polls))
+      return;
+
+   if (itr->second.armed)
+   {
+      io_uring_sqe *sqe = get_sqe();
+      sqe->opcode = IORING_OP_POLL_REMOVE;
+      sqe->fd = -1;
+      sqe->addr = itr->second.armed;
+      ops.erase(itr->second.armed);
+   }
+   polls.erase(itr);
+}
+
+void Uring::arm_poll(int fd, Poll &poll)
+{
+   std::uint64_t id = next_id++;
+   Op &op = ops[id];
+   op.kind = Kind::Poll;
+   op.fd = fd;
+   poll.armed = id;
+
+   io_uring_sqe *sqe = get_sqe();
+   sqe->opcode = IORING_OP_POLL_ADD;
+   sqe->fd = fd;
+   sqe->poll32_events = poll.events;
+   sqe->user_data = id;
+}
+
+bool Uring::accept(int fd, AcceptCallback callback)
+{
+   if (!buf_ring)
+      return false;
+
+   std::uint64_t id = next_id++;
+   Op &op = ops[id];
+   op.kind = Kind::Accept;
+   op.fd = fd;
+   op.accept = std::move(callback);
+   arm_accept(id);
+   return true;
+}
+
+void Uring::arm_accept(std::uint64_t id)
+{
+   io_uring_sqe *sqe = get_sqe();
+   sqe->opcode = IORING_OP_ACCEPT;
+   sqe->fd = ops[id].fd;
+   sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+   sqe->ioprio = multishot ? IORING_ACCEPT_MULTISHOT : 0;
+   sqe->user_data = id;
+}
+
+bool Uring::recv(int fd, RecvCallback callback)
+{
+   if (!buf_ring)
+      return false;
+
+   std::uint64_t id = next_id++;
+   Op &op = ops[id];
+   op.kind = Kind::Recv;
+   op.fd = fd;
+   op.recv = std::move(callback);
+   arm_recv(id);
+   return true;
+}
+
+void Uring::arm_recv(std::uint64_t id)
+{
+   io_uring_sqe *sqe = get_sqe();
+   sqe->opcode = IORING_OP_RECV;
+   sqe->fd = ops[id].fd;
+   sqe->flags = IOSQE_BUFFER_SELECT;
+   sqe->buf_group = buffer_group;
+   sqe->ioprio = multishot ? IORING_RECV_MULTISHOT : 0;
+   sqe->user_data = id;
+}
+
+void Uring::send(int fd, std::string &&data, SendCallback callback)
+{
+   std::uint64_t id = next_id++;
+   Op &op = ops[id];
+   op.kind = Kind::Send;
+   op.fd = fd;
+   op.send = std::move(callback);
+   op.data = std::move(data);
+   op.offset = 0;
+   arm_send(id);
+}
+
+void Uring::arm_send(std::uint64_t id)
+{
+   Op &op = ops[id];
+
+   io_uring_sqe *sqe = get_sqe();
+   sqe->opcode = IORING_OP_SEND;
+   sqe->fd = op.fd;
+   sqe->addr = reinterpret_cast<std::uintptr_t>(op.data.data() + op.offset);
+   sqe->len = op.data.size() - op.offset;
+   sqe->msg_flags = MSG_NOSIGNAL;
+   sqe->user_data = id;
+}
+
+void Uring::cancel(int fd)
+{
+   for (auto itr = std::begin(ops); itr != std::end(ops); )
+   {
+      if (itr->second.fd != fd || itr->second.kind == Kind::Poll)
+      {
+         ++itr;
+         continue;
+      }
+
+      io_uring_sqe *sqe = get_sqe();
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = -1;
+      sqe->addr = itr->first;
+
+      // The kernel may still read from a send's buffer until it completes.
+      if (itr->second.kind == Kind::Send)
+      {
+         itr->second.fd = -1;
+         itr->second.send = nullptr;
+         ++itr;
+      }
+      else
+         itr = ops.erase(itr);
+   }
+}
+
+void Uring::wait(std::vector<int> &ready)
+{
+   // Polls are one-shot, arm them again now that their handlers ran.
+   for (auto fd : fired)
+   {
+      auto itr = polls.find(fd);
+      if (itr != std::end(polls) && !itr->second.armed)
+         arm_poll(fd, itr->second);
+   }
+   fired.clear();
+
+   bool pending = *cq_head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+   if (!pending || queued)
+      submit(pending ? 0 : 1);
+
+   reap(ready);
+}
+
+void Uring::reap(std::vector<int> &ready)
+{
+   unsigned head = *cq_head;
+   unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+   for (; head != tail; head++)
+   {
+      const io_uring_cqe &cqe = cqes[head & *cq_mask];
+
+      auto itr = ops.find(cqe.user_data);
+      if (itr == std::end(ops))
+      {
+         // Late completion of something cancelled, hand back its buffer.
+         if (cqe.flags & IORING_CQE_F_BUFFER)
+            recycle(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+         continue;
+      }
+
+      if (itr->second.kind == Kind::Poll)
+      {
+         int fd = itr->second.fd;
+         ops.erase(itr);
+
+         auto poll = polls.find(fd);
+         if (poll != std::end(polls) && poll->second.armed == cqe.user_data)
+         {
+            // A failed poll means a dead fd, it stays quiet until removed.
+            poll->second.armed = 0;
+            if (cqe.res >= 0)
+            {
+               ready.push_back(fd);
+               fired.push_back(fd);
+            }
+         }
+      }
+      else
+         done.push_back({cqe.user_data, cqe.res, cqe.flags});
+   }
+
+   __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+void Uring::complete()
+{
+   std::vector<Completion> finished;
+   finished.swap(done);
+
+   for (auto &c : finished)
+   {
+      bool has_buffer = c.flags & IORING_CQE_F_BUFFER;
+      unsigned short bid = c.flags >> IORING_CQE_BUFFER_SHIFT;
+      bool more = c.flags & IORING_CQE_F_MORE;
+
+      // Callbacks may cancel anything, so look the op up again each time.
+      auto itr = ops.find(c.id);
+      if (itr == std::end(ops))
+      {
+         if (has_buffer)
+            recycle(bid);
+         continue;
+      }
+
+      Op &op = itr->second;
+      switch (op.kind)
+      {
+         case Kind::Accept:
+         {
+            // Multishot accept and recv came with 5.19 and 6.0, fall back to one-shot.
+            if (c.res == -EINVAL && multishot)
+            {
+               multishot = false;
+               arm_accept(c.id);
+               break;
+            }
+
+            auto callback = op.accept;
+            if (c.res >= 0 || c.res == -EINTR || c.res == -ECONNABORTED)
+            {
+               if (c.res >= 0)
+                  callback(c.res);
+               if (!more && ops.count(c.id))
+                  arm_accept(c.id);
+            }
+            else
+            {
+               ops.erase(itr);
+               callback(c.res);
+            }
+            break;
+         }
+
+         case Kind::Recv:
+         {
+            if (c.res == -EINVAL && multishot)
+            {
+               multishot = false;
+               arm_recv(c.id);
+               break;
+            }
+
+            auto callback = op.recv;
+            if (c.res > 0 && has_buffer)
+            {
+               callback(c.res, &buffers[bid * buffer_size]);
+               recycle(bid);
+               if (!more && ops.count(c.id))
+                  arm_recv(c.id);
+            }
+            else if (c.res == -ENOBUFS)
+            {
+               // Every buffer was taken, they are back in the ring by now.
+               if (!more)
+                  arm_recv(c.id);
+            }
+            else
+            {
+               if (has_buffer)
+                  recycle(bid);
+               ops.erase(itr);
+               callback(c.res, nullptr);
+            }
+            break;
+         }
+
+         case Kind::Send:
+         {
+            if (c.res > 0)
+               op.offset += c.res;
+
+            if (op.fd >= 0 && c.res > 0 && op.offset < op.data.size())
+            {
+               arm_send(c.id);
+               break;
+            }
+
+            bool ok = op.fd >= 0 && op.offset == op.data.size();
+            auto callback = std::move(op.send);
+            ops.erase(itr);
+            if (callback)
+               callback(ok);
+            break;
+         }
+
+         case Kind::Poll:
+            break;
+      }
+   }
+}
+
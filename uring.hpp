@@ -0,0 +1,121 @@
+#ifndef URING_HPP__
+#define URING_HPP__
+
+#include "eventhandler.hpp"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf;
+
+// io_uring event backend, on the raw kernel interface.
+// Readiness is emulated with one-shot polls that are armed again after the
+// handler ran, so handlers see the same level triggered behaviour as with epoll.
+// Sockets can instead use multishot accept, multishot recv into provided
+// buffers and sends. Everything queued during one loop iteration goes to the
+// kernel in a single io_uring_enter().
+class Uring : public Poller
+{
+   public:
+      explicit Uring(unsigned entries);
+      ~Uring();
+
+      void operator=(const Uring &) = delete;
+
+      void add(int fd, unsigned events);
+      void remove(int fd);
+      void wait(std::vector<int> &ready);
+      void complete();
+      const char *name() const { return "io_uring"; }
+
+      // New fd for each connection, a negative errno once accepting stops.
+      typedef std::function<void (int)> AcceptCallback;
+      // Bytes received, 0 on end of stream or a negative errno.
+      typedef std::function<void (int, const char *)> RecvCallback;
+      typedef std::function<void (bool)> SendCallback;
+
+      bool accept(int fd, AcceptCallback callback);
+      // False without provided buffer rings, kernels before 5.19.
+      bool recv(int fd, RecvCallback callback);
+      // One send per fd at a time, the caller keeps them in order.
+      void send(int fd, std::string &&data, SendCallback callback);
+      // Stops multishot operations on fd, their callbacks are not called again.
+      void cancel(int fd);
+
+   private:
+      int ring_fd;
+      unsigned sq_entries, cq_entries;
+      void *sq_ptr, *cq_ptr;
+      std::size_t sq_size, cq_size, sqes_size;
+
+      unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+      unsigned *cq_head, *cq_tail, *cq_mask;
+      io_uring_sqe *sqes;
+      io_uring_cqe *cqes;
+      unsigned local_tail, queued;
+
+      enum { buffer_group = 1, buffer_count = 64, buffer_size = 4096 };
+      io_uring_buf *buf_ring;
+      std::vector<char> buffers;
+      std::size_t buf_ring_size;
+      unsigned short buf_tail;
+      bool multishot;
+
+      enum class Kind
+      {
+         Poll,
+         Accept,
+         Recv,
+         Send
+      };
+
+      struct Op
+      {
+         Kind kind;
+         int fd;
+         AcceptCallback accept;
+         RecvCallback recv;
+         SendCallback send;
+         std::string data;
+         std::size_t offset;
+      };
+
+      std::uint64_t next_id;
+      std::map<std::uint64_t, Op> ops;
+
+      struct Poll
+      {
+         unsigned events;
+         // Op id of the armed poll, 0 while the handler has it.
+         std::uint64_t armed;
+      };
+      std::map<int, Poll> polls;
+      std::vector<int> fired;
+
+      struct Completion
+      {
+         std::uint64_t id;
+         int res;
+         unsigned flags;
+      };
+      std::vector<Completion> done;
+
+      io_uring_sqe *get_sqe();
+      void submit(unsigned wait_nr);
+      void reap(std::vector<int> &ready);
+      void recycle(unsigned short bid);
+
+      void arm_poll(int fd, Poll &poll);
+      void arm_accept(std::uint64_t id);
+      void arm_recv(std::uint64_t id);
+      void arm_send(std::uint64_t id);
+};
+
+#endif
+
@@ -5,7 +5,9 @@
 #include <string>
 #include <vector>
 #include <cstddef>
+#include <cstdint>
 #include <string.h>
+#include <time.h>
 
 template <class T>
 std::string stringify(T&& t)
@@ -51,5 +53,12 @@ inline std::string string_join(const std::vector<std::string> &list, const std::
    return res;
 }
 
+inline std::int64_t monotonic_ns()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
 #endif
 
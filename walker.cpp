@@ -0,0 +1,264 @@
+#include "walker.hpp"
+#include "config.hpp"
+#include "utils.hpp"
+#include "timers.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <set>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+
+// Layout the kernel fills in for getdents64(), glibc does not export it everywhere.
+struct Dirent64
+{
+   std::uint64_t d_ino;
+   std::int64_t d_off;
+   unsigned short d_reclen;
+   unsigned char d_type;
+   char d_name[1];
+};
+
+// Lists one directory, symlinked directories are skipped so loops cannot happen.
+static void list_dir(const std::string &dir,
+      std::vector<std::string> &dirs, std::vector<std::string> &files)
+{
+   int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+   if (fd < 0)
+      return;
+
+   char buf[32 * 1024];
+   for (;;)
+   {
+      long ret = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+      if (ret <= 0)
+         break;
+
+      for (long off = 0; off < ret; )
+      {
+         auto entry = reinterpret_cast<const Dirent64*>(buf + off);
+         off += entry->d_reclen;
+
+         const char *name = entry->d_name;
+         if (name[0] == '.')
+            continue;
+
+         unsigned type = entry->d_type;
+         if (type == DT_UNKNOWN || type == DT_LNK)
+         {
+            struct stat st;
+            if (fstatat(fd, name, &st, 0) < 0)
+               continue;
+
+            if (S_ISDIR(st.st_mode))
+               type = entry->d_type == DT_LNK ? DT_LNK : DT_DIR;
+            else if (S_ISREG(st.st_mode))
+               type = DT_REG;
+         }
+
+         if (type == DT_DIR)
+            dirs.push_back(stringify(dir, "/", name));
+         else if (type == DT_REG && Walker::is_audio(name))
+            files.push_back(stringify(dir, "/", name));
+      }
+   }
+
+   close(fd);
+}
+
+Walker::Walker(EventHandler &handler)
+   : tasks(handler.task_queue()), checks(std::make_shared<Checks>())
+{
+   checks->running = false;
+}
+
+Walker::~Walker()
+{
+   for (auto &job : running)
+      job->cancelled = true;
+}
+
+bool Walker::is_directory(const std::string &path)
+{
+   struct stat st;
+   return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+void Walker::check(const std::string &path, CheckCallback callback)
+{
+   std::lock_guard<std::mutex> hold(checks->lock);
+   checks->pending.push_back({path, callback});
+   if (checks->running)
+      return;
+   checks->running = true;
+
+   // One thread drains the queue, so a later check never overtakes an earlier one.
+   auto checks = this->checks;
+   auto tasks = this->tasks;
+   std::weak_ptr<Walker> self = shared_from_this();
+   std::thread([checks, tasks, self] {
+      for (;;)
+      {
+         std::pair<std::string, CheckCallback> next;
+         {
+            std::lock_guard<std::mutex> hold(checks->lock);
+            if (checks->pending.empty())
+            {
+               checks->running = false;
+               return;
+            }
+            next = std::move(checks->pending.front());
+            checks->pending.pop_front();
+         }
+
+         bool directory = is_directory(next.first);
+         auto callback = std::move(next.second);
+         tasks->post([self, callback, directory] {
+            if (self.lock())
+               callback(directory);
+         });
+      }
+   }).detach();
+}
+
+bool Walker::is_audio(const std::string &name)
+{
+   static const std::set<std::string> extensions = [] {
+      auto list = string_split(config().get("audio_extensions",
+               "flac,mp3,ogg,oga,opus,m4a,mp4,aac,wav,wv,ape,mpc,aif,aiff,wma,mka,tta,dsf"), ", ");
+      return std::set<std::string>(std::begin(list), std::end(list));
+   }();
+
+   auto dot = name.rfind('.');
+   if (dot == std::string::npos)
+      return false;
+
+   std::string ext = name.substr(dot + 1);
+   for (auto &c : ext)
+      if (c >= 'A' && c <= 'Z')
+         c = c - 'A' + 'a';
+   return extensions.count(ext);
+}
+
+void Walker::walk(Job &job, unsigned threads)
+{
+   std::mutex lock;
+   std::condition_variable cond;
+   std::vector<std::string> stack{job.dir};
+   unsigned active = 0;
+
+   // Directories are shared out one at a time, a thread quits once none are
+   // left and nobody is still listing one that could add more.
+   auto worker = [&]() {
+      std::vector<std::string> dirs, files;
+      for (;;)
+      {
+         std::string dir;
+         {
+            std::unique_lock<std::mutex> hold(lock);
+            cond.wait(hold, [&] { return !stack.empty() || !active || job.cancelled; });
+            if (stack.empty() || job.cancelled)
+               return;
+
+            dir = std::move(stack.back());
+            stack.pop_back();
+            active++;
+         }
+
+         int wd = -1;
+         if (job.watch_fd >= 0)
+            wd = inotify_add_watch(job.watch_fd, dir.c_str(), job.watch_mask);
+
+         dirs.clear();
+         files.clear();
+         list_dir(dir, dirs, files);
+
+         std::lock_guard<std::mutex> hold(lock);
+         if (wd >= 0)
+            job.watches.push_back({wd, dir});
+         job.dirs++;
+         stack.insert(std::end(stack), std::begin(dirs), std::end(dirs));
+         job.files.insert(std::end(job.files), std::begin(files), std::end(files));
+         active--;
+         cond.notify_all();
+      }
+   };
+
+   std::vector<std::thread> helpers;
+   for (unsigned i = 1; i < threads; i++)
+      helpers.push_back(std::thread(worker));
+   worker();
+   for (auto &thread : helpers)
+      thread.join();
+
+   std::sort(std::begin(job.files), std::end(job.files));
+}
+
+void Walker::scan(const std::string &dir, Callback callback)
+{
+   auto job = std::make_shared<Job>();
+   job->dir = dir;
+   job->callback = callback;
+   job->watch_fd = -1;
+   job->watch_mask = 0;
+   start(job);
+}
+
+void Walker::watch(const std::string &dir, int inotify_fd, std::uint32_t mask,
+      WatchCallback callback)
+{
+   auto job = std::make_shared<Job>();
+   job->dir = dir;
+   job->watch_fd = inotify_fd;
+   job->watch_mask = mask;
+   job->watch_callback = callback;
+   start(job);
+}
+
+void Walker::start(std::shared_ptr<Job> job)
+{
+   while (job->dir.size() > 1 && job->dir.back() == '/')
+      job->dir.pop_back();
+   job->cancelled = false;
+   job->dirs = 0;
+   job->elapsed = 0;
+   running.push_back(job);
+
+   unsigned threads = std::max(config().get_int("walk_threads", 4), 1);
+
+   auto tasks = this->tasks;
+   std::weak_ptr<Walker> self = shared_from_this();
+   std::thread([job, tasks, self, threads] {
+      std::int64_t start = monotonic_ns();
+      walk(*job, threads);
+      job->elapsed = monotonic_ns() - start;
+
+      tasks->post([job, self] {
+         if (auto walker = self.lock())
+            walker->finish(job);
+      });
+   }).detach();
+}
+
+void Walker::finish(const std::shared_ptr<Job> &job)
+{
+   running.erase(std::remove(std::begin(running), std::end(running), job), std::end(running));
+
+   std::cerr << "Scanned " << job->dir << ": " << job->files.size() << " files in "
+      << job->dirs << " directories, " << job->elapsed / 1000000 << " ms." << std::endl;
+
+   auto callback = std::move(job->callback);
+   auto watch_callback = std::move(job->watch_callback);
+   if (callback)
+      callback(std::move(job->files));
+   else if (watch_callback)
+      watch_callback(std::move(job->files), std::move(job->watches));
+}
+
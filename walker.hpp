@@ -0,0 +1,74 @@
+#ifndef WALKER_HPP__
+#define WALKER_HPP__
+
+#include "eventhandler.hpp"
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <deque>
+#include <utility>
+#include <cstdint>
+
+// Collects the audio files below a directory on a pool of threads and hands
+// the sorted list back on the event loop, so large shares never stall it.
+class Walker : public std::enable_shared_from_this<Walker>
+{
+   public:
+      typedef std::function<void (std::vector<std::string>)> Callback;
+      typedef std::vector<std::pair<int, std::string>> WatchList;
+      typedef std::function<void (std::vector<std::string>, WatchList)> WatchCallback;
+      typedef std::function<void (bool)> CheckCallback;
+
+      explicit Walker(EventHandler &handler);
+      ~Walker();
+      void operator=(const Walker &) = delete;
+
+      static bool is_directory(const std::string &path);
+      // is_directory() off the loop, answers come back in the order asked.
+      void check(const std::string &path, CheckCallback callback);
+      // By extension, audio_extensions in the config overrides the list.
+      static bool is_audio(const std::string &name);
+      void scan(const std::string &dir, Callback callback);
+      // Also puts an inotify watch on every directory it lists, before listing it.
+      void watch(const std::string &dir, int inotify_fd, std::uint32_t mask,
+            WatchCallback callback);
+
+   private:
+      struct Job
+      {
+         std::string dir;
+         std::atomic<bool> cancelled;
+         std::vector<std::string> files;
+         unsigned long dirs;
+         std::int64_t elapsed;
+         Callback callback;
+
+         int watch_fd;
+         std::uint32_t watch_mask;
+         WatchList watches;
+         WatchCallback watch_callback;
+      };
+
+      struct Checks
+      {
+         std::mutex lock;
+         std::deque<std::pair<std::string, CheckCallback>> pending;
+         bool running;
+      };
+
+      // Held by the walks, which may outlive the loop.
+      std::shared_ptr<TaskQueue> tasks;
+      std::vector<std::shared_ptr<Job>> running;
+      std::shared_ptr<Checks> checks;
+
+      void start(std::shared_ptr<Job> job);
+      void finish(const std::shared_ptr<Job> &job);
+      static void walk(Job &job, unsigned threads);
+};
+
+#endif
+
@@ -0,0 +1,220 @@
+#include "watcher.hpp"
+#include "config.hpp"
+#include "utils.hpp"
+
+#include <stdexcept>
+#include <iostream>
+#include <algorithm>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <errno.h>
+
+static const std::uint32_t watch_mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+   IN_CREATE | IN_DELETE | IN_ONLYDIR;
+
+Watcher::Watcher(Walker &walker, Analyzer &analyzer, Library &library)
+   : walker(walker), analyzer(analyzer), library(library), timer(0),
+   batch_start(0), last_event(0), rescan_pending(false),
+   events(0), overflows(0), rescans(0), reindexed(0), dropped(0),
+   started(monotonic_ns())
+{
+   inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+   if (inotify_fd < 0)
+      throw std::runtime_error("Failed to create inotify instance.\n");
+}
+
+Watcher::~Watcher()
+{
+   close(inotify_fd);
+}
+
+void Watcher::add_root(std::string dir)
+{
+   while (dir.size() > 1 && dir.back() == '/')
+      dir.pop_back();
+
+   if (std::find(std::begin(roots), std::end(roots), dir) != std::end(roots))
+      return;
+
+   roots.push_back(dir);
+   rescan(dir);
+}
+
+void Watcher::rescan(const std::string &dir)
+{
+   rescans++;
+
+   // The analyzer workers skip files whose mtime and size are still cached.
+   walker.watch(dir, inotify_fd, watch_mask,
+         [this, dir](std::vector<std::string> files, Walker::WatchList list) {
+            for (auto &watch : list)
+               watches[watch.first] = watch.second;
+
+            library.retain(dir, files);
+            analyzer.enqueue(files);
+         });
+}
+
+EventHandled::PollList Watcher::pollfds() const
+{
+   return {{inotify_fd, EPOLLIN}};
+}
+
+void Watcher::handle(EventHandler &handler)
+{
+   read_events(handler);
+}
+
+void Watcher::read_events(EventHandler &handler)
+{
+   alignas(struct inotify_event) char buf[16 * 1024];
+
+   for (;;)
+   {
+      ssize_t ret = read(inotify_fd, buf, sizeof(buf));
+      if (ret <= 0)
+         break;
+
+      for (ssize_t off = 0; off < ret; )
+      {
+         auto event = reinterpret_cast<const struct inotify_event*>(buf + off);
+         off += sizeof(struct inotify_event) + event->len;
+         events++;
+
+         if (event->mask & IN_Q_OVERFLOW)
+         {
+            overflows++;
+            rescan_pending = true;
+         }
+         else if (event->mask & IN_IGNORED)
+            watches.erase(event->wd);
+
+         if (!event->len || rescan_pending)
+            continue;
+
+         auto entry = std::make_pair(event->wd, std::string(event->name));
+         if (event->mask & IN_ISDIR)
+         {
+            if (event->mask & (IN_CREATE | IN_MOVED_TO))
+               new_dirs.insert(entry);
+            else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+               gone_dirs.insert(entry);
+         }
+         else if (!Walker::is_audio(entry.second))
+            continue;
+         else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+         {
+            removed.erase(entry);
+            changed.insert(entry);
+         }
+         else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+         {
+            changed.erase(entry);
+            removed.insert(entry);
+         }
+      }
+
+      last_event = monotonic_ns();
+      if (!batch_start)
+         batch_start = last_event;
+      arm(handler);
+   }
+}
+
+void Watcher::arm(EventHandler &handler)
+{
+   // Waits for the roots to go quiet, but a steady trickle still gets flushed.
+   unsigned debounce = std::max(config().get_int("watch_debounce_ms", 2000), 1);
+   unsigned delay = debounce;
+   if (last_event - batch_start > 5 * debounce * 1000000ll)
+      delay = 1;
+
+   if (timer)
+      handler.cancel_timer(timer);
+
+   std::weak_ptr<EventHandled> weak = shared_from_this();
+   timer = handler.add_timer(delay, [this, weak] {
+         if (!weak.lock())
+            return;
+         timer = 0;
+         flush();
+      });
+}
+
+void Watcher::flush()
+{
+   batch_start = 0;
+
+   if (rescan_pending)
+   {
+      std::cerr << "Watch queue overflowed, rescanning library." << std::endl;
+      rescan_pending = false;
+      changed.clear();
+      removed.clear();
+      new_dirs.clear();
+      gone_dirs.clear();
+
+      for (auto &root : roots)
+         rescan(root);
+      return;
+   }
+
+   auto resolve = [this](const std::pair<int, std::string> &entry, std::string &path) {
+      auto itr = watches.find(entry.first);
+      if (itr == std::end(watches))
+      {
+         dropped++;
+         return false;
+      }
+
+      path = itr->second + '/' + entry.second;
+      return true;
+   };
+
+   std::string path;
+   for (auto &entry : gone_dirs)
+      if (resolve(entry, path))
+         library.retain(path, std::vector<std::string>());
+
+   for (auto &entry : removed)
+      if (resolve(entry, path))
+         library.remove(path);
+
+   for (auto &entry : new_dirs)
+      if (resolve(entry, path))
+         rescan(path);
+
+   std::vector<std::string> files;
+   for (auto &entry : changed)
+      if (resolve(entry, path))
+         files.push_back(path);
+
+   reindexed += files.size();
+   analyzer.enqueue(files);
+
+   changed.clear();
+   removed.clear();
+   new_dirs.clear();
+   gone_dirs.clear();
+}
+
+std::string Watcher::stats() const
+{
+   std::int64_t now = monotonic_ns();
+   double minutes = (now - started) / 60e9;
+
+   // Stale is how long the oldest unhandled change has waited, backlog is what
+   // the analyzer still has to index.
+   return stringify("roots=", roots.size(),
+         " watches=", watches.size(),
+         " pending=", changed.size() + removed.size() + new_dirs.size() + gone_dirs.size(),
+         " stale_ms=", batch_start ? (now - batch_start) / 1000000 : 0,
+         " backlog=", analyzer.backlog(),
+         " events=", events,
+         " overflows=", overflows,
+         " rescans=", rescans,
+         " reindexed=", reindexed,
+         " reindex_per_min=", minutes > 0.0 ? reindexed / minutes : 0.0,
+         " unresolved=", dropped);
+}
+
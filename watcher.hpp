@@ -0,0 +1,60 @@
+#ifndef WATCHER_HPP__
+#define WATCHER_HPP__
+
+#include "eventhandler.hpp"
+#include "walker.hpp"
+#include "analysis.hpp"
+#include "library.hpp"
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <map>
+#include <set>
+#include <utility>
+#include <cstdint>
+
+// Keeps the library index current by watching its roots with inotify.
+// Changes are batched until the roots have been quiet for a moment, then only
+// the touched files are scanned again. A watch queue overflow, and every start,
+// falls back to walking the roots, where unchanged files are skipped by mtime.
+class Watcher : public EventHandled
+{
+   public:
+      Watcher(Walker &walker, Analyzer &analyzer, Library &library);
+      ~Watcher();
+      void operator=(const Watcher &) = delete;
+
+      void add_root(std::string dir);
+      std::string stats() const;
+
+      EventHandled::PollList pollfds() const;
+      void handle(EventHandler &handler);
+
+   private:
+      Walker &walker;
+      Analyzer &analyzer;
+      Library &library;
+
+      int inotify_fd;
+      std::uint64_t timer;
+      std::vector<std::string> roots;
+      std::map<int, std::string> watches;
+
+      // Names are resolved when the batch is flushed, a watch might still be
+      // on its way back from the walker when its first events arrive.
+      std::set<std::pair<int, std::string>> changed, removed, new_dirs, gone_dirs;
+      std::int64_t batch_start, last_event;
+      bool rescan_pending;
+
+      unsigned long events, overflows, rescans, reindexed, dropped;
+      std::int64_t started;
+
+      void read_events(EventHandler &handler);
+      void arm(EventHandler &handler);
+      void flush();
+      void rescan(const std::string &dir);
+};
+
+#endif
+
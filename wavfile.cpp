@@ -0,0 +1,138 @@
+#include "wavfile.hpp"
+#include "utils.hpp"
+
+#include <stdexcept>
+#include <limits>
+#include <fcntl.h>
+#include <unistd.h>
+
+WAVFile::WAVFile()
+   : fd(-1), data_size(0), segment(0), channels(0), rate(0),
+   fmt(FF::MediaInfo::Format::None)
+{}
+
+WAVFile::~WAVFile()
+{
+   stop();
+}
+
+std::string WAVFile::default_device() const
+{
+   return "umusd.wav";
+}
+
+bool WAVFile::active() const
+{
+   return fd >= 0;
+}
+
+EventHandled::PollList WAVFile::pollfds() const
+{
+   return {};
+}
+
+void WAVFile::init(unsigned channels, unsigned rate,
+      FF::MediaInfo::Format fmt,
+      const std::string &dev)
+{
+   // Gapless continuation, keep recording into the same file.
+   if (active() && dev == path &&
+         channels == this->channels && rate == this->rate && fmt == this->fmt)
+      return;
+
+   if (fmt == FF::MediaInfo::Format::None)
+      throw std::runtime_error("Unsupported sample format for WAV.\n");
+
+   // Reopening starts a new numbered segment rather than clobbering the recording.
+   segment = dev == path ? segment + 1 : 0;
+   stop();
+
+   path = dev;
+   this->channels = channels;
+   this->rate = rate;
+   this->fmt = fmt;
+
+   auto name = segment ? stringify(path, ".", segment) : path;
+   fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0)
+      throw std::runtime_error(stringify("Failed to open ", name, ".\n"));
+
+   data_size = 0;
+   write_header();
+}
+
+static inline void put_le(std::uint8_t *out, std::uint32_t val, unsigned bytes)
+{
+   for (unsigned i = 0; i < bytes; i++)
+      out[i] = (val >> (8 * i)) & 0xff;
+}
+
+void wav_header(std::uint8_t *header, unsigned channels, unsigned rate,
+      FF::MediaInfo::Format fmt, std::uint32_t data_size)
+{
+   FF::MediaInfo info{};
+   info.channels = channels;
+   info.fmt = fmt;
+   unsigned frame_size = info.frame_size();
+
+   memcpy(header + 0, "RIFF", 4);
+   put_le(header + 4, data_size > 0xffffffffu - 36 ? 0xffffffffu : 36 + data_size, 4);
+   memcpy(header + 8, "WAVEfmt ", 8);
+   put_le(header + 16, 16, 4);
+   put_le(header + 20, fmt == FF::MediaInfo::Format::Float ? 3 : 1, 2);
+   put_le(header + 22, channels, 2);
+   put_le(header + 24, rate, 4);
+   put_le(header + 28, rate * frame_size, 4);
+   put_le(header + 32, frame_size, 2);
+   put_le(header + 34, channels ? 8 * frame_size / channels : 0, 2);
+   memcpy(header + 36, "data", 4);
+   put_le(header + 40, data_size, 4);
+}
+
+void WAVFile::write_header()
+{
+   std::uint8_t header[wav_header_size];
+   wav_header(header, channels, rate, fmt, data_size);
+
+   if (pwrite(fd, header, sizeof(header), 0) != sizeof(header))
+      throw std::runtime_error("Failed to write WAV header.\n");
+}
+
+void WAVFile::write(const std::uint8_t *data, std::size_t size)
+{
+   if (fd < 0)
+      return;
+
+   if (size > std::numeric_limits<std::uint32_t>::max() - 36 - data_size)
+      throw std::runtime_error("WAV file is full.\n");
+
+   while (size)
+   {
+      ssize_t ret = ::write(fd, data, size);
+      if (ret <= 0)
+         throw std::runtime_error("Failed to write to WAV file.\n");
+
+      data += ret;
+      size -= ret;
+      data_size += ret;
+   }
+}
+
+void WAVFile::stop()
+{
+   if (fd >= 0)
+   {
+      try
+      {
+         write_header();
+      }
+      catch(...)
+      {}
+
+      close(fd);
+   }
+
+   fd = -1;
+   clear_queue();
+}
+
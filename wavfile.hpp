@@ -0,0 +1,42 @@
+#ifndef WAVFILE_HPP__
+#define WAVFILE_HPP__
+
+#include "audio.hpp"
+#include <cstdint>
+
+enum { wav_header_size = 44 };
+void wav_header(std::uint8_t *out, unsigned channels, unsigned rate,
+      FF::MediaInfo::Format fmt, std::uint32_t data_size);
+
+class WAVFile : public Audio
+{
+   public:
+      WAVFile();
+      ~WAVFile();
+
+      std::string default_device() const;
+      void init(unsigned channels, unsigned rate,
+            FF::MediaInfo::Format fmt,
+            const std::string &dev);
+
+      void write(const std::uint8_t *data, std::size_t size);
+      void stop();
+
+      bool active() const;
+
+      EventHandled::PollList pollfds() const;
+
+   private:
+      int fd;
+      std::uint32_t data_size;
+
+      std::string path;
+      unsigned segment;
+      unsigned channels, rate;
+      FF::MediaInfo::Format fmt;
+
+      void write_header();
+};
+
+#endif
+